@@ -9,8 +9,20 @@
 #define INODE_TABLE_SIZE (50)
 #define MAX_OPEN_FILES (20)
 #define MAX_FILE_NAME (40)
-#define MAX_DIRECT_BLOCKS (10)
+#define MAX_FILE_EXTENTS (12)
+
+/* Number of data blocks each thread may keep cached for allocation */
+#define BLOCK_MAGAZINE_SIZE (16)
 
 #define DELAY (5000)
 
+/* Number of times a busy lock is tried before blocking on it, and the most
+ * pauses between two tries (see spin_on_lock) */
+#define LOCK_SPINS (20)
+#define MAX_LOCK_SPIN_PAUSES (16)
+
+/* Number of times an allocation on a full volume tries to advance the epoch
+ * before giving up on the readers still inside it (see epoch_reclaim) */
+#define EPOCH_RECLAIM_ATTEMPTS (1000)
+
 #endif // CONFIG_H
@@ -1,11 +1,20 @@
 #include "operations.h"
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* Number of times a read tries to work on a snapshot of the i-node, before
+ * giving up and locking it (see _tfs_read_optimistic) */
+#define OPTIMISTIC_READ_ATTEMPTS (3)
+
 int tfs_init() {
-    state_init();
+    return tfs_init_with_lock_spins(LOCK_SPINS);
+}
+
+int tfs_init_with_lock_spins(unsigned lock_spins) {
+    state_init(lock_spins);
 
     /* create root inode */
     int root = inode_create(T_DIRECTORY);
@@ -37,6 +46,28 @@ int tfs_lookup(char const *name) {
     return find_in_dir(ROOT_DIR_INUM, name);
 }
 
+/*
+ * Creates a file in the root directory; the caller must hold the lock of
+ * the file's name (see get_dir_name_lock)
+ * Returns the file's i-number if successful, -1 otherwise
+ */
+static int _tfs_create(char const *name) {
+    int inum = inode_create(T_FILE);
+    if (inum == -1) {
+        return -1;
+    }
+    pthread_rwlock_t *inode_lock = get_inode_table_lock(inum);
+    write_lock_rwlock(inode_lock);
+    /* Add entry in the root directory */
+    if (add_dir_entry(ROOT_DIR_INUM, inum, name + 1) == -1) {
+        inode_delete(inum);
+        unlock_rwlock(inode_lock);
+        return -1;
+    }
+    unlock_rwlock(inode_lock);
+    return inum;
+}
+
 int tfs_open(char const *name, int flags) {
     int inum;
     size_t offset;
@@ -47,82 +78,82 @@ int tfs_open(char const *name, int flags) {
         return -1;
     }
 
-    lock_mutex(&open_file_lock); // prevents two files with the same name being created
+    /* Lookups don't lock the directory, so only files that don't exist yet
+     * need the lock of their name (which prevents two files with the same
+     * name being created) */
     inum = tfs_lookup(name);
-    if (inum >= 0) {
-        pthread_rwlock_t *inode_lock = get_inode_table_lock(inum);
-        write_lock_rwlock(inode_lock);
-        /* The file already exists */
-        inode_t *inode = inode_get(inum);
-        if (inode == NULL) {
-        	unlock_mutex(&open_file_lock);
-            unlock_rwlock(inode_lock);
-            return -1;
-        }
-        /* Trucate (if requested) */
-        if (flags & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                size_t written_blocks = inode->i_size / BLOCK_SIZE;
-                if (written_blocks % BLOCK_SIZE != 0) {
-                    written_blocks++;
-                }
-                size_t loop_limit = (written_blocks <= 10) ? written_blocks : 10;
-                for (int i = 0; i < loop_limit; i++) {
-                    
-                    if (data_block_free(inode->i_data_block[i]) == -1) {
-        				unlock_mutex(&open_file_lock);
-                        unlock_rwlock(inode_lock);
-                        return -1;
-                    }
-                    inode->i_data_block[i] = -1;
-                }
-                if (written_blocks >= MAX_DIRECT_BLOCKS) {
-                    if (data_block_free(inode->i_indirect_data_block) == -1) {
-        			    unlock_mutex(&open_file_lock);
-                        unlock_rwlock(inode_lock);
-                        return -1;
-                    }
-                    inode->i_indirect_data_block = -1;
-                }
-                inode->i_size = 0;
+    if (inum < 0 && (flags & TFS_O_CREAT)) {
+        pthread_mutex_t *name_lock = get_dir_name_lock(name + 1);
+        lock_mutex(name_lock);
+        inum = tfs_lookup(name);
+        if (inum < 0) {
+            /* The file doesn't exist; the flags specify that it should be
+             * created */
+            inum = _tfs_create(name);
+            unlock_mutex(name_lock);
+            if (inum == -1) {
+                return -1;
             }
+            return add_to_open_file_table(inum, 0, flags & TFS_O_APPEND);
         }
-        /* Determine initial offset */
-        if (flags & TFS_O_APPEND) {
-            offset = inode->i_size;
+        unlock_mutex(name_lock);
+    }
+    if (inum < 0) {
+        return -1;
+    }
+
+    /* Only truncating changes the i-node */
+    bool truncate = (flags & TFS_O_TRUNC) != 0;
+    pthread_rwlock_t *inode_lock = get_inode_table_lock(inum);
+    if (truncate) {
+        inode_write_lock(inum);
+    } else {
+        read_lock_rwlock(inode_lock);
+    }
+    /* The file already exists */
+    inode_t *inode = inode_get(inum);
+    if (inode == NULL) {
+        if (truncate) {
+            inode_write_unlock(inum);
         } else {
-            offset = 0;
-        }
-        unlock_mutex(&open_file_lock);
-        unlock_rwlock(inode_lock);
-    } else if (flags & TFS_O_CREAT) {
-        /* The file doesn't exist; the flags specify that it should be created */
-        inum = inode_create(T_FILE);
-        pthread_rwlock_t *inode_lock = get_inode_table_lock(inum);
-        if (inum == -1) {
-        	unlock_mutex(&open_file_lock);
-            return -1;
-        }
-        write_lock_rwlock(inode_lock);
-        /* Add entry in the root directory */
-        if (add_dir_entry(ROOT_DIR_INUM, inum, name + 1) == -1) {
-            inode_delete(inum);
-        	unlock_mutex(&open_file_lock);
             unlock_rwlock(inode_lock);
-            return -1;
         }
+        return -1;
+    }
+    /* Trucate (if requested) */
+    if (truncate) {
+        /* Seeking to the end only locks the map (see tfs_seek) */
+        pthread_rwlock_t *map_lock = get_inode_map_lock(inum);
+        write_lock_rwlock(map_lock);
+        if (inode->i_size > 0) {
+            if (inode_free_blocks(inode) == -1) {
+                unlock_rwlock(map_lock);
+                inode_write_unlock(inum);
+                return -1;
+            }
+            inode->i_size = 0;
+        }
+        unlock_rwlock(map_lock);
+    }
+    /* Determine initial offset */
+    if (flags & TFS_O_APPEND) {
+        /* Writes through other handles may be changing the size */
+        pthread_rwlock_t *map_lock = get_inode_map_lock(inum);
+        read_lock_rwlock(map_lock);
+        offset = inode->i_size;
+        unlock_rwlock(map_lock);
+    } else {
         offset = 0;
-        unlock_mutex(&open_file_lock);
-        unlock_rwlock(inode_lock);
+    }
+    if (truncate) {
+        inode_write_unlock(inum);
     } else {
-        unlock_mutex(&open_file_lock);
-        return -1;
+        unlock_rwlock(inode_lock);
     }
 
-
     /* Finally, add entry to the open file table and
      * return the corresponding handle */
-    return add_to_open_file_table(inum, offset);
+    return add_to_open_file_table(inum, offset, flags & TFS_O_APPEND);
 
     /* Note: for simplification, if file was created with TFS_O_CREAT and there
      * is an error adding an entry to the open file table, the file is not
@@ -132,225 +163,470 @@ int tfs_open(char const *name, int flags) {
 
 int tfs_close(int fhandle) { return remove_from_open_file_table(fhandle); }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
-        return -1;
+/*
+ * Writes to an i-node, starting at the given offset. The caller must hold the
+ * i-node's lock (at least for reading) and the written range of its range
+ * lock; the i-node's map lock is only taken (for writing) to allocate blocks
+ * and to update its size, so writes to disjoint ranges copy their contents
+ * in parallel
+ * Returns the number of bytes written, -1 in case of error
+ */
+static ssize_t _tfs_write_at(int inumber, inode_t *inode, void const *buffer,
+                             size_t to_write, size_t offset) {
+    pthread_rwlock_t *map_lock = get_inode_map_lock(inumber);
+    size_t bytes_written = 0;
+
+    /* Writing past the end of the file leaves a hole, which must read as
+     * zeros: the blocks after the file's last block are simply not
+     * allocated, and the part of the last block past the end of the file
+     * is already zero (new blocks are cleared where they aren't written) */
+
+    /* Each iteration copies into one run of contiguous blocks: either the
+     * rest of an extent that is already allocated, or a run that is
+     * allocated (as contiguously as possible) for the remaining bytes */
+    while (bytes_written < to_write) {
+        int file_block = (int)(offset / BLOCK_SIZE);
+        size_t block_offset = offset % BLOCK_SIZE;
+        int run_length;
+        read_lock_rwlock(map_lock);
+        int block_number = inode_block_map(inode, file_block, &run_length);
+        unlock_rwlock(map_lock);
+        bool new_run = (block_number == -1);
+        if (new_run) {
+            /* Only this range's writer allocates its blocks, so the block
+             * is still unallocated */
+            size_t end = offset + to_write - bytes_written;
+            int missing_blocks =
+                (int)((end + BLOCK_SIZE - 1) / BLOCK_SIZE) - file_block;
+            write_lock_rwlock(map_lock);
+            block_number = inode_block_alloc(inode, file_block,
+                                             missing_blocks, &run_length);
+            unlock_rwlock(map_lock);
+            if (block_number == -1) {
+                break;
+            }
+        }
+
+        char *run = data_block_get(block_number);
+        if (run == NULL) {
+            return -1;
+        }
+
+        size_t to_write_in_run = (size_t)run_length * BLOCK_SIZE - block_offset;
+        if (to_write_in_run > to_write - bytes_written) {
+            to_write_in_run = to_write - bytes_written;
+        }
+        memcpy(run + block_offset, (char const *)buffer + bytes_written,
+               to_write_in_run);
+        if (new_run) {
+            /* The new blocks may start or end inside a hole */
+            size_t written_end = block_offset + to_write_in_run;
+            memset(run, 0, block_offset);
+            memset(run + written_end, 0,
+                   (size_t)run_length * BLOCK_SIZE - written_end);
+        }
+        bytes_written += to_write_in_run;
+        offset += to_write_in_run;
     }
-    pthread_rwlock_t *file_lock = get_open_file_table_lock(fhandle);
 
-    /* From the open file table entry, we get the inode */
-    write_lock_rwlock(file_lock);
-    int inum = file->of_inumber;
-    inode_t *inode = inode_get(inum);
-    if (inode == NULL) {
-		unlock_rwlock(file_lock);
+    /* Nothing could be allocated for a non-empty write */
+    if (bytes_written == 0 && to_write > 0) {
         return -1;
     }
 
-    size_t bytes_written = 0;
-    pthread_rwlock_t *inode_lock = get_inode_table_lock(inum);
-	write_lock_rwlock(inode_lock);
-
-    if (to_write > 0) {
-        size_t previously_written_blocks = file->of_offset / BLOCK_SIZE;
-        size_t end_write_blocks = (file->of_offset + to_write) / BLOCK_SIZE;
-        size_t buffer_offset = 0;
-        if (to_write % BLOCK_SIZE > 0) {
-            end_write_blocks++;
+    write_lock_rwlock(map_lock);
+    if (offset > inode->i_size) {
+        inode->i_size = offset;
+    }
+    unlock_rwlock(map_lock);
+    return (ssize_t) bytes_written;
+}
+
+/*
+ * Reads from an i-node (either a snapshot of it, or one whose read range and
+ * map lock the caller holds), starting at the given offset
+ * Returns the number of bytes read, -1 in case of error
+ */
+static ssize_t _tfs_read_at(inode_t const *inode, void *buffer, size_t len,
+                            size_t offset) {
+    /* Determine how many bytes to read */
+    size_t to_read = 0;
+    if (offset < inode->i_size) {
+        to_read = inode->i_size - offset;
+    }
+    if (to_read > len) {
+        to_read = len;
+    }
+
+    size_t bytes_read = 0;
+
+    /* Each iteration copies from one run of contiguous blocks (the rest of
+     * the extent holding the current offset), or zero-fills one hole (up to
+     * the next extent) */
+    while (bytes_read < to_read) {
+        int file_block = (int)(offset / BLOCK_SIZE);
+        size_t block_offset = offset % BLOCK_SIZE;
+        int run_length;
+        int block_number = inode_block_map(inode, file_block, &run_length);
+
+        size_t to_read_in_run = (size_t)run_length * BLOCK_SIZE - block_offset;
+        if (run_length == 0 || to_read_in_run > to_read - bytes_read) {
+            to_read_in_run = to_read - bytes_read;
         }
-	
-        for (size_t i = previously_written_blocks; i < end_write_blocks; i++) {
-            void *block;
-            if (i < MAX_DIRECT_BLOCKS) {
-                if (inode->i_data_block[i] == -1) {
-                    inode->i_data_block[i] = data_block_alloc();
-                    if (inode->i_data_block[i] == -1) {
-                        unlock_rwlock(file_lock);
-                        unlock_rwlock(inode_lock);
-                        return -1;
-                    }
-                }
-                block = data_block_get(inode->i_data_block[i]);
-                if (block == NULL) {
-                    unlock_rwlock(file_lock);
-                    unlock_rwlock(inode_lock);
-                    return -1;
-                }
-            } else {
-                int indirect_block_num;
-                if (inode->i_indirect_data_block == -1) {
-                    inode->i_indirect_data_block = data_block_alloc();
-                    indirect_block_num = inode->i_indirect_data_block;
-                    int *indirect_block = data_block_get(indirect_block_num);
-                    if (indirect_block == NULL) {
-                        unlock_rwlock(file_lock);
-                        unlock_rwlock(inode_lock);
-                        return -1;
-                    }
-                    for (int j = MAX_DIRECT_BLOCKS; j < BLOCK_SIZE; j++) {
-                        indirect_block[j-MAX_DIRECT_BLOCKS] = -1; // they start at -1, allocated if needed
-                    }
-                }
-                indirect_block_num = inode->i_indirect_data_block;
-                int *indirect_block = (int *) data_block_get(indirect_block_num);
-                if (indirect_block == NULL) {
-                    unlock_rwlock(file_lock);
-                    unlock_rwlock(inode_lock);
-                    return -1;
-                }
-
-                if (indirect_block[i-MAX_DIRECT_BLOCKS] == -1) {
-                    indirect_block[i-MAX_DIRECT_BLOCKS] = data_block_alloc();
-                    if (indirect_block[i-MAX_DIRECT_BLOCKS] == -1) {
-                        unlock_rwlock(file_lock);
-                        unlock_rwlock(inode_lock);
-                        return -1;
-                    }
-                }
-                block = data_block_get(indirect_block[i-MAX_DIRECT_BLOCKS]);
-                if (block == NULL) {
-                    unlock_rwlock(file_lock);
-                    unlock_rwlock(inode_lock);
-                    return -1;
-                }
+
+        if (block_number == -1) {
+            memset((char *)buffer + bytes_read, 0, to_read_in_run);
+        } else {
+            char *run = data_block_get(block_number);
+            if (run == NULL) {
+                return -1;
             }
-            if (i + 1 < end_write_blocks && to_write > BLOCK_SIZE - (file->of_offset % BLOCK_SIZE)) {
-                // we continue writing for one more block
-                size_t to_write_in_block = BLOCK_SIZE - (file->of_offset % BLOCK_SIZE);
-                memcpy(block + file->of_offset % BLOCK_SIZE, buffer + buffer_offset, to_write_in_block);
-                bytes_written += to_write_in_block;
-                buffer_offset += to_write_in_block;
-                file->of_offset += to_write_in_block;
-                to_write -= to_write_in_block;
-            } else if (to_write <= BLOCK_SIZE) {
-                // last write
-                memcpy(block + file->of_offset % BLOCK_SIZE, buffer + buffer_offset, to_write);
-                bytes_written += to_write;
-                buffer_offset += to_write;
-                file->of_offset += to_write;
-                to_write -= to_write;
-                if (file->of_offset > inode->i_size) {
-                    inode->i_size = file->of_offset;
-                }
-                break;
-            } else {
-                // we write the whole block and still continue
-                memcpy(block + file->of_offset % BLOCK_SIZE, buffer + buffer_offset, BLOCK_SIZE);
-                bytes_written += BLOCK_SIZE;
-                buffer_offset += BLOCK_SIZE;
-                file->of_offset += BLOCK_SIZE;
-                to_write -= BLOCK_SIZE;
+            /* A torn snapshot (see _tfs_read_optimistic) may map the run
+             * anywhere; it is kept inside the volume, and what it reads is
+             * thrown away once the torn read is detected */
+            size_t volume_left =
+                (size_t)(DATA_BLOCKS - block_number) * BLOCK_SIZE -
+                block_offset;
+            if (to_read_in_run > volume_left) {
+                to_read_in_run = volume_left;
             }
+            memcpy((char *)buffer + bytes_read, run + block_offset,
+                   to_read_in_run);
+        }
+        bytes_read += to_read_in_run;
+        offset += to_read_in_run;
+    }
 
-            if (file->of_offset > inode->i_size) {
-                inode->i_size = file->of_offset;
-            }
+    return (ssize_t) bytes_read;
+}
+
+/*
+ * Reads from a file without locking its i-node: the read works on a snapshot
+ * of the i-node, and is retried if a writer changed the i-node meanwhile (in
+ * which case the data that was copied may be torn). After a few attempts, the
+ * range being read is locked instead, so that readers of a busy file don't
+ * starve. Either way, the read runs inside an epoch, so the blocks it sees
+ * aren't reused even if the file is truncated meanwhile (truncating doesn't
+ * wait for readers)
+ * Returns the number of bytes read, -1 in case of error
+ */
+static ssize_t _tfs_read_optimistic(int inum, void *buffer, size_t len,
+                                    size_t offset) {
+    inode_t snapshot;
+    unsigned int seq;
+    unsigned int entered = epoch_enter();
+    for (int attempt = 0; attempt < OPTIMISTIC_READ_ATTEMPTS; attempt++) {
+        if (!inode_snapshot(inum, &snapshot, &seq)) {
+            continue;
+        }
+        ssize_t bytes_read = _tfs_read_at(&snapshot, buffer, len, offset);
+        if (!inode_changed_since(inum, seq)) {
+            epoch_exit(entered);
+            return bytes_read;
         }
+    }
+    epoch_exit(entered);
+
+    /* The writers of other ranges may still add extents, which moves the
+     * extents kept in extent blocks, so the map stays locked while the
+     * range is read. The epoch is entered while the map is locked (nothing
+     * is freed meanwhile), since waiting for the locks inside it isn't
+     * allowed */
+    pthread_rwlock_t *map_lock = get_inode_map_lock(inum);
+    range_lock_entry_t range;
+    inode_range_lock(inum, &range, offset, len, false);
+    read_lock_rwlock(map_lock);
+    entered = epoch_enter();
+    ssize_t bytes_read = _tfs_read_at(inode_get(inum), buffer, len, offset);
+    epoch_exit(entered);
+    unlock_rwlock(map_lock);
+    inode_range_unlock(inum, &range);
+    return bytes_read;
+}
+
+/*
+ * Locks an open file entry (for writing if the operation moves its offset,
+ * for reading otherwise); readers don't lock anything else (see
+ * _tfs_read_optimistic), while writers lock the range they write next (see
+ * lock_written_range)
+ * Returns the entry if successful, NULL otherwise (and nothing stays locked)
+ */
+static open_file_entry_t *lock_open_file(int fhandle, bool moves_offset) {
+    pthread_rwlock_t *file_lock = get_open_file_table_lock(fhandle);
+    if (file_lock == NULL) {
+        return NULL;
+    }
+
+    /* From the open file table entry, we get the inode */
+    if (moves_offset) {
+        write_lock_rwlock(file_lock);
+    } else {
+        read_lock_rwlock(file_lock);
+    }
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || inode_get(file->of_inumber) == NULL) {
         unlock_rwlock(file_lock);
-        unlock_rwlock(inode_lock);
+        return NULL;
     }
+    return file;
+}
 
-    return (ssize_t) bytes_written;
+static void unlock_open_file(int fhandle) {
+    unlock_rwlock(get_open_file_table_lock(fhandle));
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
+/*
+ * Locks a file's i-node (for reading: only truncating locks a whole file)
+ * and then the range of the file that is written
+ */
+static void lock_written_range(int inumber, range_lock_entry_t *range,
+                               size_t offset, size_t len) {
+    read_lock_rwlock(get_inode_table_lock(inumber));
+    inode_range_lock(inumber, range, offset, len, true);
+    inode_write_begin(inumber);
+}
+
+static void unlock_written_range(int inumber, range_lock_entry_t *range) {
+    inode_write_end(inumber);
+    inode_range_unlock(inumber, range);
+    unlock_rwlock(get_inode_table_lock(inumber));
+}
+
+/*
+ * Appends a batch of requests to the end of a file, one after the other,
+ * locking the file (and the range they take) once for the whole batch
+ */
+static void _tfs_append_batch(int inumber, append_request_t *batch) {
+    size_t total = 0;
+    for (append_request_t *request = batch; request != NULL;
+         request = request->ar_next) {
+        total += request->ar_len;
+    }
+
+    /* Other writers may still extend the file before its end is locked, in
+     * which case the new end is locked instead */
+    inode_t *inode = inode_get(inumber);
+    pthread_rwlock_t *map_lock = get_inode_map_lock(inumber);
+    range_lock_entry_t range;
+    size_t offset;
+    for (;;) {
+        read_lock_rwlock(map_lock);
+        offset = inode->i_size;
+        unlock_rwlock(map_lock);
+        lock_written_range(inumber, &range, offset, total);
+        read_lock_rwlock(map_lock);
+        bool moved = inode->i_size != offset;
+        unlock_rwlock(map_lock);
+        if (!moved) {
+            break;
+        }
+        unlock_written_range(inumber, &range);
+    }
+
+    for (append_request_t *request = batch; request != NULL;
+         request = request->ar_next) {
+        /* The offset's block must be addressable by an extent (see
+         * tfs_seek) */
+        request->ar_written = -1;
+        if (offset / BLOCK_SIZE <= (size_t)INT_MAX) {
+            request->ar_written = _tfs_write_at(
+                inumber, inode, request->ar_buffer, request->ar_len, offset);
+        }
+        if (request->ar_written > 0) {
+            offset += (size_t)request->ar_written;
+        }
+        request->ar_end = offset;
+    }
+
+    unlock_written_range(inumber, &range);
+}
+
+/*
+ * Appends to the end of a file by flat combining: the request is queued in
+ * the file's append queue, and the appender that finds no combiner running
+ * becomes one, taking the whole queue and appending every request in it,
+ * while the others wait for theirs to be done. Concurrent appends thus take
+ * the file's locks once per batch, rather than once each
+ * Input:
+ *  - inumber: the file's i-number
+ *  - buffer, len: the contents to append
+ *  - end: set to the end of the appended contents
+ * Returns the number of bytes written, -1 in case of error
+ */
+static ssize_t _tfs_append(int inumber, void const *buffer, size_t len,
+                           size_t *end) {
+    append_queue_t *queue = get_inode_append_queue(inumber);
+    append_request_t request = {.ar_buffer = buffer, .ar_len = len};
+
+    lock_mutex(&queue->aq_mutex);
+    *queue->aq_tail = &request;
+    queue->aq_tail = &request.ar_next;
+    while (!request.ar_done) {
+        if (queue->aq_combining) {
+            pthread_cond_wait(&queue->aq_done, &queue->aq_mutex);
+            continue;
+        }
+
+        queue->aq_combining = true;
+        append_request_t *batch = queue->aq_head;
+        queue->aq_head = NULL;
+        queue->aq_tail = &queue->aq_head;
+        unlock_mutex(&queue->aq_mutex);
+
+        _tfs_append_batch(inumber, batch);
+
+        /* A request may be gone as soon as it is done */
+        lock_mutex(&queue->aq_mutex);
+        while (batch != NULL) {
+            append_request_t *next = batch->ar_next;
+            batch->ar_done = true;
+            batch = next;
+        }
+        queue->aq_combining = false;
+        pthread_cond_broadcast(&queue->aq_done);
+    }
+    unlock_mutex(&queue->aq_mutex);
+
+    *end = request.ar_end;
+    return request.ar_written;
+}
+
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    open_file_entry_t *file = lock_open_file(fhandle, true);
     if (file == NULL) {
         return -1;
     }
 
-    pthread_rwlock_t *file_lock = get_open_file_table_lock(fhandle);
+    ssize_t bytes_written;
+    if (file->of_append) {
+        /* Appends go to the end of the file, wherever the offset is */
+        size_t end;
+        bytes_written = _tfs_append(file->of_inumber, buffer, to_write, &end);
+        if (bytes_written != -1) {
+            file->of_offset = end;
+        }
+    } else {
+        range_lock_entry_t range;
+        lock_written_range(file->of_inumber, &range, file->of_offset,
+                           to_write);
+        bytes_written =
+            _tfs_write_at(file->of_inumber, inode_get(file->of_inumber),
+                          buffer, to_write, file->of_offset);
+        unlock_written_range(file->of_inumber, &range);
+        if (bytes_written > 0) {
+            file->of_offset += (size_t)bytes_written;
+        }
+    }
 
-    /* From the open file table entry, we get the inode */
-	write_lock_rwlock(file_lock);
-    int inum = file->of_inumber;
-    inode_t *inode = inode_get(inum);
-    if (inode == NULL) {
-        unlock_rwlock(file_lock);
+    unlock_open_file(fhandle);
+    return bytes_written;
+}
+
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t to_write,
+                   size_t offset) {
+    /* The offset's block must be addressable by an extent (see tfs_seek) */
+    if (offset / BLOCK_SIZE > (size_t)INT_MAX) {
         return -1;
     }
 
-    pthread_rwlock_t *inode_lock = get_inode_table_lock(inum);
+    /* The shared offset is left untouched, so the entry is only read, and
+     * writes to disjoint ranges of the file run in parallel */
+    open_file_entry_t *file = lock_open_file(fhandle, false);
+    if (file == NULL) {
+        return -1;
+    }
 
-    /* Determine how many bytes to read */
-    write_lock_rwlock(inode_lock);
-    size_t to_read = inode->i_size - file->of_offset;
-    if (to_read > len) {
-        to_read = len;
+    range_lock_entry_t range;
+    lock_written_range(file->of_inumber, &range, offset, to_write);
+    ssize_t bytes_written =
+        _tfs_write_at(file->of_inumber, inode_get(file->of_inumber), buffer,
+                      to_write, offset);
+    unlock_written_range(file->of_inumber, &range);
+
+    unlock_open_file(fhandle);
+    return bytes_written;
+}
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    open_file_entry_t *file = lock_open_file(fhandle, true);
+    if (file == NULL) {
+        return -1;
     }
 
-    if (to_read <= 0) {
-    	unlock_rwlock(file_lock);
-    	unlock_rwlock(inode_lock);
-        return 0;
+    ssize_t bytes_read =
+        _tfs_read_optimistic(file->of_inumber, buffer, len, file->of_offset);
+    if (bytes_read > 0) {
+        file->of_offset += (size_t)bytes_read;
     }
 
-    size_t bytes_read = 0;
+    unlock_open_file(fhandle);
+    return bytes_read;
+}
 
-    size_t previously_read_blocks = file->of_offset / BLOCK_SIZE; 
-    size_t end_read_blocks = (file->of_offset + to_read) / BLOCK_SIZE;
-    size_t buffer_offset = 0;
-    if (to_read % BLOCK_SIZE > 0) {
-        end_read_blocks++;
-    }
-
-    for (size_t i = previously_read_blocks; i < end_read_blocks; i++) {
-        void *block;
-        if (i < MAX_DIRECT_BLOCKS) {
-            int data_block_num = inode->i_data_block[i];
-            block = data_block_get(data_block_num);
-            if (block == NULL) {
-                unlock_rwlock(file_lock);
-                unlock_rwlock(inode_lock);
-                return -1;
-            }
-        } else {
-            int indirect_data_block_num = inode->i_indirect_data_block;
-            int *indirect_block = (int *) data_block_get(indirect_data_block_num);
-            if (indirect_block == NULL) {
-                unlock_rwlock(file_lock);
-                unlock_rwlock(inode_lock);
-                return -1;
-            }
-            block = data_block_get(indirect_block[i-MAX_DIRECT_BLOCKS]);
-            if (block == NULL) {
-                unlock_rwlock(file_lock);
-                unlock_rwlock(inode_lock);
-                return -1;
-            }
-        }
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    /* Positional reads only share the entry's lock (and don't lock the
+     * i-node), so they run in parallel, also through the same file handle */
+    open_file_entry_t *file = lock_open_file(fhandle, false);
+    if (file == NULL) {
+        return -1;
+    }
 
+    ssize_t bytes_read =
+        _tfs_read_optimistic(file->of_inumber, buffer, len, offset);
 
-        if (i + 1 < end_read_blocks && to_read > BLOCK_SIZE - (file->of_offset % BLOCK_SIZE)) {
-            // we continue reading for one more block
-            size_t to_read_in_block = BLOCK_SIZE - (file->of_offset % BLOCK_SIZE);
-            memcpy(buffer + buffer_offset, block + file->of_offset % BLOCK_SIZE, to_read_in_block);
-            bytes_read += to_read_in_block;
-            buffer_offset += to_read_in_block;
-            file->of_offset += to_read_in_block;
-            to_read -= to_read_in_block;
-        } else if (to_read <= BLOCK_SIZE) {
-            // last read
-            memcpy(buffer + buffer_offset, block + file->of_offset % BLOCK_SIZE, to_read);
-            bytes_read += to_read;
-            buffer_offset += to_read;
-            file->of_offset += to_read;
-            to_read -= to_read;
-            break;
-        } else {
-            // we read the whole block and still continue
-            memcpy(buffer + buffer_offset, block + file->of_offset % BLOCK_SIZE, BLOCK_SIZE);
-            bytes_read += BLOCK_SIZE;
-            buffer_offset += BLOCK_SIZE;
-            file->of_offset += BLOCK_SIZE;
-            to_read -= BLOCK_SIZE;
+    unlock_open_file(fhandle);
+    return bytes_read;
+}
+
+ssize_t tfs_seek(int fhandle, ssize_t offset, int whence) {
+    pthread_rwlock_t *file_lock = get_open_file_table_lock(fhandle);
+    if (file_lock == NULL) {
+        return -1;
+    }
+
+    write_lock_rwlock(file_lock);
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        unlock_rwlock(file_lock);
+        return -1;
+    }
+
+    ssize_t base;
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = (ssize_t)file->of_offset;
+        break;
+    case SEEK_END: {
+        inode_t *inode = inode_get(file->of_inumber);
+        if (inode == NULL) {
+            unlock_rwlock(file_lock);
+            return -1;
         }
+        pthread_rwlock_t *map_lock = get_inode_map_lock(file->of_inumber);
+        read_lock_rwlock(map_lock);
+        base = (ssize_t)inode->i_size;
+        unlock_rwlock(map_lock);
+        break;
+    }
+    default:
+        unlock_rwlock(file_lock);
+        return -1;
     }
 
+    /* The new offset must not overflow, and its block must still be
+     * addressable by an extent */
+    if (offset < -base || offset > SSIZE_MAX - base ||
+        (size_t)(base + offset) / BLOCK_SIZE > (size_t)INT_MAX) {
+        unlock_rwlock(file_lock);
+        return -1;
+    }
+    file->of_offset = (size_t)(base + offset);
+
     unlock_rwlock(file_lock);
-    unlock_rwlock(inode_lock);
-    return (ssize_t) bytes_read;
+    return base + offset;
 }
 
 int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
@@ -17,6 +17,13 @@ enum {
  */
 int tfs_init();
 
+/*
+ * Initializes tecnicofs, trying a busy lock 'lock_spins' times before
+ * blocking on it (tfs_init uses LOCK_SPINS)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_init_with_lock_spins(unsigned lock_spins);
+
 /*
  * Destroy tecnicofs
  * Returns 0 if successful, -1 otherwise.
@@ -44,7 +51,8 @@ int tfs_lookup(char const *name);
  * Input:
  *  - name: absolute path name
  *  - flags: can be a combination (with bitwise or) of the following flags:
- *    - append mode (TFS_O_APPEND)
+ *    - append mode (TFS_O_APPEND): every write through the handle goes to
+ *      the end of the file
  *    - truncate file contents (TFS_O_TRUNC)
  *    - create file if it does not exist (TFS_O_CREAT)
  */
@@ -57,7 +65,8 @@ int tfs_open(char const *name, int flags);
  */
 int tfs_close(int fhandle);
 
-/* Writes to an open file, starting at the current offset
+/* Writes to an open file, starting at the current offset (or at the end of
+ * the file, if it was opened with TFS_O_APPEND)
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
  * 	- buffer containing the contents to write
@@ -78,6 +87,41 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes to an open file, starting at the given offset (the file's current
+ * offset is neither used nor changed)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ * 	- offset (in bytes) where the contents are written
+ * 	Returns the number of bytes that were written, or -1 in case of error
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/* Reads from an open file, starting at the given offset (the file's current
+ * offset is neither used nor changed)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- offset (in bytes) where the read starts
+ * 	Returns the number of bytes that were copied from the file to the buffer,
+ * 	or -1 in case of error
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/* Moves the current offset of an open file. The offset may be set past the
+ * end of the file: a later write there leaves a hole, which takes no data
+ * blocks and reads as zeros.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset (in bytes), relative to the position given by 'whence'
+ * 	- whence: SEEK_SET (start of the file), SEEK_CUR (current offset) or
+ * 	  SEEK_END (end of the file)
+ * 	Returns the new offset, or -1 in case of error
+ */
+ssize_t tfs_seek(int fhandle, ssize_t offset, int whence);
+
 /* Copies the contents of a file that exists in TecnicoFS to the contents
  * of another file in the OS' file system tree (outside TecnicoFS).
  * 0 ->> Success, -1 ->> Error.
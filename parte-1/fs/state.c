@@ -1,9 +1,14 @@
 #include "state.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
 #include <unistd.h>
 
 /* Persistent FS state  (in reality, it should be maintained in secondary
@@ -11,28 +16,139 @@
 
 /* I-node table */
 static inode_t inode_table[INODE_TABLE_SIZE];
-static char freeinode_ts[INODE_TABLE_SIZE];
+
+/* Free i-nodes bitmap: bit i of word w is set when i-node (w * 64 + i) is
+ * TAKEN (bits past INODE_TABLE_SIZE are kept permanently set). I-nodes are
+ * claimed with a CAS on their word, starting at the word of the last claim
+ * (next-fit), so creating files neither locks i-nodes nor rescans the taken
+ * ones */
+#define FREE_INODES_WORD_BITS (64)
+#define FREE_INODES_WORDS                                                      \
+    ((INODE_TABLE_SIZE + FREE_INODES_WORD_BITS - 1) / FREE_INODES_WORD_BITS)
+
+static _Atomic uint64_t free_inodes[FREE_INODES_WORDS];
+static atomic_size_t free_inodes_cursor;
+/* Only held for writing to change a whole i-node (e.g. to truncate it):
+ * writes to a file share it, and lock the blocks they write through the
+ * i-node's range lock, while its size and extents are guarded by its map
+ * lock (which is only held for short periods) */
 static pthread_rwlock_t inode_table_locks[INODE_TABLE_SIZE];
 
+/* Range lock of an i-node: the ranges currently held, and a condition that
+ * is signalled whenever one of them is released */
+typedef struct {
+    pthread_mutex_t rl_mutex;
+    pthread_cond_t rl_released;
+    range_lock_entry_t *rl_held;
+} range_lock_t;
+
+static range_lock_t inode_range_locks[INODE_TABLE_SIZE];
+static pthread_rwlock_t inode_map_locks[INODE_TABLE_SIZE];
+static append_queue_t inode_append_queues[INODE_TABLE_SIZE];
+
+/* Writers of the i-nodes: the number of writers changing each i-node, and a
+ * sequence counter that each of them bumps when it starts and when it ends
+ * (see inode_write_begin), so readers can take snapshots of an i-node
+ * without locking it (see inode_snapshot) */
+static atomic_uint inode_writers[INODE_TABLE_SIZE];
+static atomic_uint inode_seqs[INODE_TABLE_SIZE];
+
 /* Data blocks */
 static char fs_data[BLOCK_SIZE * DATA_BLOCKS];
-static char free_blocks[DATA_BLOCKS];
-static pthread_rwlock_t data_blocks_locks[DATA_BLOCKS];
+
+/* Free data blocks bitmap: bit i of word w is set when block (w * 64 + i) is
+ * TAKEN. Bits past DATA_BLOCKS in the last word are kept permanently set, so
+ * they are never handed out. The cursor holds the word where the last
+ * allocation happened (next-fit), so that allocations don't rescan the
+ * already full prefix of the volume. */
+#define FREE_BLOCKS_WORD_BITS (64)
+#define FREE_BLOCKS_WORDS                                                      \
+    ((DATA_BLOCKS + FREE_BLOCKS_WORD_BITS - 1) / FREE_BLOCKS_WORD_BITS)
+
+static uint64_t free_blocks[FREE_BLOCKS_WORDS];
+static size_t free_blocks_cursor;
+
+/* The free blocks lock is statically initialized (and never destroyed) because
+ * threads may still drain their magazines into the bitmap when they exit,
+ * which can happen after state_destroy(). The generation is bumped by every
+ * state_init()/state_destroy(), so blocks cached by a magazine in a previous
+ * FS instance are discarded instead of being handed out again. */
+static pthread_mutex_t free_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint free_blocks_generation = 0;
+
+/* Per-thread block magazines: each thread keeps a small stack of block numbers
+ * that it has reserved from (or freed back to) the bitmap, so most
+ * data_block_alloc()/data_block_free() calls don't touch the shared bitmap.
+ * Magazines are refilled and drained half a magazine at a time. A magazine's
+ * lock is only taken by other threads when the bitmap runs out and they drain
+ * it (see block_magazines_drain), so it is free most of the time. */
+typedef struct block_magazine {
+    pthread_mutex_t lock;
+    int blocks[BLOCK_MAGAZINE_SIZE];
+    int count;
+    unsigned int generation;
+    struct block_magazine *next; // next magazine of block_magazines
+} block_magazine_t;
+
+static pthread_key_t block_magazine_key;
+static pthread_once_t block_magazine_key_once = PTHREAD_ONCE_INIT;
+
+/* Every thread's magazine, so they can be drained. Like the free blocks lock,
+ * the list's lock outlives FS instances, as magazines do */
+static block_magazine_t *block_magazines = NULL;
+static pthread_mutex_t block_magazines_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Epoch-based reclamation: readers of file data announce themselves in the
+ * counter of the epoch they entered (see epoch_enter), and freed blocks are
+ * kept in the limbo list of the epoch they were freed in. The epoch only
+ * advances once the readers of the previous one have left, at which point
+ * the blocks freed during the previous epoch can no longer be seen by any
+ * reader and go back to the bitmap. Only two epochs are ever live, so
+ * counters and limbo lists are indexed by the epoch's parity. */
+static atomic_uint epoch;
+static atomic_uint epoch_readers[2];
+static int epoch_limbo[2][DATA_BLOCKS];
+static int epoch_limbo_count[2];
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int data_block_release_run(int block_number, int run_length);
+static bool epoch_reclaim();
 
 /* Volatile FS state */
 
+/* Open file slots are claimed and released with atomic operations on a
+ * bitmap (bit i of word w is set when slot (w * 64 + i) is TAKEN; bits past
+ * MAX_OPEN_FILES are kept permanently set), so opening and closing files
+ * doesn't serialize on a lock */
+#define OPEN_FILES_WORD_BITS (64)
+#define OPEN_FILES_WORDS                                                       \
+    ((MAX_OPEN_FILES + OPEN_FILES_WORD_BITS - 1) / OPEN_FILES_WORD_BITS)
+
+/* A file handle carries its slot's generation above the slot's index. The
+ * generation is bumped whenever the slot is freed, so a handle that was
+ * already closed is rejected even if its slot has been claimed again */
+#define HANDLE_SLOT_BITS (16)
+#define HANDLE_SLOT_MASK ((1 << HANDLE_SLOT_BITS) - 1)
+#define HANDLE_GENERATION_MASK (INT_MAX >> HANDLE_SLOT_BITS)
+
+_Static_assert(MAX_OPEN_FILES <= HANDLE_SLOT_MASK + 1,
+               "open file slots must fit in a file handle");
+
 static open_file_entry_t open_file_table[MAX_OPEN_FILES];
-static char free_open_file_entries[MAX_OPEN_FILES];
+static _Atomic uint64_t open_file_bitmap[OPEN_FILES_WORDS];
+static atomic_uint open_file_generations[MAX_OPEN_FILES];
 static pthread_rwlock_t open_file_table_locks[MAX_OPEN_FILES];
 
-/* Locks for directory entries */
+/* Directory entries are read without locks (see dir_entry_t); only the
+ * creation of files with the same name must be serialized, which is done by
+ * a lock per hash of the name */
+#define DIR_NAME_LOCKS (16)
 
-static pthread_rwlock_t dir_entries_locks[MAX_DIR_ENTRIES];
+static pthread_mutex_t dir_name_locks[DIR_NAME_LOCKS];
 
-int open_files_count = 0;
+atomic_int open_files_count = 0;
 pthread_cond_t open_files_cond;
 pthread_mutex_t open_files_mutex;
-pthread_mutex_t open_file_lock;
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -42,8 +158,16 @@ static inline bool valid_block_number(int block_number) {
     return block_number >= 0 && block_number < DATA_BLOCKS;
 }
 
+static inline int handle_slot(int file_handle) {
+    return file_handle & HANDLE_SLOT_MASK;
+}
+
+static inline unsigned int handle_generation(int file_handle) {
+    return (unsigned int)file_handle >> HANDLE_SLOT_BITS;
+}
+
 static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+    return file_handle >= 0 && handle_slot(file_handle) < MAX_OPEN_FILES;
 }
 
 /* Returns the lock associated with the given inumber */
@@ -51,9 +175,55 @@ pthread_rwlock_t *get_inode_table_lock(int inumber) {
     return &inode_table_locks[inumber];
 }
 
-/* Returns the lock associated with the given file handle */
+/* Returns the queue of pending appends to the given inumber */
+append_queue_t *get_inode_append_queue(int inumber) {
+    return &inode_append_queues[inumber];
+}
+
+/* Returns the lock guarding the size and extents of the given inumber */
+pthread_rwlock_t *get_inode_map_lock(int inumber) {
+    return &inode_map_locks[inumber];
+}
+
+/* Marks an i-node as being changed, for the readers that don't lock it; the
+ * writer must already hold the locks that let it change the i-node */
+void inode_write_begin(int inumber) {
+    atomic_fetch_add(&inode_writers[inumber], 1);
+    atomic_fetch_add(&inode_seqs[inumber], 1);
+}
+
+void inode_write_end(int inumber) {
+    atomic_fetch_add(&inode_seqs[inumber], 1);
+    atomic_fetch_sub(&inode_writers[inumber], 1);
+}
+
+/* Locks a whole i-node for writing (see inode_write_begin) */
+void inode_write_lock(int inumber) {
+    write_lock_rwlock(&inode_table_locks[inumber]);
+    inode_write_begin(inumber);
+}
+
+void inode_write_unlock(int inumber) {
+    inode_write_end(inumber);
+    unlock_rwlock(&inode_table_locks[inumber]);
+}
+
+/* Returns the lock that serializes the creation of files with the given name
+ * (FNV-1a hash of the part of the name that is compared) */
+pthread_mutex_t *get_dir_name_lock(char const *name) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return &dir_name_locks[hash % DIR_NAME_LOCKS];
+}
+
+/* Returns the lock associated with the given file handle (NULL if invalid) */
 pthread_rwlock_t *get_open_file_table_lock(int file_handle) {
-    return &open_file_table_locks[file_handle];
+    if (!valid_file_handle(file_handle)) {
+        return NULL;
+    }
+    return &open_file_table_locks[handle_slot(file_handle)];
 }
 
 /**
@@ -83,28 +253,100 @@ static void insert_delay() {
     }
 }
 
+/* Number of times a busy lock is tried before blocking on it (see
+ * spin_on_lock); set by state_init */
+static unsigned lock_spins = LOCK_SPINS;
+
 /*
- * Locks (and checks for errors) a given mutex
+ * Tells the CPU that the calling thread is spinning on a lock (which saves
+ * power and lets a sibling hyper-thread run)
+ */
+static void cpu_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * Spins on a lock before its caller blocks on it: the lock is tried up to
+ * lock_spins times, pausing between tries for twice as long as the last
+ * time (up to MAX_LOCK_SPIN_PAUSES pauses). Most critical sections are a few
+ * instructions long, so the lock is usually released long before a thread
+ * that blocked on it would be woken up
+ * Input:
+ *  - try_lock: pthread_mutex_trylock, pthread_rwlock_tryrdlock or
+ *    pthread_rwlock_trywrlock
+ *  - lock: the lock
+ * Returns: true if the lock was taken, false if the caller should block
+ */
+static bool spin_on_lock(int (*try_lock)(void *), void *lock) {
+    unsigned pauses = 1;
+    for (unsigned spin = 0; spin < lock_spins; spin++) {
+        int ret = try_lock(lock);
+        if (ret == 0) {
+            return true;
+        }
+        if (ret != EBUSY) {
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned i = 0; i < pauses; i++) {
+            cpu_pause();
+        }
+        if (pauses < MAX_LOCK_SPIN_PAUSES) {
+            pauses *= 2;
+        }
+    }
+    return false;
+}
+
+static int try_lock_mutex(void *mutex) {
+    return pthread_mutex_trylock((pthread_mutex_t *)mutex);
+}
+
+static int try_read_lock_rwlock(void *rwlock) {
+    return pthread_rwlock_tryrdlock((pthread_rwlock_t *)rwlock);
+}
+
+static int try_write_lock_rwlock(void *rwlock) {
+    return pthread_rwlock_trywrlock((pthread_rwlock_t *)rwlock);
+}
+
+/*
+ * Locks (and checks for errors) a given mutex, spinning on it first (see
+ * spin_on_lock)
  */
 void lock_mutex(pthread_mutex_t *mutex) {
+    if (spin_on_lock(try_lock_mutex, mutex)) {
+        return;
+    }
     if(pthread_mutex_lock(mutex) != 0) {
         exit(EXIT_FAILURE);
     }
 }
 
 /*
- * Read-locks (and checks for errors) a given rwlock
+ * Read-locks (and checks for errors) a given rwlock, spinning on it first
+ * (see spin_on_lock)
  */
 void read_lock_rwlock(pthread_rwlock_t *rwlock) {
+    if (spin_on_lock(try_read_lock_rwlock, rwlock)) {
+        return;
+    }
     if(pthread_rwlock_rdlock(rwlock) != 0) {
         exit(EXIT_FAILURE);
     }
 }
 
 /*
- * Write-locks (and checks for errors) a given rwlock
+ * Write-locks (and checks for errors) a given rwlock, spinning on it first
+ * (see spin_on_lock)
  */
 void write_lock_rwlock(pthread_rwlock_t *rwlock) {
+    if (spin_on_lock(try_write_lock_rwlock, rwlock)) {
+        return;
+    }
     if(pthread_rwlock_wrlock(rwlock) != 0) {
         exit(EXIT_FAILURE);
     }
@@ -166,43 +408,137 @@ void destroy_rwlock(pthread_rwlock_t *rwlock) {
 
 /*
  * Initializes FS state
+ * Input:
+ *  - spins: number of times a busy lock is tried before blocking on it (see
+ *    spin_on_lock)
  */
-void state_init() {
+void state_init(unsigned spins) {
+    /* On a single CPU, the holder of a busy lock can't run while its waiter
+     * spins */
+    lock_spins = sysconf(_SC_NPROCESSORS_ONLN) < 2 ? 0 : spins;
     init_mutex(&open_files_mutex);
-    init_mutex(&open_file_lock);
+    for (size_t i = 0; i < DIR_NAME_LOCKS; i++) {
+        init_mutex(&dir_name_locks[i]);
+    }
     for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
         init_rwlock(&inode_table_locks[i]);
+        init_mutex(&inode_range_locks[i].rl_mutex);
+        if (pthread_cond_init(&inode_range_locks[i].rl_released, NULL) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        inode_range_locks[i].rl_held = NULL;
+        init_rwlock(&inode_map_locks[i]);
+        init_mutex(&inode_append_queues[i].aq_mutex);
+        if (pthread_cond_init(&inode_append_queues[i].aq_done, NULL) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        inode_append_queues[i].aq_head = NULL;
+        inode_append_queues[i].aq_tail = &inode_append_queues[i].aq_head;
+        inode_append_queues[i].aq_combining = false;
+        atomic_store(&inode_writers[i], 0);
+        atomic_store(&inode_seqs[i], 0);
+    }
+
+    for (size_t i = 0; i < FREE_INODES_WORDS; i++) {
+        atomic_store(&free_inodes[i], 0);
+    }
+    if (INODE_TABLE_SIZE % FREE_INODES_WORD_BITS != 0) {
+        atomic_store(&free_inodes[FREE_INODES_WORDS - 1],
+                     UINT64_MAX << (INODE_TABLE_SIZE % FREE_INODES_WORD_BITS));
+    }
+    atomic_store(&free_inodes_cursor, 0);
+
+    lock_mutex(&free_blocks_lock);
+    for (size_t i = 0; i < FREE_BLOCKS_WORDS; i++) {
+        free_blocks[i] = 0;
+    }
+    if (DATA_BLOCKS % FREE_BLOCKS_WORD_BITS != 0) {
+        free_blocks[FREE_BLOCKS_WORDS - 1] =
+            UINT64_MAX << (DATA_BLOCKS % FREE_BLOCKS_WORD_BITS);
     }
+    free_blocks_cursor = 0;
+    atomic_fetch_add(&free_blocks_generation, 1);
+    unlock_mutex(&free_blocks_lock);
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
-        init_rwlock(&data_blocks_locks[i]);
+    lock_mutex(&epoch_lock);
+    atomic_store(&epoch, 0);
+    for (size_t i = 0; i < 2; i++) {
+        atomic_store(&epoch_readers[i], 0);
+        epoch_limbo_count[i] = 0;
     }
+    unlock_mutex(&epoch_lock);
 
+    for (size_t i = 0; i < OPEN_FILES_WORDS; i++) {
+        atomic_store(&open_file_bitmap[i], 0);
+    }
+    if (MAX_OPEN_FILES % OPEN_FILES_WORD_BITS != 0) {
+        atomic_store(&open_file_bitmap[OPEN_FILES_WORDS - 1],
+                     UINT64_MAX << (MAX_OPEN_FILES % OPEN_FILES_WORD_BITS));
+    }
+    atomic_store(&open_files_count, 0);
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
         init_rwlock(&open_file_table_locks[i]);
     }
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        init_rwlock(&dir_entries_locks[i]);
-    }
 }
 
 void state_destroy() {
-    destroy_mutex(&open_file_lock);
+    for (size_t i = 0; i < DIR_NAME_LOCKS; i++) {
+        destroy_mutex(&dir_name_locks[i]);
+    }
+    lock_mutex(&free_blocks_lock);
+    atomic_fetch_add(&free_blocks_generation, 1);
+    unlock_mutex(&free_blocks_lock);
     for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
         destroy_rwlock(&inode_table_locks[i]);
-    }
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        destroy_rwlock(&data_blocks_locks[i]);
+        destroy_mutex(&inode_range_locks[i].rl_mutex);
+        if (pthread_cond_destroy(&inode_range_locks[i].rl_released) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        destroy_rwlock(&inode_map_locks[i]);
+        destroy_mutex(&inode_append_queues[i].aq_mutex);
+        if (pthread_cond_destroy(&inode_append_queues[i].aq_done) != 0) {
+            exit(EXIT_FAILURE);
+        }
     }
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
         destroy_rwlock(&open_file_table_locks[i]);
     }
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        destroy_rwlock(&dir_entries_locks[i]);
+}
+
+/*
+ * Claims a free i-node in the free i-nodes bitmap
+ * Returns: the i-node's number, or -1 if there is none
+ */
+static int inode_claim() {
+    insert_delay(); // simulate storage access delay (to free_inodes)
+    size_t start = atomic_load(&free_inodes_cursor);
+    for (size_t i = 0; i < FREE_INODES_WORDS; i++) {
+        size_t w = (start + i) % FREE_INODES_WORDS;
+        uint64_t word = atomic_load(&free_inodes[w]);
+        while (word != UINT64_MAX) {
+            /* Claims the word's first free i-node (on failure, the CAS
+             * reloads the word, and the next free i-node is tried) */
+            int bit = __builtin_ctzll(~word);
+            if (atomic_compare_exchange_weak(&free_inodes[w], &word,
+                                             word | (uint64_t)1 << bit)) {
+                atomic_store(&free_inodes_cursor, w);
+                return (int)(w * FREE_INODES_WORD_BITS) + bit;
+            }
+        }
     }
+    return -1;
+}
+
+/* Returns an i-node to the free i-nodes bitmap */
+static void inode_release(int inumber) {
+    atomic_fetch_and(&free_inodes[inumber / FREE_INODES_WORD_BITS],
+                     ~((uint64_t)1 << (inumber % FREE_INODES_WORD_BITS)));
+}
+
+/* Returns whether an i-node is TAKEN */
+static bool inode_taken(int inumber) {
+    return atomic_load(&free_inodes[inumber / FREE_INODES_WORD_BITS]) &
+           (uint64_t)1 << (inumber % FREE_INODES_WORD_BITS);
 }
 
 /*
@@ -213,55 +549,44 @@ void state_destroy() {
  *  new i-node's number if successfully created, -1 otherwise
  */
 int inode_create(inode_type n_type) {
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * (int) sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
-        }
-
-        write_lock_rwlock(&inode_table_locks[inumber]);
-        /* Finds first free entry in i-node table */
-        if (freeinode_ts[inumber] == FREE) {
-            /* Found a free entry, so takes it for the new i-node*/
-            freeinode_ts[inumber] = TAKEN;
-            unlock_rwlock(&inode_table_locks[inumber]);
-            insert_delay(); // simulate storage access delay (to i-node)
-            inode_table[inumber].i_node_type = n_type;
-
-            if (n_type == T_DIRECTORY) {
-                /* Initializes directory (filling its block with empty
-                 * entries, labeled with inumber==-1) */
-                int b = data_block_alloc();
-                if (b == -1) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
-
-                inode_table[inumber].i_size = BLOCK_SIZE;
-                inode_table[inumber].i_data_block[0] = b;
-                inode_table[inumber].i_indirect_data_block = -1;
-
-                dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-                if (dir_entry == NULL) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
-
-                for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    dir_entry[i].d_inumber = -1;
-                }
-            } else {
-                /* In case of a new file, simply sets its size to 0 */
-                inode_table[inumber].i_size = 0;
-                for (size_t i = 0; i < MAX_DIRECT_BLOCKS; i++) {
-                    inode_table[inumber].i_data_block[i] = -1;
-                }
-                inode_table[inumber].i_indirect_data_block = -1;
-            }
-            return inumber;
+    int inumber = inode_claim();
+    if (inumber == -1) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay (to i-node)
+    inode_table[inumber].i_node_type = n_type;
+
+    if (n_type == T_DIRECTORY) {
+        /* Initializes directory (filling its block with empty
+         * entries, labeled with inumber==-1) */
+        int b = data_block_alloc();
+        if (b == -1) {
+            inode_release(inumber);
+            return -1;
         }
-        unlock_rwlock(&inode_table_locks[inumber]);
+
+        inode_table[inumber].i_size = BLOCK_SIZE;
+        inode_table[inumber].i_extents[0].e_file_block = 0;
+        inode_table[inumber].i_extents[0].e_start = b;
+        inode_table[inumber].i_extents[0].e_length = 1;
+        inode_table[inumber].i_extent_count = 1;
+
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+        if (dir_entry == NULL) {
+            inode_release(inumber);
+            return -1;
+        }
+
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+            atomic_init(&dir_entry[i].d_inumber, -1);
+        }
+    } else {
+        /* In case of a new file, simply sets its size to 0 */
+        inode_table[inumber].i_size = 0;
+        inode_table[inumber].i_extent_count = 0;
     }
-    return -1;
+    return inumber;
 }
 
 /*
@@ -271,29 +596,19 @@ int inode_create(inode_type n_type) {
  * Returns: 0 if successful, -1 if failed
  */
 int inode_delete(int inumber) {
-    // simulate storage access delay (to i-node and freeinode_ts)
+    // simulate storage access delay (to i-node and free_inodes)
     insert_delay();
     insert_delay();
 
-    if (!valid_inumber(inumber) || freeinode_ts[inumber] == FREE) {
+    if (!valid_inumber(inumber) || !inode_taken(inumber)) {
         return -1;
     }
 
-    freeinode_ts[inumber] = FREE;
-
-    if (inode_table[inumber].i_size > 0) {
-        for (int i = 0; i < MAX_DIRECT_BLOCKS; i++) {
-            int block = inode_table[inumber].i_data_block[i];
-            write_lock_rwlock(&data_blocks_locks[block]);
-            if (data_block_free(block) == -1) {
-                unlock_rwlock(&data_blocks_locks[block]);
-                return -1;
-            }
-            unlock_rwlock(&data_blocks_locks[block]);
-        }
-    }
-
-    return 0;
+    /* The blocks are released before the i-node, so that it can't be reused
+     * while they are still being freed */
+    int ret = inode_free_blocks(&inode_table[inumber]);
+    inode_release(inumber);
+    return ret;
 }
 
 /*
@@ -311,6 +626,286 @@ inode_t *inode_get(int inumber) {
     return &inode_table[inumber];
 }
 
+/*
+ * Copies an i-node without locking it.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - snapshot: where the i-node is copied to
+ *  - seq: set to the i-node's sequence number when it was copied
+ * Returns: true if the copy is consistent, false if a writer was changing
+ * the i-node (in any of its ranges) meanwhile. Anything read based on the copy (e.g. its blocks) is
+ * only consistent as well while inode_changed_since(inumber, seq) is false.
+ */
+bool inode_snapshot(int inumber, inode_t *snapshot, unsigned int *seq) {
+    if (!valid_inumber(inumber)) {
+        return false;
+    }
+
+    *seq = atomic_load(&inode_seqs[inumber]);
+    if (atomic_load(&inode_writers[inumber]) != 0) {
+        return false;
+    }
+    insert_delay(); // simulate storage access delay to i-node
+    memcpy(snapshot, &inode_table[inumber], sizeof(inode_t));
+    return !inode_changed_since(inumber, *seq);
+}
+
+/* Returns true if the i-node was changed (or is being changed) since its
+ * sequence number was 'seq' */
+bool inode_changed_since(int inumber, unsigned int seq) {
+    /* The reads made since the snapshot can't be moved after this check */
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&inode_seqs[inumber], memory_order_relaxed) !=
+           seq;
+}
+
+/*
+ * Returns whether two ranges of blocks conflict (they overlap, and at least
+ * one of them is being written)
+ */
+static bool ranges_conflict(range_lock_entry_t const *a,
+                            range_lock_entry_t const *b) {
+    return (a->rl_write || b->rl_write) &&
+           a->rl_first_block < b->rl_end_block &&
+           b->rl_first_block < a->rl_end_block;
+}
+
+/*
+ * Locks a range of an i-node's bytes, waiting for the conflicting ranges
+ * held by other threads to be released. Ranges are locked by whole blocks,
+ * so that threads holding disjoint ranges never touch the same block.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - range: where the lock's state is kept (until it's unlocked)
+ *  - offset, len: the range of bytes to lock (at least one block is locked)
+ *  - write: whether the range is locked for writing (or for reading, which
+ *    can be shared)
+ */
+void inode_range_lock(int inumber, range_lock_entry_t *range, size_t offset,
+                      size_t len, bool write) {
+    range->rl_first_block = offset / BLOCK_SIZE;
+    range->rl_end_block = range->rl_first_block + 1;
+    if (len > 0) {
+        range->rl_end_block = len > SIZE_MAX - offset
+                                  ? SIZE_MAX
+                                  : (offset + len - 1) / BLOCK_SIZE + 1;
+    }
+    range->rl_write = write;
+
+    range_lock_t *lock = &inode_range_locks[inumber];
+    lock_mutex(&lock->rl_mutex);
+    for (;;) {
+        range_lock_entry_t const *held = lock->rl_held;
+        while (held != NULL && !ranges_conflict(held, range)) {
+            held = held->rl_next;
+        }
+        if (held == NULL) {
+            break;
+        }
+        pthread_cond_wait(&lock->rl_released, &lock->rl_mutex);
+    }
+    range->rl_next = lock->rl_held;
+    lock->rl_held = range;
+    unlock_mutex(&lock->rl_mutex);
+}
+
+/*
+ * Unlocks a range locked by inode_range_lock
+ */
+void inode_range_unlock(int inumber, range_lock_entry_t *range) {
+    range_lock_t *lock = &inode_range_locks[inumber];
+    lock_mutex(&lock->rl_mutex);
+    range_lock_entry_t **link = &lock->rl_held;
+    while (*link != range) {
+        link = &(*link)->rl_next;
+    }
+    *link = range->rl_next;
+    pthread_cond_broadcast(&lock->rl_released);
+    unlock_mutex(&lock->rl_mutex);
+}
+
+/* Returns the number of extent blocks holding a file's extents past the
+ * ones kept in its i-node */
+static int extent_blocks_needed(int extent_count) {
+    if (extent_count <= MAX_FILE_EXTENTS) {
+        return 0;
+    }
+    return (extent_count - MAX_FILE_EXTENTS + EXTENTS_PER_BLOCK - 1) /
+           EXTENTS_PER_BLOCK;
+}
+
+/* Extent returned for the extents of a torn snapshot of an i-node that
+ * can't be in an extent block (see inode_extent): it maps no blocks, so the
+ * read based on the snapshot only sees a hole (and is retried anyway) */
+static extent_t torn_extent;
+
+/*
+ * Returns a file's extent with the given index: the first MAX_FILE_EXTENTS
+ * are in its i-node, and the next ones in its extent blocks, in order.
+ * Input:
+ *  - inode: the file's i-node (or a snapshot of it)
+ *  - index: index of the extent, below i_extent_count
+ * Returns: pointer to the extent (to torn_extent if the i-node is a snapshot
+ * taken while a writer changed it, and the extent can't be found)
+ */
+extent_t *inode_extent(inode_t const *inode, int index) {
+    if (index < MAX_FILE_EXTENTS) {
+        return (extent_t *)&inode->i_extents[index];
+    }
+
+    /* The delay of accessing the map was already simulated along with the
+     * i-node's, so the extent block is read directly */
+    index -= MAX_FILE_EXTENTS;
+    if (index / EXTENTS_PER_BLOCK >= MAX_EXTENT_BLOCKS) {
+        return &torn_extent;
+    }
+    int block_number = inode->i_extent_blocks[index / EXTENTS_PER_BLOCK];
+    if (!valid_block_number(block_number)) {
+        return &torn_extent;
+    }
+    extent_t *extents = (extent_t *)&fs_data[block_number * BLOCK_SIZE];
+    return &extents[index % EXTENTS_PER_BLOCK];
+}
+
+/*
+ * Maps a block of a file to the data block that holds it.
+ * Input:
+ *  - inode: the file's i-node
+ *  - file_block: index of the block inside the file
+ *  - run_length: set to the number of contiguous data blocks, starting at the
+ *    returned one, that hold file_block and the file blocks following it.
+ *    If file_block is in a hole, it is set to the number of file blocks up
+ *    to the next extent instead (0 if no extent follows)
+ * Returns: data block index, or -1 if the file block isn't allocated
+ */
+int inode_block_map(inode_t const *inode, int file_block, int *run_length) {
+    /* Binary search for the last extent starting at or before file_block */
+    int low = 0;
+    int high = inode->i_extent_count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (inode_extent(inode, middle)->e_file_block <= file_block) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    /* The block is in a hole if that extent ends before it */
+    extent_t const *extent = (low > 0) ? inode_extent(inode, low - 1) : NULL;
+    if (extent == NULL ||
+        file_block - extent->e_file_block >= extent->e_length) {
+        *run_length = (low < inode->i_extent_count)
+                          ? inode_extent(inode, low)->e_file_block - file_block
+                          : 0;
+        return -1;
+    }
+
+    int offset = file_block - extent->e_file_block;
+    *run_length = extent->e_length - offset;
+    return extent->e_start + offset;
+}
+
+/*
+ * Allocates contiguous data blocks for a range of a file that isn't
+ * allocated yet. The blocks are taken right after the data blocks of the
+ * preceding extent whenever possible, in which case that extent simply grows.
+ * Input:
+ *  - inode: the file's i-node
+ *  - file_block: index of the first block to allocate inside the file
+ *  - count: number of blocks wanted
+ *  - run_length: set to the number of blocks actually allocated (between 1
+ *    and count)
+ * Returns: index of the first data block allocated, or -1 if there is no
+ * space left (in the volume or in the i-node's extents)
+ */
+int inode_block_alloc(inode_t *inode, int file_block, int count,
+                      int *run_length) {
+    /* Finds where the new extent goes (appends, the usual case, are
+     * checked first) */
+    int position = inode->i_extent_count;
+    while (position > 0 &&
+           inode_extent(inode, position - 1)->e_file_block > file_block) {
+        position--;
+    }
+
+    /* Never overlaps the next extent */
+    if (position < inode->i_extent_count) {
+        extent_t const *next = inode_extent(inode, position);
+        if (next->e_file_block - file_block < count) {
+            count = next->e_file_block - file_block;
+        }
+    }
+
+    extent_t *previous =
+        (position > 0) ? inode_extent(inode, position - 1) : NULL;
+    int hint = -1;
+    if (previous != NULL &&
+        previous->e_file_block + previous->e_length == file_block) {
+        hint = previous->e_start + previous->e_length;
+    }
+
+    int start = data_block_alloc_run(hint, count, run_length);
+    if (start == -1) {
+        return -1;
+    }
+
+    if (start == hint) {
+        previous->e_length += *run_length;
+        return start;
+    }
+
+    /* The new extent may need another extent block */
+    int extent_blocks = extent_blocks_needed(inode->i_extent_count);
+    if (extent_blocks_needed(inode->i_extent_count + 1) > extent_blocks) {
+        int extent_block =
+            (extent_blocks < MAX_EXTENT_BLOCKS) ? data_block_alloc() : -1;
+        if (extent_block == -1) {
+            /* No reader has seen the blocks, so they are released at once */
+            data_block_release_run(start, *run_length);
+            return -1;
+        }
+        inode->i_extent_blocks[extent_blocks] = extent_block;
+    }
+
+    for (int i = inode->i_extent_count; i > position; i--) {
+        *inode_extent(inode, i) = *inode_extent(inode, i - 1);
+    }
+    inode->i_extent_count++;
+    extent_t *extent = inode_extent(inode, position);
+    extent->e_file_block = file_block;
+    extent->e_start = start;
+    extent->e_length = *run_length;
+    return start;
+}
+
+/*
+ * Frees all the data blocks of a file.
+ * Input:
+ *  - inode: the file's i-node
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_free_blocks(inode_t *inode) {
+    /* The blocks are unlinked from the i-node before they are freed, so
+     * that readers entering an epoch after they are freed can't see them.
+     * The extent blocks are freed last, since they are read until then */
+    inode_t unlinked = *inode;
+    inode->i_extent_count = 0;
+
+    for (int i = 0; i < unlinked.i_extent_count; i++) {
+        extent_t const *extent = inode_extent(&unlinked, i);
+        if (data_block_free_run(extent->e_start, extent->e_length) == -1) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < extent_blocks_needed(unlinked.i_extent_count); i++) {
+        if (data_block_free(unlinked.i_extent_blocks[i]) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 /*
  * Adds an entry to the i-node directory data.
  * Input:
@@ -339,23 +934,24 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
     /* Locates the block containing the directory's entries */
     read_lock_rwlock(&inode_table_locks[inumber]);
     dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block[0]);
+        (dir_entry_t *)data_block_get(inode_table[inumber].i_extents[0].e_start);
     unlock_rwlock(&inode_table_locks[inumber]);
     if (dir_entry == NULL) {
         return -1;
     }
 
-    /* Finds and fills the first empty entry */
+    /* Claims the first empty entry, and publishes it once its name is
+     * filled */
     for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        write_lock_rwlock(&dir_entries_locks[i]);
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
+        int expected = -1;
+        if (atomic_compare_exchange_strong(&dir_entry[i].d_inumber, &expected,
+                                           DIR_ENTRY_CLAIMED)) {
             strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
             dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
-            unlock_rwlock(&dir_entries_locks[i]);
+            atomic_store_explicit(&dir_entry[i].d_inumber, sub_inumber,
+                                  memory_order_release);
             return 0;
         }
-        unlock_rwlock(&dir_entries_locks[i]);
     }
 
     return -1;
@@ -368,75 +964,483 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
  * 	Returns i-number linked to the target name, -1 if not found
  */
 int find_in_dir(int inumber, char const *sub_name) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    /* A directory's i-node doesn't change after it is created, so it's read
+     * without locking it */
     insert_delay(); // simulate storage access delay to i-node with inumber
-    read_lock_rwlock(&inode_table_locks[inumber]);
-    if (!valid_inumber(inumber) ||
-        inode_table[inumber].i_node_type != T_DIRECTORY) {
-        unlock_rwlock(&inode_table_locks[inumber]);
+    if (inode_table[inumber].i_node_type != T_DIRECTORY) {
         return -1;
     }
 
     /* Locates the block containing the directory's entries */
     dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block[0]);
-    unlock_rwlock(&inode_table_locks[inumber]);
+        (dir_entry_t *)data_block_get(inode_table[inumber].i_extents[0].e_start);
     if (dir_entry == NULL) {
         return -1;
     }
 
-    /* Iterates over the directory entries looking for one that has the target
-     * name */
+    /* Iterates over the published directory entries looking for one that
+     * has the target name (the acquire load makes the name visible) */
     for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        read_lock_rwlock(&dir_entries_locks[i]);
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            unlock_rwlock(&dir_entries_locks[i]);
-            return dir_entry[i].d_inumber;
+        int sub_inumber = atomic_load_explicit(&dir_entry[i].d_inumber,
+                                               memory_order_acquire);
+        if (sub_inumber >= 0 &&
+            strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0) {
+            return sub_inumber;
         }
-        unlock_rwlock(&dir_entries_locks[i]);
     }
 
     return -1;
 }
 
+/*
+ * Takes up to 'count' free blocks from the bitmap, storing them in 'blocks'
+ * in descending order (so that popping them from the end of the array gives
+ * increasing block numbers).
+ * The bitmap is scanned a word at a time starting at the next-fit cursor, and
+ * the first free block inside a word is found with a count-trailing-zeros on
+ * its complement, so the cost doesn't grow as the volume fills up.
+ * Must be called with free_blocks_lock held.
+ * Returns: the number of blocks taken
+ */
+static int free_blocks_take(int *blocks, int count) {
+    int taken = 0;
+    for (size_t n = 0; n < FREE_BLOCKS_WORDS && taken < count; n++) {
+        if (n * sizeof(uint64_t) % BLOCK_SIZE == 0) {
+            insert_delay(); // simulate storage access delay to free_blocks
+        }
+
+        size_t w = (free_blocks_cursor + n) % FREE_BLOCKS_WORDS;
+        while (free_blocks[w] != UINT64_MAX && taken < count) {
+            int bit = __builtin_ctzll(~free_blocks[w]);
+            free_blocks[w] |= (uint64_t)1 << bit;
+            free_blocks_cursor = w;
+            taken++;
+            blocks[count - taken] = (int)(w * FREE_BLOCKS_WORD_BITS) + bit;
+        }
+    }
+
+    /* Moves the blocks to the start of the array if fewer were found */
+    if (taken < count) {
+        memmove(blocks, blocks + count - taken, (size_t)taken * sizeof(int));
+    }
+    return taken;
+}
+
+/*
+ * Takes a run of up to 'count' contiguous free blocks from the bitmap,
+ * starting at 'hint' if that block is free, or at the first free block after
+ * the next-fit cursor otherwise.
+ * Must be called with free_blocks_lock held.
+ * Returns: index of the first block of the run, or -1 if the volume is full
+ */
+static int free_blocks_take_run(int hint, int count, int *run_length) {
+    int start = hint;
+    if (!valid_block_number(hint) ||
+        (free_blocks[hint / FREE_BLOCKS_WORD_BITS] &
+         ((uint64_t)1 << (hint % FREE_BLOCKS_WORD_BITS))) != 0) {
+        if (free_blocks_take(&start, 1) == 0) {
+            return -1;
+        }
+    } else {
+        insert_delay(); // simulate storage access delay to free_blocks
+        free_blocks[hint / FREE_BLOCKS_WORD_BITS] |=
+            (uint64_t)1 << (hint % FREE_BLOCKS_WORD_BITS);
+    }
+
+    int length = 1;
+    while (length < count && valid_block_number(start + length)) {
+        int block = start + length;
+        uint64_t mask = (uint64_t)1 << (block % FREE_BLOCKS_WORD_BITS);
+        if ((free_blocks[block / FREE_BLOCKS_WORD_BITS] & mask) != 0) {
+            break;
+        }
+        free_blocks[block / FREE_BLOCKS_WORD_BITS] |= mask;
+        length++;
+    }
+    free_blocks_cursor = (size_t)(start + length - 1) / FREE_BLOCKS_WORD_BITS;
+
+    *run_length = length;
+    return start;
+}
+
+/*
+ * Returns the given blocks to the bitmap.
+ * Must be called with free_blocks_lock held.
+ */
+static void free_blocks_put(int const *blocks, int count) {
+    insert_delay(); // simulate storage access delay to free_blocks
+    for (int i = 0; i < count; i++) {
+        free_blocks[blocks[i] / FREE_BLOCKS_WORD_BITS] &=
+            ~((uint64_t)1 << (blocks[i] % FREE_BLOCKS_WORD_BITS));
+    }
+}
+
+/*
+ * Destructor for a thread's magazine: its blocks go back to the bitmap,
+ * unless they belong to an FS instance that no longer exists.
+ */
+static void block_magazine_destroy(void *arg) {
+    block_magazine_t *magazine = (block_magazine_t *)arg;
+    lock_mutex(&block_magazines_lock);
+    block_magazine_t **link = &block_magazines;
+    while (*link != magazine) {
+        link = &(*link)->next;
+    }
+    *link = magazine->next;
+    unlock_mutex(&block_magazines_lock);
+
+    lock_mutex(&free_blocks_lock);
+    if (magazine->generation == atomic_load(&free_blocks_generation)) {
+        free_blocks_put(magazine->blocks, magazine->count);
+    }
+    unlock_mutex(&free_blocks_lock);
+    destroy_mutex(&magazine->lock);
+    free(magazine);
+}
+
+static void block_magazine_key_create() {
+    if (pthread_key_create(&block_magazine_key, block_magazine_destroy) != 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Returns the calling thread's magazine, locked, creating it on first use. A
+ * magazine left over from a previous FS instance is emptied.
+ */
+static block_magazine_t *get_block_magazine() {
+    if (pthread_once(&block_magazine_key_once, block_magazine_key_create) !=
+        0) {
+        exit(EXIT_FAILURE);
+    }
+
+    block_magazine_t *magazine =
+        (block_magazine_t *)pthread_getspecific(block_magazine_key);
+    if (magazine == NULL) {
+        magazine = (block_magazine_t *)malloc(sizeof(block_magazine_t));
+        if (magazine == NULL ||
+            pthread_setspecific(block_magazine_key, magazine) != 0) {
+            free(magazine);
+            return NULL;
+        }
+        init_mutex(&magazine->lock);
+        magazine->count = 0;
+        magazine->generation = 0;
+        lock_mutex(&block_magazines_lock);
+        magazine->next = block_magazines;
+        block_magazines = magazine;
+        unlock_mutex(&block_magazines_lock);
+    }
+
+    lock_mutex(&magazine->lock);
+    unsigned int generation = atomic_load(&free_blocks_generation);
+    if (magazine->generation != generation) {
+        magazine->count = 0;
+        magazine->generation = generation;
+    }
+    return magazine;
+}
+
+/*
+ * Drains every thread's magazine back to the bitmap, so the blocks other
+ * threads keep in reserve can still be allocated once the bitmap runs out.
+ * Magazines of a previous FS instance are left alone (see
+ * get_block_magazine).
+ * Returns: true if any blocks went back to the bitmap, false otherwise
+ */
+static bool block_magazines_drain() {
+    bool drained = false;
+    lock_mutex(&block_magazines_lock);
+    for (block_magazine_t *magazine = block_magazines; magazine != NULL;
+         magazine = magazine->next) {
+        lock_mutex(&magazine->lock);
+        if (magazine->count > 0 &&
+            magazine->generation == atomic_load(&free_blocks_generation)) {
+            lock_mutex(&free_blocks_lock);
+            free_blocks_put(magazine->blocks, magazine->count);
+            unlock_mutex(&free_blocks_lock);
+            magazine->count = 0;
+            drained = true;
+        }
+        unlock_mutex(&magazine->lock);
+    }
+    unlock_mutex(&block_magazines_lock);
+    return drained;
+}
+
 /*
  * Allocated a new data block
  * Returns: block index if successful, -1 otherwise
  */
 int data_block_alloc() {
-    for (int i = 0; i < DATA_BLOCKS; i++) {
-        write_lock_rwlock(&data_blocks_locks[i]);
-        if (i * (int) sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
+    int run_length;
+    return data_block_alloc_run(-1, 1, &run_length);
+}
+
+/*
+ * Takes a run of contiguous free data blocks
+ * Short runs are served from the calling thread's magazine, which is refilled
+ * from the bitmap when empty (refills take blocks in increasing order, so
+ * consecutive allocations are mostly contiguous). Runs longer than half a
+ * magazine are taken from the bitmap in one piece, as are runs the magazine
+ * can't start at the hint.
+ * Note that this fails while other threads' magazines may still hold free
+ * blocks (see data_block_alloc_run).
+ * Input:
+ *  - hint: block where the run should preferably start (-1 if any)
+ *  - count: number of blocks wanted
+ *  - run_length: set to the number of blocks allocated (between 1 and count)
+ * Returns: index of the run's first block if successful, -1 otherwise
+ */
+static int data_block_take_run(int hint, int count, int *run_length) {
+    if (count > BLOCK_MAGAZINE_SIZE / 2) {
+        lock_mutex(&free_blocks_lock);
+        int start = free_blocks_take_run(hint, count, run_length);
+        unlock_mutex(&free_blocks_lock);
+        return start;
+    }
+
+    block_magazine_t *magazine = get_block_magazine();
+    if (magazine == NULL) {
+        return -1;
+    }
+
+    /* A run that extends another one is taken from the bitmap if the
+     * magazine can't continue it, so a file grown by several threads in turn
+     * (e.g. appenders) doesn't get an extent per thread switch */
+    if (valid_block_number(hint) &&
+        (magazine->count == 0 ||
+         magazine->blocks[magazine->count - 1] != hint)) {
+        lock_mutex(&free_blocks_lock);
+        int start = free_blocks_take_run(hint, count, run_length);
+        unlock_mutex(&free_blocks_lock);
+        if (start != -1) {
+            unlock_mutex(&magazine->lock);
+            return start;
         }
+    }
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-            unlock_rwlock(&data_blocks_locks[i]);
-            return i;
+    if (magazine->count == 0) {
+        lock_mutex(&free_blocks_lock);
+        magazine->count =
+            free_blocks_take(magazine->blocks, BLOCK_MAGAZINE_SIZE / 2);
+        unlock_mutex(&free_blocks_lock);
+        if (magazine->count == 0) {
+            unlock_mutex(&magazine->lock);
+            return -1;
         }
-        unlock_rwlock(&data_blocks_locks[i]);
-        if (i > 1012) {
+    }
+
+    int start = magazine->blocks[--magazine->count];
+    int length = 1;
+    while (length < count && magazine->count > 0 &&
+           magazine->blocks[magazine->count - 1] == start + length) {
+        magazine->count--;
+        length++;
+    }
+    unlock_mutex(&magazine->lock);
+
+    *run_length = length;
+    return start;
 }
+
+/*
+ * Allocates a run of contiguous data blocks (see data_block_take_run); if
+ * the volume looks full, the freed blocks are reclaimed first (see
+ * epoch_reclaim; if the caller is inside an epoch, the blocks freed since it
+ * entered it can't be), and then the
+ * other threads' magazines are drained (see block_magazines_drain)
+ * Input:
+ *  - hint: block where the run should preferably start (-1 if any)
+ *  - count: number of blocks wanted
+ *  - run_length: set to the number of blocks allocated (between 1 and count)
+ * Returns: index of the run's first block if successful, -1 otherwise
+ */
+int data_block_alloc_run(int hint, int count, int *run_length) {
+    int start = data_block_take_run(hint, count, run_length);
+    if (start == -1 && epoch_reclaim()) {
+        start = data_block_take_run(hint, count, run_length);
     }
-    return -1;
+    if (start == -1 && block_magazines_drain()) {
+        start = data_block_take_run(hint, count, run_length);
+    }
+    return start;
 }
 
-/* Frees a data block
+/* Releases a data block that no reader can see, so it can be reused at once
+ * The block is kept in the calling thread's magazine; when the magazine is
+ * full, half of it is drained back to the bitmap first.
  * Input
  * 	- the block index
  * Returns: 0 if success, -1 otherwise
  */
-int data_block_free(int block_number) {
-    write_lock_rwlock(&data_blocks_locks[block_number]);
+static int data_block_release(int block_number) {
     if (!valid_block_number(block_number)) {
-        unlock_rwlock(&data_blocks_locks[block_number]);
         return -1;
     }
 
+    block_magazine_t *magazine = get_block_magazine();
+    if (magazine == NULL) {
+        return -1;
+    }
+
+    if (magazine->count == BLOCK_MAGAZINE_SIZE) {
+        magazine->count -= BLOCK_MAGAZINE_SIZE / 2;
+        lock_mutex(&free_blocks_lock);
+        free_blocks_put(magazine->blocks + magazine->count,
+                        BLOCK_MAGAZINE_SIZE / 2);
+        unlock_mutex(&free_blocks_lock);
+    }
+
+    magazine->blocks[magazine->count++] = block_number;
+    unlock_mutex(&magazine->lock);
+    return 0;
+}
+
+/* Releases a run of contiguous data blocks that no reader can see
+ * Runs longer than half a magazine go straight back to the bitmap.
+ * Input
+ * 	- the index of the run's first block
+ * 	- the number of blocks in the run
+ * Returns: 0 if success, -1 otherwise
+ */
+static int data_block_release_run(int block_number, int run_length) {
+    if (!valid_block_number(block_number) ||
+        !valid_block_number(block_number + run_length - 1)) {
+        return -1;
+    }
+
+    if (run_length <= BLOCK_MAGAZINE_SIZE / 2) {
+        for (int i = 0; i < run_length; i++) {
+            if (data_block_release(block_number + i) == -1) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    lock_mutex(&free_blocks_lock);
     insert_delay(); // simulate storage access delay to free_blocks
-    free_blocks[block_number] = FREE;
-    unlock_rwlock(&data_blocks_locks[block_number]);
+    for (int block = block_number; block < block_number + run_length;
+         block++) {
+        free_blocks[block / FREE_BLOCKS_WORD_BITS] &=
+            ~((uint64_t)1 << (block % FREE_BLOCKS_WORD_BITS));
+    }
+    unlock_mutex(&free_blocks_lock);
+    return 0;
+}
+
+/*
+ * Enters a read-side critical section: until epoch_exit() is called, the
+ * blocks that the caller may see (e.g. through a snapshot of an i-node)
+ * aren't reused, even if they are freed meanwhile. The caller must not wait
+ * for any lock until it exits the epoch (see epoch_reclaim)
+ * Returns the epoch entered, to be given to epoch_exit()
+ */
+unsigned int epoch_enter() {
+    for (;;) {
+        unsigned int entered = atomic_load(&epoch);
+        atomic_fetch_add(&epoch_readers[entered % 2], 1);
+        /* If the epoch advanced meanwhile, the counter may belong to the
+         * next one already */
+        if (atomic_load(&epoch) == entered) {
+            return entered;
+        }
+        atomic_fetch_sub(&epoch_readers[entered % 2], 1);
+    }
+}
+
+void epoch_exit(unsigned int entered) {
+    atomic_fetch_sub(&epoch_readers[entered % 2], 1);
+}
+
+/*
+ * Advances the epoch if the readers of the previous one have all left,
+ * returning the blocks freed during the previous epoch to the bitmap.
+ * Must be called with epoch_lock held.
+ * Returns: true if the epoch advanced, false otherwise
+ */
+static bool epoch_try_advance() {
+    unsigned int current = atomic_load(&epoch);
+    unsigned int previous = (current + 1) % 2;
+    if (atomic_load(&epoch_readers[previous]) != 0) {
+        return false;
+    }
+
+    lock_mutex(&free_blocks_lock);
+    free_blocks_put(epoch_limbo[previous], epoch_limbo_count[previous]);
+    unlock_mutex(&free_blocks_lock);
+    epoch_limbo_count[previous] = 0;
+    atomic_store(&epoch, current + 1);
+    return true;
+}
+
+/*
+ * Reclaims the freed blocks, advancing the epoch up to twice (and waiting for
+ * the readers of the previous epochs to leave). Readers never wait for
+ * anything inside an epoch, but a reader may still stay in one for long (e.g.
+ * if it is preempted), so the wait is given up after EPOCH_RECLAIM_ATTEMPTS
+ * tries, and only the blocks of the epochs that could be advanced are
+ * reclaimed.
+ * Returns: true if any blocks were reclaimed, false otherwise
+ */
+static bool epoch_reclaim() {
+    lock_mutex(&epoch_lock);
+    bool pending = epoch_limbo_count[0] + epoch_limbo_count[1] > 0;
+    unlock_mutex(&epoch_lock);
+    if (!pending) {
+        return false;
+    }
+
+    int advanced = 0;
+    for (int attempt = 0; attempt < EPOCH_RECLAIM_ATTEMPTS && advanced < 2;
+         attempt++) {
+        lock_mutex(&epoch_lock);
+        if (epoch_try_advance()) {
+            advanced++;
+        }
+        unlock_mutex(&epoch_lock);
+        if (advanced < 2) {
+            sched_yield();
+        }
+    }
+    return advanced > 0;
+}
+
+/* Frees a data block
+ * Readers may still see the block (see epoch_enter), so it is kept in the
+ * current epoch's limbo list, and only reused once they have all left.
+ * Input
+ * 	- the block index
+ * Returns: 0 if success, -1 otherwise
+ */
+int data_block_free(int block_number) {
+    return data_block_free_run(block_number, 1);
+}
+
+/* Frees a run of contiguous data blocks (see data_block_free)
+ * Input
+ * 	- the index of the run's first block
+ * 	- the number of blocks in the run
+ * Returns: 0 if success, -1 otherwise
+ */
+int data_block_free_run(int block_number, int run_length) {
+    if (!valid_block_number(block_number) ||
+        !valid_block_number(block_number + run_length - 1)) {
+        return -1;
+    }
+
+    lock_mutex(&epoch_lock);
+    unsigned int current = atomic_load(&epoch) % 2;
+    for (int i = 0; i < run_length; i++) {
+        epoch_limbo[current][epoch_limbo_count[current]++] = block_number + i;
+    }
+    epoch_try_advance();
+    unlock_mutex(&epoch_lock);
     return 0;
 }
 
@@ -458,57 +1462,98 @@ void *data_block_get(int block_number) {
  * Inputs:
  * 	- I-node number of the file to open
  * 	- Initial offset
+ * 	- Whether writes append to the end of the file (TFS_O_APPEND)
  * Returns: file handle if successful, -1 otherwise
  */
-int add_to_open_file_table(int inumber, size_t offset) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        write_lock_rwlock(&open_file_table_locks[i]);
-        if (free_open_file_entries[i] == FREE) {
-            lock_mutex(&open_files_mutex);
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            open_files_count++;
-            unlock_rwlock(&open_file_table_locks[i]);
-            unlock_mutex(&open_files_mutex);
-            return i;
-        }
-        unlock_rwlock(&open_file_table_locks[i]);
+int add_to_open_file_table(int inumber, size_t offset, bool append) {
+    for (size_t w = 0; w < OPEN_FILES_WORDS; w++) {
+        uint64_t word = atomic_load(&open_file_bitmap[w]);
+        while (word != UINT64_MAX) {
+            /* Claims the word's first free slot (on failure, the CAS reloads
+             * the word, and the next free slot is tried) */
+            int bit = __builtin_ctzll(~word);
+            if (!atomic_compare_exchange_weak(&open_file_bitmap[w], &word,
+                                              word | (uint64_t)1 << bit)) {
+                continue;
+            }
+            atomic_fetch_add(&open_files_count, 1);
+
+            /* The slot's lock is only held by threads that still use a stale
+             * handle to it, so it is free most of the time */
+            int slot = (int)(w * OPEN_FILES_WORD_BITS) + bit;
+            write_lock_rwlock(&open_file_table_locks[slot]);
+            open_file_table[slot].of_inumber = inumber;
+            open_file_table[slot].of_offset = offset;
+            open_file_table[slot].of_append = append;
+            unsigned int generation = atomic_load(&open_file_generations[slot]);
+            unlock_rwlock(&open_file_table_locks[slot]);
+            return (int)(generation << HANDLE_SLOT_BITS) | slot;
+        }
     }
     return -1;
 }
 
+/* Decrements the number of open files; whoever closes the last one does it
+ * while holding open_files_mutex, so tfs_destroy_after_all_closed() can't
+ * tear down the FS before it is done signalling */
+static void open_files_count_decrement() {
+    int count = atomic_load(&open_files_count);
+    while (count > 1) {
+        if (atomic_compare_exchange_weak(&open_files_count, &count,
+                                         count - 1)) {
+            return;
+        }
+    }
+
+    lock_mutex(&open_files_mutex);
+    if (atomic_fetch_sub(&open_files_count, 1) == 1) {
+        pthread_cond_signal(&open_files_cond);
+    }
+    unlock_mutex(&open_files_mutex);
+}
+
 /* Frees an entry from the open file table
  * Inputs:
  * 	- file handle to free/close
  * Returns 0 is success, -1 otherwise
  */
 int remove_from_open_file_table(int fhandle) {
-    read_lock_rwlock(&open_file_table_locks[fhandle]);
-    if (!valid_file_handle(fhandle) ||
-        free_open_file_entries[fhandle] != TAKEN) {
-        unlock_rwlock(&open_file_table_locks[fhandle]);
+    if (!valid_file_handle(fhandle)) {
         return -1;
     }
-    lock_mutex(&open_files_mutex);
-    open_files_count--;
-    if (open_files_count == 0) {
-        pthread_cond_signal(&open_files_cond);
+    int slot = handle_slot(fhandle);
+    write_lock_rwlock(&open_file_table_locks[slot]);
+    if (get_open_file_entry(fhandle) == NULL) {
+        unlock_rwlock(&open_file_table_locks[slot]);
+        return -1;
     }
-    free_open_file_entries[fhandle] = FREE;
-    unlock_mutex(&open_files_mutex);
-    unlock_rwlock(&open_file_table_locks[fhandle]);
+    /* Invalidates every handle to the slot before releasing it */
+    atomic_store(&open_file_generations[slot],
+                 (handle_generation(fhandle) + 1) & HANDLE_GENERATION_MASK);
+    unlock_rwlock(&open_file_table_locks[slot]);
+
+    atomic_fetch_and(&open_file_bitmap[slot / OPEN_FILES_WORD_BITS],
+                     ~((uint64_t)1 << (slot % OPEN_FILES_WORD_BITS)));
+    open_files_count_decrement();
     return 0;
 }
 
 /* Returns pointer to a given entry in the open file table
  * Inputs:
  * 	 - file handle
- * Returns: pointer to the entry if sucessful, NULL otherwise
+ * Returns: pointer to the entry if sucessful, NULL otherwise (including when
+ * the handle was already closed)
  */
 open_file_entry_t *get_open_file_entry(int fhandle) {
     if (!valid_file_handle(fhandle)) {
         return NULL;
     }
-    return &open_file_table[fhandle];
+    int slot = handle_slot(fhandle);
+    uint64_t word = atomic_load(&open_file_bitmap[slot / OPEN_FILES_WORD_BITS]);
+    if (!(word & (uint64_t)1 << (slot % OPEN_FILES_WORD_BITS)) ||
+        atomic_load(&open_file_generations[slot]) !=
+            handle_generation(fhandle)) {
+        return NULL;
+    }
+    return &open_file_table[slot];
 }
@@ -3,6 +3,8 @@
 
 #include "config.h"
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -10,39 +12,114 @@
 
 /*
  * Directory entry
+ * An entry is published by storing its i-number (with release semantics)
+ * after its name, so lookups can read entries without locking them; -1
+ * marks a free entry, and DIR_ENTRY_CLAIMED one whose name is being filled
  */
 typedef struct {
     char d_name[MAX_FILE_NAME];
-    int d_inumber;
+    atomic_int d_inumber;
 } dir_entry_t;
 
+#define DIR_ENTRY_CLAIMED (-2)
+
 typedef enum { T_FILE, T_DIRECTORY } inode_type;
 
+/*
+ * Extent: a run of e_length contiguous data blocks, starting at data block
+ * e_start, which holds the file blocks starting at e_file_block
+ */
+typedef struct {
+    int e_file_block;
+    int e_start;
+    int e_length;
+} extent_t;
+
+/* Number of extents held by each of a file's extent blocks, and the number
+ * of extent blocks a file may have: enough for a file to take every data
+ * block, even if none of them is contiguous with the previous one */
+#define EXTENTS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(extent_t)))
+#define MAX_EXTENT_BLOCKS                                                      \
+    ((DATA_BLOCKS - MAX_FILE_EXTENTS + EXTENTS_PER_BLOCK - 1) /                \
+     EXTENTS_PER_BLOCK)
+
 /*
  * I-node
+ * The file's blocks are mapped by extents, sorted by e_file_block: the first
+ * MAX_FILE_EXTENTS of them are kept in the i-node, and the rest in its
+ * extent blocks (see inode_extent), so the size of a file never depends on
+ * how fragmented its blocks are
  */
 typedef struct {
     inode_type i_node_type;
     size_t i_size;
-    int i_data_block[MAX_DIRECT_BLOCKS];
-    int i_indirect_data_block;
+    extent_t i_extents[MAX_FILE_EXTENTS];
+    int i_extent_count;
+    int i_extent_blocks[MAX_EXTENT_BLOCKS];
     /* in a real FS, more fields would exist here */
 } inode_t;
 
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
+/*
+ * Range of blocks held in an i-node's range lock (see inode_range_lock); it
+ * is kept by the holder (e.g. in its stack) while the range is locked
+ */
+typedef struct range_lock_entry {
+    size_t rl_first_block;
+    size_t rl_end_block;
+    bool rl_write;
+    struct range_lock_entry *rl_next;
+} range_lock_entry_t;
+
 /*
  * Open file entry (in open file table)
  */
 typedef struct {
     int of_inumber;
     size_t of_offset;
+    bool of_append;
 } open_file_entry_t;
 
+/*
+ * Pending append to a file (see get_inode_append_queue); it is kept by the
+ * appending thread (e.g. in its stack) until it is done
+ */
+typedef struct append_request {
+    void const *ar_buffer;
+    size_t ar_len;
+    ssize_t ar_written;
+    size_t ar_end;
+    bool ar_done;
+    struct append_request *ar_next;
+} append_request_t;
+
+/*
+ * Queue of the pending appends to a file, which are done in batches by
+ * whichever appender is the combiner
+ */
+typedef struct {
+    pthread_mutex_t aq_mutex;
+    pthread_cond_t aq_done;
+    append_request_t *aq_head;
+    append_request_t **aq_tail;
+    bool aq_combining;
+} append_queue_t;
+
 #define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
 
 pthread_rwlock_t *get_inode_table_lock(int inumber);
+pthread_rwlock_t *get_inode_map_lock(int inumber);
+append_queue_t *get_inode_append_queue(int inumber);
+void inode_write_begin(int inumber);
+void inode_write_end(int inumber);
+void inode_write_lock(int inumber);
+void inode_write_unlock(int inumber);
+void inode_range_lock(int inumber, range_lock_entry_t *range, size_t offset,
+                      size_t len, bool write);
+void inode_range_unlock(int inumber, range_lock_entry_t *range);
 pthread_rwlock_t *get_open_file_table_lock(int file_handle);
+pthread_mutex_t *get_dir_name_lock(char const *name);
 
 void lock_mutex(pthread_mutex_t *mutex);
 void read_lock_rwlock(pthread_rwlock_t *rwlock);
@@ -54,33 +131,43 @@ void init_rwlock(pthread_rwlock_t *rwlock);
 void destroy_mutex(pthread_mutex_t *mutex);
 void destroy_rwlock(pthread_rwlock_t *rwlock);
 
-void state_init();
+void state_init(unsigned spins);
 void state_destroy();
 
 int inode_create(inode_type n_type);
 int inode_delete(int inumber);
 inode_t *inode_get(int inumber);
+bool inode_snapshot(int inumber, inode_t *snapshot, unsigned int *seq);
+bool inode_changed_since(int inumber, unsigned int seq);
+extent_t *inode_extent(inode_t const *inode, int index);
+int inode_block_map(inode_t const *inode, int file_block, int *run_length);
+int inode_block_alloc(inode_t *inode, int file_block, int count,
+                      int *run_length);
+int inode_free_blocks(inode_t *inode);
 
 int clear_dir_entry(int inumber, int sub_inumber);
 int add_dir_entry(int inumber, int sub_inumber, char const *sub_name);
 int find_in_dir(int inumber, char const *sub_name);
 
 int data_block_alloc();
+int data_block_alloc_run(int hint, int count, int *run_length);
 int data_block_free(int block_number);
+int data_block_free_run(int block_number, int run_length);
+unsigned int epoch_enter();
+void epoch_exit(unsigned int entered);
 void *data_block_get(int block_number);
 
-int add_to_open_file_table(int inumber, size_t offset);
+int add_to_open_file_table(int inumber, size_t offset, bool append);
 int remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
 
 /* Stores the number of currently open files - useful for the function
  * tfs_destroy_after_all_closed() */
-extern int open_files_count;
+extern atomic_int open_files_count;
 
 /* Condition variable and mutex for the tfs_destroy_after_all_closed()
  * function - related to all files being closed (or not) */
 extern pthread_cond_t open_files_cond;
 extern pthread_mutex_t open_files_mutex;
-extern pthread_mutex_t open_file_lock;
 
 #endif // STATE_H
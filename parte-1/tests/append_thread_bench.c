@@ -0,0 +1,104 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Throughput benchmark for concurrent appenders: for 1 up to MAX_THREAD_COUNT
+ * threads, each thread opens the same log file with TFS_O_APPEND and appends
+ * small records to it, one per tfs_write call. The throughput for each
+ * thread count is printed, and the log is checked to hold every record of
+ * every thread, whole and in each thread's order. */
+
+#define MAX_THREAD_COUNT 8
+#define RECORD_SIZE 32
+#define LOG_SIZE (DATA_BLOCKS * BLOCK_SIZE / 2)
+#define RECORDS_PER_THREAD (LOG_SIZE / RECORD_SIZE / MAX_THREAD_COUNT)
+
+static char const *path = "/log";
+
+void *append_file_thread(void *arg);
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Checks that the log holds every record, in each thread's order */
+static void check_log(int thread_count) {
+    static char log[LOG_SIZE];
+    int next[MAX_THREAD_COUNT] = {0};
+    int records = thread_count * RECORDS_PER_THREAD;
+
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, log, LOG_SIZE) == records * RECORD_SIZE);
+    assert(tfs_close(f) != -1);
+
+    for (int i = 0; i < records; i++) {
+        int thread, record;
+        assert(sscanf(log + i * RECORD_SIZE, "%d %d", &thread, &record) == 2);
+        assert(thread >= 0 && thread < thread_count);
+        assert(record == next[thread]);
+        next[thread]++;
+    }
+}
+
+int main() {
+    pthread_t tid[MAX_THREAD_COUNT];
+    int table[MAX_THREAD_COUNT];
+    struct timespec start, end;
+
+    printf("%-10s %-10s %s\n", "threads", "records", "records/s");
+    for (int thread_count = 1; thread_count <= MAX_THREAD_COUNT;
+         thread_count *= 2) {
+        assert(tfs_init() != -1);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < thread_count; ++i) {
+            table[i] = i;
+            if (pthread_create(&tid[i], NULL, append_file_thread,
+                               &table[i]) != 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        for (int i = 0; i < thread_count; ++i) {
+            pthread_join(tid[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        int records = thread_count * RECORDS_PER_THREAD;
+        printf("%-10d %-10d %.0f\n", thread_count, records,
+               records / elapsed_s(&start, &end));
+
+        check_log(thread_count);
+        assert(tfs_destroy() != -1);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void *append_file_thread(void *arg) {
+    int thread = *((int *)arg);
+    char record[RECORD_SIZE];
+
+    int f = tfs_open(path, TFS_O_APPEND);
+    assert(f != -1);
+
+    for (int i = 0; i < RECORDS_PER_THREAD; i++) {
+        memset(record, ' ', RECORD_SIZE);
+        snprintf(record, RECORD_SIZE, "%d %d", thread, i);
+        assert(tfs_write(f, record, RECORD_SIZE) == RECORD_SIZE);
+    }
+
+    assert(tfs_close(f) != -1);
+
+    return NULL;
+}
@@ -0,0 +1,69 @@
+#include "fs/state.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Measures the cost of data_block_alloc() as the volume fills up: the
+ * volume is filled in steps and the average cost of the allocations done in
+ * each step is printed, down to the last 1% of free blocks. At 99% full, some
+ * blocks are also freed at random and allocated again (churn), which is what
+ * a mostly full image sees in steady state. */
+
+#define CHURN_ROUNDS (2000)
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 +
+           (double)(end->tv_nsec - start->tv_nsec);
+}
+
+int main() {
+    int fill_steps[] = {0, 25, 50, 75, 90, 95, 99};
+    size_t step_count = sizeof(fill_steps) / sizeof(fill_steps[0]);
+    int blocks[DATA_BLOCKS];
+    int allocated = 0;
+    struct timespec start, end;
+
+    state_init(LOCK_SPINS);
+
+    printf("%-12s %-12s %s\n", "fill (%)", "allocs", "ns/alloc");
+    for (size_t i = 1; i < step_count; i++) {
+        int target = DATA_BLOCKS * fill_steps[i] / 100;
+        int count = target - allocated;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (; allocated < target; allocated++) {
+            blocks[allocated] = data_block_alloc();
+            assert(blocks[allocated] != -1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        printf("%3d -> %-5d %-12d %.0f\n", fill_steps[i - 1], fill_steps[i],
+               count, elapsed_ns(&start, &end) / count);
+    }
+
+    srand(0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < CHURN_ROUNDS; i++) {
+        int victim = rand() % allocated;
+        assert(data_block_free(blocks[victim]) == 0);
+        blocks[victim] = data_block_alloc();
+        assert(blocks[victim] != -1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%-12s %-12d %.0f\n", "99 (churn)", CHURN_ROUNDS,
+           elapsed_ns(&start, &end) / CHURN_ROUNDS);
+
+    /* The remaining free blocks must all still be reachable */
+    while (allocated < DATA_BLOCKS) {
+        assert(data_block_alloc() != -1);
+        allocated++;
+    }
+    assert(data_block_alloc() == -1);
+
+    state_destroy();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Several threads create (and look up) the same set of files at once: each
+    name must end up with exactly one file, which every thread then sees,
+    and files with different names must be different.
+*/
+
+#define THREAD_COUNT (8)
+#define FILE_COUNT (16)
+
+static int inumbers[THREAD_COUNT][FILE_COUNT];
+
+void *create_files(void *arg);
+
+static void file_name(char *name, int file) {
+    snprintf(name, MAX_FILE_NAME, "/f%d", file);
+}
+
+int main() {
+    assert(tfs_init() != -1);
+
+    pthread_t tid[THREAD_COUNT];
+    int table[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        table[i] = i;
+        assert(pthread_create(&tid[i], NULL, create_files, &table[i]) == 0);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    char name[MAX_FILE_NAME];
+    for (int file = 0; file < FILE_COUNT; file++) {
+        file_name(name, file);
+        int inumber = tfs_lookup(name);
+        assert(inumber >= 0);
+        for (int i = 0; i < THREAD_COUNT; i++) {
+            assert(inumbers[i][file] == inumber);
+        }
+        for (int other = 0; other < file; other++) {
+            assert(inumbers[0][other] != inumber);
+        }
+    }
+    assert(tfs_lookup("/f") == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void *create_files(void *arg) {
+    int thread = *((int *)arg);
+    char name[MAX_FILE_NAME];
+
+    /* Each thread starts at a different file, so that all of them race */
+    for (int i = 0; i < FILE_COUNT; i++) {
+        int file = (thread + i) % FILE_COUNT;
+        file_name(name, file);
+        int f = tfs_open(name, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+        inumbers[thread][file] = tfs_lookup(name);
+        assert(inumbers[thread][file] >= 0);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,60 @@
+#include "fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+
+/*  A reader stays inside an epoch while the volume is full and some blocks
+    were freed after it entered. An allocation must give up (rather than
+    wait for the reader) and fail, and succeed once the reader has left.
+*/
+
+static pthread_barrier_t entered;
+static pthread_barrier_t leave;
+
+void *stay_in_epoch(void *arg) {
+    (void)arg;
+    unsigned int epoch = epoch_enter();
+    pthread_barrier_wait(&entered);
+    pthread_barrier_wait(&leave);
+    epoch_exit(epoch);
+    return NULL;
+}
+
+int main() {
+    static int blocks[DATA_BLOCKS];
+
+    state_init(LOCK_SPINS);
+    assert(pthread_barrier_init(&entered, NULL, 2) == 0);
+    assert(pthread_barrier_init(&leave, NULL, 2) == 0);
+
+    for (int i = 0; i < DATA_BLOCKS; i++) {
+        blocks[i] = data_block_alloc();
+        assert(blocks[i] != -1);
+    }
+    assert(data_block_alloc() == -1);
+
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, stay_in_epoch, NULL) == 0);
+    pthread_barrier_wait(&entered);
+
+    /* The reader may see every block freed from now on */
+    for (int i = 0; i < DATA_BLOCKS / 2; i++) {
+        assert(data_block_free(blocks[i]) == 0);
+    }
+    assert(data_block_alloc() == -1);
+
+    pthread_barrier_wait(&leave);
+    assert(pthread_join(tid, NULL) == 0);
+    for (int i = 0; i < DATA_BLOCKS / 2; i++) {
+        assert(data_block_alloc() != -1);
+    }
+    assert(data_block_alloc() == -1);
+
+    assert(pthread_barrier_destroy(&entered) == 0);
+    assert(pthread_barrier_destroy(&leave) == 0);
+    state_destroy();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Grows two files in turn, one block at a time, so that their blocks are
+    interleaved in the volume, and checks that both reach a size far past
+    what the extents kept in an i-node could map. Then writes a sparse file
+    with many more separate regions than those extents, and checks that all
+    the files read back whole.
+*/
+
+#define FILE_BLOCKS (300)
+#define REGION_COUNT (10 * MAX_FILE_EXTENTS)
+
+static void check_file(char const *path, char first_letter) {
+    char output[BLOCK_SIZE];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    for (int i = 0; i < FILE_BLOCKS; i++) {
+        assert(tfs_read(f, output, BLOCK_SIZE) == BLOCK_SIZE);
+        for (int j = 0; j < BLOCK_SIZE; j++) {
+            assert(output[j] == first_letter + i % 13);
+        }
+    }
+    assert(tfs_read(f, output, BLOCK_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    char input[BLOCK_SIZE];
+
+    assert(tfs_init() != -1);
+
+    int a = tfs_open("/a", TFS_O_CREAT);
+    int b = tfs_open("/b", TFS_O_CREAT);
+    assert(a != -1 && b != -1);
+    for (int i = 0; i < FILE_BLOCKS; i++) {
+        memset(input, 'a' + i % 13, BLOCK_SIZE);
+        assert(tfs_write(a, input, BLOCK_SIZE) == BLOCK_SIZE);
+        memset(input, 'n' + i % 13, BLOCK_SIZE);
+        assert(tfs_write(b, input, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(tfs_close(a) != -1);
+    assert(tfs_close(b) != -1);
+
+    check_file("/a", 'a');
+    check_file("/b", 'n');
+
+    /* One byte every other block: each byte is a region of its own */
+    int f = tfs_open("/sparse", TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < REGION_COUNT; i++) {
+        char byte = (char)('a' + i % 26);
+        assert(tfs_seek(f, 2 * i * BLOCK_SIZE, SEEK_SET) == 2 * i * BLOCK_SIZE);
+        assert(tfs_write(f, &byte, 1) == 1);
+    }
+    assert(inode_get(tfs_lookup("/sparse"))->i_extent_count == REGION_COUNT);
+
+    for (int i = 0; i < REGION_COUNT; i++) {
+        char output[2];
+        assert(tfs_seek(f, 2 * i * BLOCK_SIZE, SEEK_SET) == 2 * i * BLOCK_SIZE);
+        assert(tfs_read(f, output, 2) == (i < REGION_COUNT - 1 ? 2 : 1));
+        assert(output[0] == 'a' + i % 26);
+        assert(i == REGION_COUNT - 1 || output[1] == 0);
+    }
+    assert(tfs_close(f) != -1);
+
+    /* Truncating frees the extent blocks along with the data blocks, so the
+     * files can be written again */
+    for (int round = 0; round < 2; round++) {
+        a = tfs_open("/a", TFS_O_TRUNC);
+        b = tfs_open("/b", TFS_O_TRUNC);
+        assert(a != -1 && b != -1);
+        for (int i = 0; i < FILE_BLOCKS; i++) {
+            memset(input, 'a' + i % 13, BLOCK_SIZE);
+            assert(tfs_write(a, input, BLOCK_SIZE) == BLOCK_SIZE);
+            memset(input, 'n' + i % 13, BLOCK_SIZE);
+            assert(tfs_write(b, input, BLOCK_SIZE) == BLOCK_SIZE);
+        }
+        assert(tfs_close(a) != -1);
+        assert(tfs_close(b) != -1);
+    }
+    check_file("/a", 'a');
+    check_file("/b", 'n');
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include "fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+
+/*  Several threads allocate a block each, which leaves the rest of a refill
+    in each thread's magazine, and then stay alive. The main thread must
+    still be able to allocate every other block of the volume: the blocks
+    kept in the other threads' magazines aren't lost.
+*/
+
+#define THREAD_COUNT (8)
+
+static pthread_barrier_t allocated;
+static pthread_barrier_t done;
+
+void *allocate_one(void *arg) {
+    (void)arg;
+    assert(data_block_alloc() != -1);
+    pthread_barrier_wait(&allocated);
+    pthread_barrier_wait(&done);
+    return NULL;
+}
+
+int main() {
+    state_init(LOCK_SPINS);
+    assert(pthread_barrier_init(&allocated, NULL, THREAD_COUNT + 1) == 0);
+    assert(pthread_barrier_init(&done, NULL, THREAD_COUNT + 1) == 0);
+
+    pthread_t tid[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&tid[i], NULL, allocate_one, NULL) == 0);
+    }
+    pthread_barrier_wait(&allocated);
+
+    int count = 0;
+    while (data_block_alloc() != -1) {
+        count++;
+    }
+    assert(count == DATA_BLOCKS - THREAD_COUNT);
+
+    pthread_barrier_wait(&done);
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+    assert(pthread_barrier_destroy(&allocated) == 0);
+    assert(pthread_barrier_destroy(&done) == 0);
+    state_destroy();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Readers that don't lock the i-node must never see a torn write: a writer
+    keeps rewriting a whole file (with a single tfs_pwrite, each time filled
+    with a different letter) while readers read it back, through handles of
+    their own, and check that it is made of a single letter.
+*/
+
+#define READER_COUNT (4)
+#define FILE_SIZE (4 * BLOCK_SIZE)
+#define WRITES (200)
+
+static char const *path = "/f1";
+static int writes_done = 0;
+static pthread_mutex_t writes_done_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *write_file(void *arg);
+void *read_file(void *arg);
+
+int main() {
+    pthread_t writer;
+    pthread_t readers[READER_COUNT];
+    char input[FILE_SIZE];
+    memset(input, 'a', FILE_SIZE);
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, input, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    assert(pthread_create(&writer, NULL, write_file, NULL) == 0);
+    for (int i = 0; i < READER_COUNT; i++) {
+        assert(pthread_create(&readers[i], NULL, read_file, NULL) == 0);
+    }
+    assert(pthread_join(writer, NULL) == 0);
+    for (int i = 0; i < READER_COUNT; i++) {
+        assert(pthread_join(readers[i], NULL) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void *write_file(void *arg) {
+    (void)arg;
+    char input[FILE_SIZE];
+
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    for (int i = 0; i < WRITES; i++) {
+        memset(input, 'a' + i % 26, FILE_SIZE);
+        assert(tfs_pwrite(f, input, FILE_SIZE, 0) == FILE_SIZE);
+    }
+    assert(tfs_close(f) != -1);
+
+    pthread_mutex_lock(&writes_done_lock);
+    writes_done = 1;
+    pthread_mutex_unlock(&writes_done_lock);
+
+    return NULL;
+}
+
+void *read_file(void *arg) {
+    (void)arg;
+    char output[FILE_SIZE];
+
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    for (;;) {
+        pthread_mutex_lock(&writes_done_lock);
+        int done = writes_done;
+        pthread_mutex_unlock(&writes_done_lock);
+
+        assert(tfs_read(f, output, FILE_SIZE) == FILE_SIZE);
+        assert(tfs_seek(f, 0, SEEK_SET) == 0);
+        for (int i = 1; i < FILE_SIZE; i++) {
+            assert(output[i] == output[0]);
+        }
+
+        if (done) {
+            break;
+        }
+    }
+    assert(tfs_close(f) != -1);
+
+    return NULL;
+}
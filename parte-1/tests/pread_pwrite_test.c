@@ -0,0 +1,82 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that tfs_pwrite/tfs_pread work at arbitrary offsets without moving
+    the file's offset, and that several threads can read different parts of
+    a file through the same handle at once.
+*/
+
+#define THREAD_COUNT (8)
+#define CHUNK_SIZE (BLOCK_SIZE / 2 + 3)
+#define FILE_SIZE (THREAD_COUNT * CHUNK_SIZE)
+#define ROUNDS (50)
+
+static int f;
+static char contents[FILE_SIZE];
+
+void *read_chunk(void *arg);
+
+int main() {
+    char *path = "/f1";
+    char output[FILE_SIZE];
+
+    for (int i = 0; i < FILE_SIZE; i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+
+    /* Writes the chunks backwards, the first one past the end of the file */
+    for (int i = THREAD_COUNT - 1; i >= 0; i--) {
+        assert(tfs_pwrite(f, contents + i * CHUNK_SIZE, CHUNK_SIZE,
+                          (size_t)i * CHUNK_SIZE) == CHUNK_SIZE);
+    }
+    assert(tfs_seek(f, 0, SEEK_CUR) == 0);
+
+    /* Positional reads don't move the offset either */
+    assert(tfs_pread(f, output, FILE_SIZE, 0) == FILE_SIZE);
+    assert(memcmp(output, contents, FILE_SIZE) == 0);
+    assert(tfs_pread(f, output, FILE_SIZE, FILE_SIZE - 10) == 10);
+    assert(tfs_pread(f, output, FILE_SIZE, FILE_SIZE + 10) == 0);
+    assert(tfs_read(f, output, FILE_SIZE) == FILE_SIZE);
+    assert(memcmp(output, contents, FILE_SIZE) == 0);
+
+    pthread_t tid[THREAD_COUNT];
+    int table[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        table[i] = i;
+        assert(pthread_create(&tid[i], NULL, read_chunk, &table[i]) == 0);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_pread(f, output, FILE_SIZE, 0) == -1);
+    assert(tfs_pwrite(f, output, FILE_SIZE, 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void *read_chunk(void *arg) {
+    int chunk = *((int *)arg);
+    char output[CHUNK_SIZE];
+
+    for (int i = 0; i < ROUNDS; i++) {
+        assert(tfs_pread(f, output, CHUNK_SIZE, (size_t)chunk * CHUNK_SIZE) ==
+               CHUNK_SIZE);
+        assert(memcmp(output, contents + chunk * CHUNK_SIZE, CHUNK_SIZE) == 0);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,80 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Writes a file with holes (by seeking past its end before writing) and
+    checks that the holes read back as zeros without taking any data blocks,
+    also after a write lands in the middle of a hole.
+*/
+
+#define HOLE_BLOCKS (8)
+#define FILE_SIZE (HOLE_BLOCKS * BLOCK_SIZE + 2 * BLOCK_SIZE)
+
+static int allocated_blocks(char const *path) {
+    inode_t *inode = inode_get(tfs_lookup(path));
+    assert(inode != NULL);
+    int blocks = 0;
+    for (int i = 0; i < inode->i_extent_count; i++) {
+        blocks += inode_extent(inode, i)->e_length;
+    }
+    return blocks;
+}
+
+int main() {
+    char *path = "/sparse";
+    char expected[FILE_SIZE];
+    char output[FILE_SIZE];
+    memset(expected, 0, sizeof(expected));
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+
+    /* Some data, a hole inside the first block and then a hole of
+     * HOLE_BLOCKS blocks */
+    assert(tfs_write(f, "head", 4) == 4);
+    assert(tfs_seek(f, 100, SEEK_SET) == 100);
+    assert(tfs_write(f, "mid", 3) == 3);
+    assert(tfs_seek(f, (HOLE_BLOCKS + 1) * BLOCK_SIZE, SEEK_CUR) ==
+           103 + (HOLE_BLOCKS + 1) * BLOCK_SIZE);
+    assert(tfs_write(f, "tail", 4) == 4);
+    memcpy(expected, "head", 4);
+    memcpy(expected + 100, "mid", 3);
+    memcpy(expected + 103 + (HOLE_BLOCKS + 1) * BLOCK_SIZE, "tail", 4);
+    size_t size = 107 + (HOLE_BLOCKS + 1) * BLOCK_SIZE;
+    assert(allocated_blocks(path) == 2);
+
+    assert(tfs_seek(f, 0, SEEK_END) == (ssize_t)size);
+    assert(tfs_seek(f, -1, SEEK_SET) == -1);
+    assert(tfs_seek(f, SSIZE_MAX, SEEK_END) == -1);
+    assert(tfs_seek(f, 0, SEEK_SET) == 0);
+    assert(tfs_read(f, output, sizeof(output)) == size);
+    assert(memcmp(expected, output, size) == 0);
+
+    /* Fills a bit of the middle of the hole */
+    assert(tfs_seek(f, 4 * BLOCK_SIZE + 10, SEEK_SET) == 4 * BLOCK_SIZE + 10);
+    assert(tfs_write(f, "hole", 4) == 4);
+    memcpy(expected + 4 * BLOCK_SIZE + 10, "hole", 4);
+    assert(allocated_blocks(path) == 3);
+
+    /* Reading past the end of the file reads nothing */
+    assert(tfs_seek(f, FILE_SIZE, SEEK_SET) == FILE_SIZE);
+    assert(tfs_read(f, output, sizeof(output)) == 0);
+
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, output, sizeof(output)) == size);
+    assert(memcmp(expected, output, size) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
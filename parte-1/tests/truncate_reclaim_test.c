@@ -0,0 +1,72 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  One thread keeps truncating a file and filling it again with a new letter,
+    while other threads read it: each read must see either the empty file or
+    a whole version of it (never blocks that were freed and reused). The file
+    is rewritten often enough to go through the volume's blocks twice, so
+    the freed blocks must be reclaimed as well.
+*/
+
+#define READER_COUNT (4)
+#define FILE_SIZE (8 * BLOCK_SIZE)
+#define VERSIONS ((2 * DATA_BLOCKS * BLOCK_SIZE) / FILE_SIZE)
+
+static char const *path = "/f1";
+static atomic_bool done;
+
+void *read_versions(void *arg);
+
+int main() {
+    static char contents[FILE_SIZE];
+
+    assert(tfs_init() != -1);
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+
+    pthread_t tid[READER_COUNT];
+    for (int i = 0; i < READER_COUNT; i++) {
+        assert(pthread_create(&tid[i], NULL, read_versions, NULL) == 0);
+    }
+
+    for (int version = 0; version < VERSIONS; version++) {
+        memset(contents, 'a' + version % 26, FILE_SIZE);
+        f = tfs_open(path, TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+        assert(tfs_close(f) != -1);
+    }
+
+    atomic_store(&done, true);
+    for (int i = 0; i < READER_COUNT; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void *read_versions(void *arg) {
+    (void)arg;
+    static _Thread_local char output[FILE_SIZE];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+
+    while (!atomic_load(&done)) {
+        ssize_t read = tfs_pread(f, output, FILE_SIZE, 0);
+        assert(read == 0 || read == FILE_SIZE);
+        for (ssize_t i = 1; i < read; i++) {
+            assert(output[i] == output[0]);
+        }
+    }
+
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
@@ -0,0 +1,85 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Scaling benchmark for concurrent writers: for 1 up to MAX_THREAD_COUNT
+ * threads, each thread creates its own file and fills it one block per
+ * tfs_write call (so every call allocates a data block). The throughput for
+ * each thread count is printed, once with threads blocking on a busy lock at
+ * once and once with them spinning on it first. */
+
+#define MAX_THREAD_COUNT 8
+#define BLOCKS_PER_THREAD 96
+#define FILE_NAME_MAX_LEN 10
+
+void *write_file(void *arg);
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Runs the benchmark for every thread count, with the given lock spins */
+static void run_bench(unsigned lock_spins) {
+    pthread_t tid[MAX_THREAD_COUNT];
+    int table[MAX_THREAD_COUNT];
+    struct timespec start, end;
+
+    for (int thread_count = 1; thread_count <= MAX_THREAD_COUNT;
+         thread_count *= 2) {
+        assert(tfs_init_with_lock_spins(lock_spins) != -1);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < thread_count; ++i) {
+            table[i] = i;
+            if (pthread_create(&tid[i], NULL, write_file, &table[i]) != 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        for (int i = 0; i < thread_count; ++i) {
+            pthread_join(tid[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        int blocks = thread_count * BLOCKS_PER_THREAD;
+        printf("%-12u %-10d %-10d %.0f\n", lock_spins, thread_count, blocks,
+               blocks / elapsed_s(&start, &end));
+
+        assert(tfs_destroy() != -1);
+    }
+}
+
+int main() {
+    printf("%-12s %-10s %-10s %s\n", "lock spins", "threads", "blocks",
+           "blocks/s");
+    run_bench(0);
+    run_bench(LOCK_SPINS);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void *write_file(void *arg) {
+    int file_i = *((int *)arg);
+    char input[BLOCK_SIZE];
+    memset(input, 'A' + file_i, BLOCK_SIZE);
+
+    char path[FILE_NAME_MAX_LEN] = {"/f"};
+    sprintf(path + 2, "%d", file_i);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+
+    for (int i = 0; i < BLOCKS_PER_THREAD; i++) {
+        assert(tfs_write(f, input, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+
+    assert(tfs_close(f) != -1);
+
+    return NULL;
+}
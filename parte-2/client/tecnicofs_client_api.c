@@ -100,6 +100,25 @@ int tfs_open(char const *name, int flags) {
     return ret;
 }
 
+int tfs_mkdir(char const *name) {
+    int ret;
+    char server_request[MKDIR_SIZE_API];
+    char op_code = TFS_OP_CODE_MKDIR;
+    memcpy(server_request, &op_code, sizeof(char));
+    memcpy(server_request + 1, &client.session_id, sizeof(int));
+    memset(server_request + 1 + sizeof(int), '\0', sizeof(char) * BUFFER_SIZE);
+    memcpy(server_request + 1 + sizeof(int), name, sizeof(char) * strlen(name));
+
+    if (write_buffer(client.tx, server_request, MKDIR_SIZE_API) == -1 || errno == EPIPE) {
+        return -1;
+    }
+    if (read(client.rx, &ret, sizeof(int)) == -1 || errno == EPIPE) {
+        fprintf(stderr, "[ERR]: read failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return ret;
+}
+
 int tfs_close(int fhandle) {
     int ret;
     char server_request[CLOSE_SIZE_API];
@@ -118,7 +137,10 @@ int tfs_close(int fhandle) {
     return ret;
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t len) {
+/*
+ * Sends a single write request, of at most MAX_WRITE_CONTENTS bytes
+ */
+static ssize_t tfs_write_request(int fhandle, void const *buffer, size_t len) {
     ssize_t ret;
     char server_request[WRITE_SIZE_API(len)];
     char op_code = TFS_OP_CODE_WRITE;
@@ -138,6 +160,26 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len) {
     return ret;
 }
 
+ssize_t tfs_write(int fhandle, void const *buffer, size_t len) {
+    // larger writes are split into requests the server can take
+    size_t written = 0;
+    do {
+        size_t to_write = len - written;
+        if (to_write > MAX_WRITE_CONTENTS) {
+            to_write = MAX_WRITE_CONTENTS;
+        }
+        ssize_t ret = tfs_write_request(fhandle, (char const *)buffer + written, to_write);
+        if (ret == -1) {
+            return written > 0 ? (ssize_t)written : -1;
+        }
+        written += (size_t)ret;
+        if ((size_t)ret < to_write) {
+            break;
+        }
+    } while (written < len);
+    return (ssize_t)written;
+}
+
 ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
     ssize_t ret;
     char server_request[READ_SIZE_API];
@@ -154,7 +196,76 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
         fprintf(stderr, "[ERR]: read failed: %s\n", strerror(errno));
         return -1;
     }
-    if (read(client.rx, buffer, len) == -1 || errno == EPIPE) {
+    // the server only sends the contents if the read succeeded
+    if (ret > 0 && read_buffer(client.rx, buffer, (size_t) ret) == -1) {
+        return -1;
+    }
+    return ret;
+}
+
+/*
+ * Sends a single pwrite request, of at most MAX_WRITE_CONTENTS bytes
+ */
+static ssize_t tfs_pwrite_request(int fhandle, void const *buffer, size_t len, size_t offset) {
+    ssize_t ret;
+    char server_request[PWRITE_SIZE_API(len)];
+    char op_code = TFS_OP_CODE_PWRITE;
+    memcpy(server_request, &op_code, sizeof(char));
+    memcpy(server_request + 1, &client.session_id, sizeof(int));
+    memcpy(server_request + 1 + sizeof(int), &fhandle, sizeof(int));
+    memcpy(server_request + 1 + 2 * sizeof(int), &len, sizeof(size_t));
+    memcpy(server_request + 1 + 2 * sizeof(int) + sizeof(size_t), &offset, sizeof(size_t));
+    memcpy(server_request + 1 + 2 * sizeof(int) + 2 * sizeof(size_t), buffer, sizeof(char) * len);
+
+    if (write_buffer(client.tx, server_request, PWRITE_SIZE_API(len)) == -1 || errno == EPIPE) {
+        return -1;
+    }
+    if (read(client.rx, &ret, sizeof(ssize_t)) == -1 || errno == EPIPE) {
+        fprintf(stderr, "[ERR]: read failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return ret;
+}
+
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset) {
+    // larger writes are split into requests the server can take
+    size_t written = 0;
+    do {
+        size_t to_write = len - written;
+        if (to_write > MAX_WRITE_CONTENTS) {
+            to_write = MAX_WRITE_CONTENTS;
+        }
+        ssize_t ret = tfs_pwrite_request(fhandle, (char const *)buffer + written, to_write, offset + written);
+        if (ret == -1) {
+            return written > 0 ? (ssize_t)written : -1;
+        }
+        written += (size_t)ret;
+        if ((size_t)ret < to_write) {
+            break;
+        }
+    } while (written < len);
+    return (ssize_t)written;
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    ssize_t ret;
+    char server_request[PREAD_SIZE_API];
+    char op_code = TFS_OP_CODE_PREAD;
+    memcpy(server_request, &op_code, sizeof(char));
+    memcpy(server_request + 1, &client.session_id, sizeof(int));
+    memcpy(server_request + 1 + sizeof(int), &fhandle, sizeof(int));
+    memcpy(server_request + 1 + 2 * sizeof(int), &len, sizeof(size_t));
+    memcpy(server_request + 1 + 2 * sizeof(int) + sizeof(size_t), &offset, sizeof(size_t));
+
+    if (write_buffer(client.tx, server_request, PREAD_SIZE_API) == -1 || errno == EPIPE) {
+        return -1;
+    }
+    if (read(client.rx, &ret, sizeof(ssize_t)) == -1 || errno == EPIPE) {
+        fprintf(stderr, "[ERR]: read failed: %s\n", strerror(errno));
+        return -1;
+    }
+    // the server only sends the contents if the read succeeded
+    if (ret > 0 && read_buffer(client.rx, buffer, (size_t) ret) == -1) {
         return -1;
     }
     return ret;
@@ -202,4 +313,23 @@ int write_buffer(int tx, char *buf, size_t to_write) {
         written_so_far += (size_t) ret;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Reads (and guarantees that it reads correctly) a given number of bytes
+ * from a pipe to a given buffer
+ */
+int read_buffer(int rx, char *buf, size_t to_read) {
+    ssize_t ret;
+    size_t read_so_far = 0;
+    while (read_so_far < to_read) {
+        ret = read(rx, buf + read_so_far, to_read - read_so_far);
+        if (ret <= 0) {
+            // the server closing the pipe mid-reply is also a failure
+            fprintf(stderr, "[ERR]: read failed: %s\n", strerror(errno));
+            return -1;
+        }
+        read_so_far += (size_t) ret;
+    }
+    return 0;
+}
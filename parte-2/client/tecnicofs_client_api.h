@@ -20,9 +20,12 @@ typedef struct Client {
 #define MOUNT_SIZE_API (sizeof(char) + BUFFER_SIZE * sizeof(char))
 #define UNMOUNT_SIZE_API (sizeof(char) + sizeof(int))
 #define OPEN_SIZE_API (sizeof(char) + 2 * sizeof(int) + BUFFER_SIZE * sizeof(char))
+#define MKDIR_SIZE_API (sizeof(char) + sizeof(int) + BUFFER_SIZE * sizeof(char))
 #define CLOSE_SIZE_API (sizeof(char) + 2 * sizeof(int))
 #define WRITE_SIZE_API(len) (sizeof(char) + 2 * sizeof(int) + sizeof(char) * len + sizeof(size_t))
 #define READ_SIZE_API (sizeof(char) + 2 * sizeof(int) + sizeof(size_t))
+#define PWRITE_SIZE_API(len) (sizeof(char) + 2 * sizeof(int) + sizeof(char) * len + 2 * sizeof(size_t))
+#define PREAD_SIZE_API (sizeof(char) + 2 * sizeof(int) + 2 * sizeof(size_t))
 #define SHUTDOWN_SIZE_API (sizeof(char) + sizeof(int))
 
 /*
@@ -63,6 +66,14 @@ int tfs_unmount();
  */
 int tfs_open(char const *name, int flags);
 
+/*
+ * Creates a directory
+ * Input:
+ *  - name: absolute path name (its parent directory must already exist)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mkdir(char const *name);
+
 /* Closes a file
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
@@ -76,6 +87,9 @@ int tfs_close(int fhandle);
  * 	- buffer containing the contents to write
  * 	- length of the contents (in bytes)
  *
+ * Writes of more than MAX_WRITE_CONTENTS bytes are sent to the server as
+ * several requests.
+ *
  * Returns the number of bytes that were written (can be lower than
  * 'len' if the maximum file size is exceeded), or -1 in case of error.
  */
@@ -93,6 +107,32 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes to an open file, starting at the given offset (the file's current
+ * offset is neither used nor changed); writing past the end of the file fills
+ * the gap with zeros
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ * 	- offset (in bytes) where the contents are written
+ * Writes of more than MAX_WRITE_CONTENTS bytes are sent to the server as
+ * several requests.
+ * Returns the number of bytes that were written, or -1 in case of error
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/* Reads from an open file, starting at the given offset (the file's current
+ * offset is neither used nor changed)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- offset (in bytes) where the read starts
+ * Returns the number of bytes that were copied from the file to the buffer,
+ * or -1 in case of error
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
 /*
  * Orders TecnicoFS server to wait until no file is open and then shutdown
  * Returns 0 if successful, -1 otherwise.
@@ -101,4 +141,6 @@ int tfs_shutdown_after_all_closed();
 
 int write_buffer(int tx, char *buf, size_t to_write);
 
+int read_buffer(int rx, char *buf, size_t to_read);
+
 #endif /* CLIENT_API_H */
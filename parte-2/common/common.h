@@ -16,7 +16,10 @@ enum {
     TFS_OP_CODE_CLOSE = 4,
     TFS_OP_CODE_WRITE = 5,
     TFS_OP_CODE_READ = 6,
-    TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7
+    TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7,
+    TFS_OP_CODE_MKDIR = 8,
+    TFS_OP_CODE_PWRITE = 9,
+    TFS_OP_CODE_PREAD = 10
 };
 
 /*
@@ -29,10 +32,16 @@ enum {
  */
 #define MAX_REQUEST_SIZE (2048)
 /*
- * 64 is an arbitrary number, we chose it because of it being a
- * base 2 exponential number which is also pretty-ish
+ * A write request carries at most a block's worth of contents: the client
+ * splits larger writes into several requests, and the server refuses the
+ * requests that carry more
  */
-#define MAX_CLIENTS (64)
+#define MAX_WRITE_CONTENTS (1024)
+/*
+ * Sessions don't have threads of their own (they share the server's worker
+ * pool), so many of them can be kept; 4096 is an arbitrary base 2 number
+ */
+#define MAX_CLIENTS (4096)
 
 #define BUFFER_SIZE (40)
 
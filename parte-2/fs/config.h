@@ -4,12 +4,29 @@
 /* FS root inode number */
 #define ROOT_DIR_INUM (0)
 
-#define BLOCK_SIZE (1024)
-#define DATA_BLOCKS (1024)
-#define INODE_TABLE_SIZE (50)
-#define MAX_OPEN_FILES (20)
+/* Default volume geometry (see tfs_init_with_geometry) */
+#define DEFAULT_BLOCK_SIZE (1024)
+#define DEFAULT_DATA_BLOCKS (1024)
+#define DEFAULT_INODE_TABLE_SIZE (50)
+#define DEFAULT_MAX_OPEN_FILES (20)
+#define DEFAULT_LOCK_SPINS (20)
+
 #define MAX_FILE_NAME (40)
+#define MAX_DIRECT_BLOCKS (10)
+
+/* Files up to this size are stored inside their i-node */
+#define MAX_INLINE_DATA (64)
 
 #define DELAY (5000)
 
+/* Longest pause, in pause instructions, between two tries of a lock that is
+ * spun on (see spin_on_lock) */
+#define MAX_LOCK_SPIN_PAUSES (16)
+
+/* Size of a cache line, to which the entries of the FS tables are aligned */
+#define CACHE_LINE_SIZE (64)
+
+/* Size of the huge pages that may back the FS arena */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 #endif // CONFIG_H
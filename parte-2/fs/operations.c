@@ -5,17 +5,25 @@
 #include <stdlib.h>
 #include <string.h>
 
-static pthread_mutex_t single_global_lock;
+/* Serializes the creation of files and directories, so that the same name
+ * can't be added twice to a directory (lookups don't take it) */
+static pthread_mutex_t create_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int tfs_init() {
-    state_init();
-
-    if (pthread_mutex_init(&single_global_lock, 0) != 0)
-        return -1;
+    tfs_geometry_t geometry = {
+        .block_size = DEFAULT_BLOCK_SIZE,
+        .data_blocks = DEFAULT_DATA_BLOCKS,
+        .inode_table_size = DEFAULT_INODE_TABLE_SIZE,
+        .max_open_files = DEFAULT_MAX_OPEN_FILES,
+        .huge_pages = false,
+        .image_path = NULL,
+        .lock_spins = DEFAULT_LOCK_SPINS,
+    };
+    return tfs_init_with_geometry(&geometry);
+}
 
-    /* create root inode */
-    int root = inode_create(T_DIRECTORY);
-    if (root != ROOT_DIR_INUM) {
+int tfs_init_with_geometry(tfs_geometry_t const *geometry) {
+    if (state_init(geometry) == -1) {
         return -1;
     }
 
@@ -24,9 +32,6 @@ int tfs_init() {
 
 int tfs_destroy() {
     state_destroy();
-    if (pthread_mutex_destroy(&single_global_lock) != 0) {
-        return -1;
-    }
     return 0;
 }
 
@@ -39,13 +44,19 @@ int tfs_destroy_after_all_closed() {
     while (open_files_count != 0) {
         pthread_cond_wait(&open_files_cond, &open_files_mutex);
     }
-	open_flag = 0;
+	atomic_store(&open_flag, 0);
     state_destroy();
     unlock_mutex(&open_files_mutex);
     return 0;
 }
 
-int _tfs_lookup_unsynchronized(char const *name) {
+/*
+ * Resolves every directory in a path but the last one (through the dentry
+ * cache, see find_in_dir), and copies the path's last component to
+ * 'last_name' (which must hold MAX_FILE_NAME chars)
+ * Returns the inumber of the path's parent directory, -1 if unsuccessful
+ */
+static int _tfs_lookup_parent(char const *name, char *last_name) {
     if (!valid_pathname(name)) {
         return -1;
     }
@@ -53,65 +64,122 @@ int _tfs_lookup_unsynchronized(char const *name) {
     // skip the initial '/' character
     name++;
 
-    return find_in_dir(ROOT_DIR_INUM, name);
+    int parent = ROOT_DIR_INUM;
+    for (;;) {
+        char const *end = strchr(name, '/');
+        size_t len = end == NULL ? strlen(name) : (size_t)(end - name);
+        if (len == 0 || len >= MAX_FILE_NAME) {
+            return -1;
+        }
+        memcpy(last_name, name, len);
+        last_name[len] = '\0';
+        if (end == NULL) {
+            return parent;
+        }
+
+        parent = find_in_dir(parent, last_name);
+        if (parent == -1) {
+            return -1;
+        }
+        name = end + 1;
+    }
 }
 
-int tfs_lookup(char const *name) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
-        return -1;
-    int ret = _tfs_lookup_unsynchronized(name);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
+int _tfs_lookup_unsynchronized(char const *name) {
+    char last_name[MAX_FILE_NAME];
+    int parent = _tfs_lookup_parent(name, last_name);
+    if (parent == -1) {
         return -1;
-    return ret;
+    }
+
+    return find_in_dir(parent, last_name);
+}
+
+int tfs_lookup(char const *name) {
+    /* The dentry cache has its own lock, so lookups don't need the global
+     * one */
+    return _tfs_lookup_unsynchronized(name);
 }
 
 static int _tfs_open_unsynchronized(char const *name, int flags) {
     int inum;
     size_t offset;
+    char last_name[MAX_FILE_NAME];
 
-    inum = _tfs_lookup_unsynchronized(name);
-    if (inum >= 0) {
-        /* The file already exists */
-        inode_t *inode = inode_get(inum);
-        if (inode == NULL) {
-            return -1;
-        }
+    int parent = _tfs_lookup_parent(name, last_name);
+    if (parent == -1) {
+        return -1;
+    }
 
-        /* Trucate (if requested) */
-        if (flags & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                if (data_block_free(inode->i_data_block) == -1) {
-                    return -1;
-                }
-                inode->i_size = 0;
+    /* Lookups don't exclude each other, so only files that don't exist yet
+     * need create_lock (which prevents two files with the same name being
+     * created) */
+    inum = find_in_dir(parent, last_name);
+    if (inum < 0 && (flags & TFS_O_CREAT)) {
+        lock_mutex(&create_lock);
+        inum = find_in_dir(parent, last_name);
+        if (inum < 0) {
+            /* The file doesn't exist; the flags specify that it should be
+             * created */
+            inum = inode_create(T_FILE);
+            if (inum == -1) {
+                unlock_mutex(&create_lock);
+                return -1;
             }
+            /* Add entry in the parent directory */
+            if (add_dir_entry(parent, inum, last_name) == -1) {
+                inode_delete(inum);
+                unlock_mutex(&create_lock);
+                return -1;
+            }
+            unlock_mutex(&create_lock);
+            return add_to_open_file_table(inum, 0, flags & TFS_O_APPEND);
         }
-        /* Determine initial offset */
-        if (flags & TFS_O_APPEND) {
-            offset = inode->i_size;
-        } else {
-            offset = 0;
-        }
-    } else if (flags & TFS_O_CREAT) {
-        /* The file doesn't exist; the flags specify that it should be created*/
-        /* Create inode */
-        inum = inode_create(T_FILE);
-        if (inum == -1) {
-            return -1;
-        }
-        /* Add entry in the root directory */
-        if (add_dir_entry(ROOT_DIR_INUM, inum, name + 1) == -1) {
-            inode_delete(inum);
-            return -1;
-        }
-        offset = 0;
+        unlock_mutex(&create_lock);
+    }
+    if (inum < 0) {
+        return -1;
+    }
+
+    /* The file already exists */
+    pthread_rwlock_t *inode_lock = get_inode_table_lock(inum);
+    /* Only truncating changes the i-node */
+    if (flags & TFS_O_TRUNC) {
+        write_lock_rwlock(inode_lock);
     } else {
+        read_lock_rwlock(inode_lock);
+    }
+    inode_t *inode = inode_get(inum);
+    if (inode == NULL || inode->i_node_type != T_FILE) {
+        unlock_rwlock(inode_lock);
         return -1;
     }
 
+    /* Trucate (if requested) */
+    if (flags & TFS_O_TRUNC) {
+        if (inode->i_size > 0) {
+            if (inode_free_blocks(inode) == -1) {
+                unlock_rwlock(inode_lock);
+                return -1;
+            }
+            inode->i_size = 0;
+        }
+    }
+    /* Determine initial offset */
+    if (flags & TFS_O_APPEND) {
+        /* Writes through other handles may be changing the size */
+        pthread_rwlock_t *map_lock = get_inode_map_lock(inum);
+        read_lock_rwlock(map_lock);
+        offset = inode->i_size;
+        unlock_rwlock(map_lock);
+    } else {
+        offset = 0;
+    }
+    unlock_rwlock(inode_lock);
+
     /* Finally, add entry to the open file table and
      * return the corresponding handle */
-    return add_to_open_file_table(inum, offset);
+    return add_to_open_file_table(inum, offset, flags & TFS_O_APPEND);
 
     /* Note: for simplification, if file was created with TFS_O_CREAT and there
      * is an error adding an entry to the open file table, the file is not
@@ -119,123 +187,481 @@ static int _tfs_open_unsynchronized(char const *name, int flags) {
 }
 
 int tfs_open(char const *name, int flags) {
-	lock_mutex(&open_files_mutex);
-	if (open_flag == 0) {
-		unlock_mutex(&open_files_mutex);
+	if (atomic_load(&open_flag) == 0) {
 		return -1;
 	}
-	unlock_mutex(&open_files_mutex);
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    return _tfs_open_unsynchronized(name, flags);
+}
+
+static int _tfs_mkdir_unsynchronized(char const *name) {
+    char last_name[MAX_FILE_NAME];
+    int parent = _tfs_lookup_parent(name, last_name);
+    if (parent == -1 || find_in_dir(parent, last_name) != -1) {
         return -1;
-    int ret = _tfs_open_unsynchronized(name, flags);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
+    }
+
+    int inum = inode_create(T_DIRECTORY);
+    if (inum == -1) {
         return -1;
-    return ret;
+    }
+    if (add_dir_entry(parent, inum, last_name) == -1) {
+        inode_delete(inum);
+        return -1;
+    }
+    return 0;
 }
 
-int tfs_close(int fhandle) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
-        return -1;
-    int r = remove_from_open_file_table(fhandle);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
+int tfs_mkdir(char const *name) {
+    if (atomic_load(&open_flag) == 0) {
         return -1;
+    }
+    lock_mutex(&create_lock);
+    int ret = _tfs_mkdir_unsynchronized(name);
+    unlock_mutex(&create_lock);
+    return ret;
+}
 
-    return r;
+int tfs_close(int fhandle) { return remove_from_open_file_table(fhandle); }
+
+/*
+ * Returns the data block holding the given block of a file, allocating it if
+ * needed; the i-node's map lock is only held for writing if the block has to
+ * be allocated
+ * Returns NULL if there is no space left (in the volume or for the file's
+ * size)
+ */
+static void *_tfs_block_for_write(int inumber, inode_t *inode,
+                                  size_t file_block) {
+    pthread_rwlock_t *map_lock = get_inode_map_lock(inumber);
+    read_lock_rwlock(map_lock);
+    int block_number = inode_block_get(inode, file_block, false);
+    unlock_rwlock(map_lock);
+    if (block_number == -1) {
+        write_lock_rwlock(map_lock);
+        block_number = inode_block_get(inode, file_block, true);
+        unlock_rwlock(map_lock);
+    }
+    return data_block_get(block_number);
 }
 
-static ssize_t _tfs_write_unsynchronized(int fhandle, void const *buffer,
-                                         size_t to_write) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
+/*
+ * Allocates the blocks of the gap between the end of a file (whose map lock
+ * the caller must hold for writing, and whose contents are in blocks) and
+ * the offset a write starts at; being freshly allocated, they read as zeros
+ * Returns 0 if successful, -1 if there is no space left for the gap (whose
+ * blocks are then freed again)
+ */
+static int _tfs_write_fill_gap(inode_t *inode, size_t offset) {
+    if (offset <= inode->i_size) {
+        return 0;
+    }
+
+    /* The blocks allocated here are recorded, since the blocks past the end
+     * of the file may also belong to writes that are still copying */
+    size_t first_block = inode->i_size / BLOCK_SIZE;
+    size_t gap_blocks = (offset - 1) / BLOCK_SIZE - first_block + 1;
+    size_t *allocated = malloc(gap_blocks * sizeof(size_t));
+    if (allocated == NULL) {
         return -1;
     }
+    size_t allocated_count = 0;
+    int ret = 0;
+    for (size_t file_block = first_block;
+         file_block < first_block + gap_blocks; file_block++) {
+        if (inode_block_get(inode, file_block, false) != -1) {
+            continue;
+        }
+        if (inode_block_get(inode, file_block, true) == -1) {
+            while (allocated_count > 0) {
+                inode_block_free(inode, allocated[--allocated_count]);
+            }
+            ret = -1;
+            break;
+        }
+        allocated[allocated_count++] = file_block;
+    }
+    free(allocated);
+    return ret;
+}
 
-    /* From the open file table entry, we get the inode */
-    inode_t *inode = inode_get(file->of_inumber);
-    if (inode == NULL) {
+/*
+ * Writes to an i-node, starting at the given offset; writing past the end of
+ * the file fills the gap with zeros. The caller must hold the i-node's lock
+ * (at least for reading) and the written range of its range lock; the
+ * i-node's map lock is only taken (for writing) to allocate blocks and to
+ * update its size, so writes to disjoint ranges copy their contents in
+ * parallel
+ * Returns the number of bytes written, -1 in case of error
+ */
+static ssize_t _tfs_write_unsynchronized(int inumber, inode_t *inode,
+                                         void const *buffer, size_t to_write,
+                                         size_t offset) {
+    /* Nothing is allocated for a write past the largest possible file */
+    if (offset / BLOCK_SIZE >= MAX_FILE_BLOCKS) {
         return -1;
     }
 
-    /* Determine how many bytes to write */
-    if (to_write + file->of_offset > BLOCK_SIZE) {
-        to_write = BLOCK_SIZE - file->of_offset;
+    pthread_rwlock_t *map_lock = get_inode_map_lock(inumber);
+    write_lock_rwlock(map_lock);
+    /* Small files are kept inline, in the i-node, until they outgrow it */
+    if (inode_is_inline(inode) && to_write <= MAX_INLINE_DATA &&
+        offset <= MAX_INLINE_DATA - to_write) {
+        if (offset > inode->i_size) {
+            memset(inode->i_inline_data + inode->i_size, 0,
+                   offset - inode->i_size);
+        }
+        memcpy(inode->i_inline_data + offset, buffer, to_write);
+        if (offset + to_write > inode->i_size) {
+            inode->i_size = offset + to_write;
+        }
+        unlock_rwlock(map_lock);
+        return (ssize_t)to_write;
+    }
+    if (inode_is_inline(inode) && inode_spill_inline(inode) == -1) {
+        /* No space left for the contents */
+        unlock_rwlock(map_lock);
+        return 0;
     }
+    if (_tfs_write_fill_gap(inode, offset) == -1) {
+        unlock_rwlock(map_lock);
+        return -1;
+    }
+    unlock_rwlock(map_lock);
+
+    /* Each iteration writes the part of the buffer that falls in one block
+     * (allocating the block if needed) */
+    size_t bytes_written = 0;
+    size_t block_offset = offset % BLOCK_SIZE;
+    size_t file_block = offset / BLOCK_SIZE;
+    while (bytes_written < to_write) {
+        void *block = _tfs_block_for_write(inumber, inode, file_block);
+        if (block == NULL) {
+            /* No space left (in the volume or for the file's size) */
+            break;
+        }
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            /* If empty file, allocate new block */
-            inode->i_data_block = data_block_alloc();
+        size_t to_write_in_block = BLOCK_SIZE - block_offset;
+        if (to_write_in_block > to_write - bytes_written) {
+            to_write_in_block = to_write - bytes_written;
         }
 
-        void *block = data_block_get(inode->i_data_block);
+        /* Perform the actual write */
+        memcpy(block + block_offset, buffer + bytes_written, to_write_in_block);
+        bytes_written += to_write_in_block;
+        block_offset = 0;
+        file_block++;
+    }
+
+    if (bytes_written > 0) {
+        write_lock_rwlock(map_lock);
+        if (offset + bytes_written > inode->i_size) {
+            inode->i_size = offset + bytes_written;
+        }
+        unlock_rwlock(map_lock);
+    }
+    return (ssize_t)bytes_written;
+}
+
+/*
+ * Reads from an i-node, starting at the given offset. The caller must hold
+ * the i-node's lock (at least for reading) and the read range of its range
+ * lock; the i-node's map lock is taken (for reading) to look up its size and
+ * blocks
+ * Returns the number of bytes read, -1 in case of error
+ */
+static ssize_t _tfs_read_unsynchronized(int inumber, inode_t *inode,
+                                        void *buffer, size_t len,
+                                        size_t offset) {
+    pthread_rwlock_t *map_lock = get_inode_map_lock(inumber);
+    read_lock_rwlock(map_lock);
+
+    /* Determine how many bytes to read */
+    size_t to_read = 0;
+    if (offset < inode->i_size) {
+        to_read = inode->i_size - offset;
+    }
+    if (to_read > len) {
+        to_read = len;
+    }
+
+    if (inode_is_inline(inode)) {
+        memcpy(buffer, inode->i_inline_data + offset, to_read);
+        unlock_rwlock(map_lock);
+        return (ssize_t)to_read;
+    }
+    unlock_rwlock(map_lock);
+
+    /* Each iteration reads the part of the file that falls in one block */
+    size_t bytes_read = 0;
+    while (bytes_read < to_read) {
+        size_t block_offset = offset % BLOCK_SIZE;
+        read_lock_rwlock(map_lock);
+        int block_number = inode_block_get(inode, offset / BLOCK_SIZE, false);
+        unlock_rwlock(map_lock);
+        void *block = data_block_get(block_number);
         if (block == NULL) {
             return -1;
         }
 
-        /* Perform the actual write */
-        memcpy(block + file->of_offset, buffer, to_write);
+        size_t to_read_in_block = BLOCK_SIZE - block_offset;
+        if (to_read_in_block > to_read - bytes_read) {
+            to_read_in_block = to_read - bytes_read;
+        }
+
+        /* Perform the actual read */
+        memcpy(buffer + bytes_read, block + block_offset, to_read_in_block);
+        bytes_read += to_read_in_block;
+        offset += to_read_in_block;
+    }
+
+    return (ssize_t)bytes_read;
+}
+
+/*
+ * Locks an open file entry (for writing if the operation moves its offset,
+ * for reading otherwise) and looks up its i-node
+ * Returns the entry if successful, NULL otherwise (and nothing stays locked)
+ */
+static open_file_entry_t *lock_open_file_entry(int fhandle, bool moves_offset,
+                                               inode_t **inode) {
+    pthread_rwlock_t *file_lock = get_open_file_table_lock(fhandle);
+    if (file_lock == NULL) {
+        return NULL;
+    }
+    if (moves_offset) {
+        write_lock_rwlock(file_lock);
+    } else {
+        read_lock_rwlock(file_lock);
+    }
+
+    /* From the open file table entry, we get the inode */
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || (*inode = inode_get(file->of_inumber)) == NULL) {
+        unlock_rwlock(file_lock);
+        return NULL;
+    }
+    return file;
+}
+
+/*
+ * Locks an open file entry (see lock_open_file_entry), then its i-node (for
+ * reading: only truncating locks a whole file) and then the range of the
+ * file that the operation accesses (for writing if the operation writes to
+ * it); the locks are always taken in this order
+ * Returns the entry if successful, NULL otherwise (and nothing stays locked)
+ */
+static open_file_entry_t *lock_open_file(int fhandle, bool moves_offset,
+                                         bool writes, size_t len,
+                                         size_t const *offset,
+                                         range_lock_entry_t *range,
+                                         inode_t **inode) {
+    open_file_entry_t *file =
+        lock_open_file_entry(fhandle, moves_offset, inode);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    read_lock_rwlock(get_inode_table_lock(file->of_inumber));
+    inode_range_lock(file->of_inumber, range,
+                     offset == NULL ? file->of_offset : *offset, len, writes);
+    return file;
+}
+
+static void unlock_open_file(int fhandle, open_file_entry_t const *file,
+                             range_lock_entry_t *range) {
+    inode_range_unlock(file->of_inumber, range);
+    unlock_rwlock(get_inode_table_lock(file->of_inumber));
+    unlock_rwlock(get_open_file_table_lock(fhandle));
+}
+
+/*
+ * Appends a batch of requests to the end of a file, one after the other,
+ * locking the file (and the range they take) once for the whole batch
+ */
+static void _tfs_append_batch(int inumber, append_request_t *batch) {
+    size_t total = 0;
+    for (append_request_t *request = batch; request != NULL;
+         request = request->ar_next) {
+        total += request->ar_len;
+    }
+
+    /* Other writers may still extend the file before its end is locked, in
+     * which case the new end is locked instead */
+    inode_t *inode = inode_get(inumber);
+    pthread_rwlock_t *inode_lock = get_inode_table_lock(inumber);
+    pthread_rwlock_t *map_lock = get_inode_map_lock(inumber);
+    range_lock_entry_t range;
+    size_t offset;
+    read_lock_rwlock(inode_lock);
+    for (;;) {
+        read_lock_rwlock(map_lock);
+        offset = inode->i_size;
+        unlock_rwlock(map_lock);
+        inode_range_lock(inumber, &range, offset, total, true);
+        read_lock_rwlock(map_lock);
+        bool moved = inode->i_size != offset;
+        unlock_rwlock(map_lock);
+        if (!moved) {
+            break;
+        }
+        inode_range_unlock(inumber, &range);
+    }
 
-        /* The offset associated with the file handle is
-         * incremented accordingly */
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
+    for (append_request_t *request = batch; request != NULL;
+         request = request->ar_next) {
+        request->ar_written = _tfs_write_unsynchronized(
+            inumber, inode, request->ar_buffer, request->ar_len, offset);
+        if (request->ar_written > 0) {
+            offset += (size_t)request->ar_written;
         }
+        request->ar_end = offset;
     }
 
-    return (ssize_t)to_write;
+    inode_range_unlock(inumber, &range);
+    unlock_rwlock(inode_lock);
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
-        return -1;
-    ssize_t ret = _tfs_write_unsynchronized(fhandle, buffer, to_write);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
-        return -1;
+/*
+ * Appends to the end of a file by flat combining: the request is queued in
+ * the file's append queue, and the appender that finds no combiner running
+ * becomes one, taking the whole queue and appending every request in it,
+ * while the others wait for theirs to be done. Concurrent appends (e.g. from
+ * different client sessions) thus take the file's locks once per batch,
+ * rather than once each
+ * Input:
+ *  - inumber: the file's i-number
+ *  - buffer, len: the contents to append
+ *  - end: set to the end of the appended contents
+ * Returns the number of bytes written, -1 in case of error
+ */
+static ssize_t _tfs_append(int inumber, void const *buffer, size_t len,
+                           size_t *end) {
+    append_queue_t *queue = get_inode_append_queue(inumber);
+    append_request_t request = {.ar_buffer = buffer, .ar_len = len};
+
+    lock_mutex(&queue->aq_mutex);
+    *queue->aq_tail = &request;
+    queue->aq_tail = &request.ar_next;
+    while (!request.ar_done) {
+        if (queue->aq_combining) {
+            pthread_cond_wait(&queue->aq_done, &queue->aq_mutex);
+            continue;
+        }
 
-    return ret;
+        queue->aq_combining = true;
+        append_request_t *batch = queue->aq_head;
+        queue->aq_head = NULL;
+        queue->aq_tail = &queue->aq_head;
+        unlock_mutex(&queue->aq_mutex);
+
+        _tfs_append_batch(inumber, batch);
+
+        /* A request may be gone as soon as it is done */
+        lock_mutex(&queue->aq_mutex);
+        while (batch != NULL) {
+            append_request_t *next = batch->ar_next;
+            batch->ar_done = true;
+            batch = next;
+        }
+        queue->aq_combining = false;
+        pthread_cond_broadcast(&queue->aq_done);
+    }
+    unlock_mutex(&queue->aq_mutex);
+
+    *end = request.ar_end;
+    return request.ar_written;
 }
 
-static ssize_t _tfs_read_unsynchronized(int fhandle, void *buffer, size_t len) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    inode_t *inode;
+    open_file_entry_t *file = lock_open_file_entry(fhandle, true, &inode);
     if (file == NULL) {
         return -1;
     }
 
-    /* From the open file table entry, we get the inode */
-    inode_t *inode = inode_get(file->of_inumber);
-    if (inode == NULL) {
-        return -1;
+    if (file->of_append) {
+        /* Appends go to the end of the file, wherever the offset is; the
+         * combiner locks the i-node and the range of the whole batch */
+        size_t end;
+        ssize_t ret = _tfs_append(file->of_inumber, buffer, to_write, &end);
+        if (ret != -1) {
+            file->of_offset = end;
+        }
+        unlock_rwlock(get_open_file_table_lock(fhandle));
+        return ret;
     }
 
-    /* Determine how many bytes to read */
-    size_t to_read = inode->i_size - file->of_offset;
-    if (to_read > len) {
-        to_read = len;
+    range_lock_entry_t range;
+    read_lock_rwlock(get_inode_table_lock(file->of_inumber));
+    inode_range_lock(file->of_inumber, &range, file->of_offset, to_write,
+                     true);
+
+    ssize_t ret = _tfs_write_unsynchronized(file->of_inumber, inode, buffer,
+                                            to_write, file->of_offset);
+    if (ret > 0) {
+        /* The offset associated with the file handle is incremented
+         * accordingly */
+        file->of_offset += (size_t)ret;
     }
 
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        if (block == NULL) {
-            return -1;
-        }
+    unlock_open_file(fhandle, file, &range);
+    return ret;
+}
 
-        /* Perform the actual read */
-        memcpy(buffer, block + file->of_offset, to_read);
-        /* The offset associated with the file handle is
-         * incremented accordingly */
-        file->of_offset += to_read;
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t to_write,
+                   size_t offset) {
+    /* The shared offset is left untouched, so the entry is only read, and
+     * writes to disjoint ranges of the file run in parallel */
+    inode_t *inode;
+    range_lock_entry_t range;
+    open_file_entry_t *file =
+        lock_open_file(fhandle, false, true, to_write, &offset, &range, &inode);
+    if (file == NULL) {
+        return -1;
     }
 
-    return (ssize_t)to_read;
+    ssize_t ret = _tfs_write_unsynchronized(file->of_inumber, inode, buffer,
+                                            to_write, offset);
+
+    unlock_open_file(fhandle, file, &range);
+    return ret;
 }
 
 ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    /* Reading moves the handle's offset, but leaves the i-node untouched, so
+     * readers of the same file (through different handles) run in parallel */
+    inode_t *inode;
+    range_lock_entry_t range;
+    open_file_entry_t *file =
+        lock_open_file(fhandle, true, false, len, NULL, &range, &inode);
+    if (file == NULL) {
         return -1;
-    ssize_t ret = _tfs_read_unsynchronized(fhandle, buffer, len);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
+    }
+
+    ssize_t ret = _tfs_read_unsynchronized(file->of_inumber, inode, buffer,
+                                           len, file->of_offset);
+    if (ret > 0) {
+        file->of_offset += (size_t)ret;
+    }
+
+    unlock_open_file(fhandle, file, &range);
+    return ret;
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    /* Positional reads only share locks, so they run in parallel, also
+     * through the same file handle */
+    inode_t *inode;
+    range_lock_entry_t range;
+    open_file_entry_t *file =
+        lock_open_file(fhandle, false, false, len, &offset, &range, &inode);
+    if (file == NULL) {
         return -1;
+    }
+
+    ssize_t ret = _tfs_read_unsynchronized(file->of_inumber, inode, buffer,
+                                           len, offset);
 
+    unlock_open_file(fhandle, file, &range);
     return ret;
 }
@@ -7,11 +7,26 @@
 #include <sys/types.h>
 
 /*
- * Initializes tecnicofs
+ * Initializes tecnicofs, with the default volume geometry (see config.h)
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_init();
 
+/*
+ * Initializes tecnicofs
+ * Input:
+ *  - geometry: the volume's block size, number of data blocks, number of
+ *    i-nodes and maximum number of open files (block_size must be a multiple
+ *    of sizeof(int) that fits a directory entry), whether the volume
+ *    should be backed by huge pages, the path of the volume's image file
+ *    (or NULL) and how many times a lock is tried before blocking on it.
+ *    An existing image file is mapped as it is, keeping its volume's block
+ *    size, number of data blocks and number of i-nodes; otherwise, a new
+ *    volume is created (in the image file, if given)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_init_with_geometry(tfs_geometry_t const *geometry);
+
 /*
  * Destroy tecnicofs
  * Returns 0 if successful, -1 otherwise.
@@ -25,10 +40,10 @@ int tfs_destroy();
 int tfs_destroy_after_all_closed();
 
 /*
- * Looks for a file
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported Input:
- *  - name: absolute path name
+ * Looks for a file or directory
+ * Input:
+ *  - name: absolute path name (each of its components must be shorter than
+ *    MAX_FILE_NAME)
  * Returns the inumber of the file, -1 if unsuccessful
  */
 int tfs_lookup(char const *name);
@@ -38,12 +53,21 @@ int tfs_lookup(char const *name);
  * Input:
  *  - name: absolute path name
  *  - flags: can be a combination (with bitwise or) of the following flags:
- *    - append mode (TFS_O_APPEND)
+ *    - append mode (TFS_O_APPEND): every write through the handle goes to
+ *      the end of the file
  *    - truncate file contents (TFS_O_TRUNC)
  *    - create file if it does not exist (TFS_O_CREAT)
  */
 int tfs_open(char const *name, int flags);
 
+/*
+ * Creates a directory
+ * Input:
+ *  - name: absolute path name (its parent directory must already exist)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mkdir(char const *name);
+
 /* Closes a file
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
@@ -72,6 +96,30 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes to an open file, starting at the given offset (the file's current
+ * offset is neither used nor changed); writing past the end of the file fills
+ * the gap with zeros
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ * 	- offset (in bytes) where the contents are written
+ * Returns the number of bytes that were written, or -1 in case of error
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/* Reads from an open file, starting at the given offset (the file's current
+ * offset is neither used nor changed)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- offset (in bytes) where the read starts
+ * Returns the number of bytes that were copied from the file to the buffer,
+ * or -1 in case of error
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
 /* Copies the contents of a file that exists in TecnicoFS to the contents
  * of another file in the OS' file system tree (outside TecnicoFS).
  * Input:
@@ -1,43 +1,236 @@
+/* MAP_ANONYMOUS, MAP_HUGETLB and MADV_HUGEPAGE aren't part of POSIX */
+#define _DEFAULT_SOURCE
+
 #include "state.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <pthread.h>
 
-/* Persistent FS state  (in reality, it should be maintained in secondary
- * memory; for simplicity, this project maintains it in primary memory) */
+tfs_geometry_t fs_geometry;
+
+/* All the tables below live in two memory-mapped arenas, laid out by
+ * state_init() according to the volume geometry, with each table aligned to
+ * a cache line:
+ *  - the volume image holds the persistent tables. It is backed by the image
+ *    file named by the geometry, if any (so that the volume outlives the
+ *    process), and is anonymous memory otherwise. It starts with the
+ *    superblock, in a page of its own, followed by the data blocks (so that
+ *    they start at a page boundary) and the other tables;
+ *  - the arena holds the volatile tables, and is always anonymous memory */
+#define ARENA_ALIGNMENT (CACHE_LINE_SIZE)
+
+static char *fs_image = NULL;
+static size_t fs_image_size;
+static int fs_image_fd = -1;
+
+static char *fs_arena = NULL;
+static size_t fs_arena_size;
+
+/* Persistent FS state */
+
+/* Superblock: describes the volume held by an image file. The magic number is
+ * only written once the volume is fully formatted. Images written with
+ * another layout of the persistent tables are refused: the format version
+ * is bumped whenever that layout changes, and the sizes of the records kept
+ * in the image are recorded as well, since they also change with the
+ * compiler and the configuration (e.g. CACHE_LINE_SIZE) */
+#define SUPERBLOCK_MAGIC (0x32534654) // "TFS2"
+#define SUPERBLOCK_VERSION (1)
+
+typedef struct {
+    uint32_t sb_magic;
+    uint32_t sb_version;
+    uint64_t sb_block_size;
+    uint64_t sb_data_blocks;
+    uint64_t sb_inode_table_size;
+    uint64_t sb_inode_size;
+    uint64_t sb_dir_bucket_size;
+    uint64_t sb_dir_entry_size;
+} superblock_t;
+
+static superblock_t *superblock;
 
 /* I-node table */
-static inode_t inode_table[INODE_TABLE_SIZE];
-static char freeinode_ts[INODE_TABLE_SIZE];
+static inode_t *inode_table;
+static char *freeinode_ts;
+
+/* Free i-nodes bitmap (in the arena, built from freeinode_ts when the volume
+ * is mapped): bit i of word w is set when i-node (w * 64 + i) is TAKEN (bits
+ * past INODE_TABLE_SIZE are kept permanently set). I-nodes are claimed with
+ * a CAS on their word, starting at the word of the last claim (next-fit), so
+ * creating files neither locks i-nodes nor rescans the taken ones */
+#define FREE_INODES_WORD_BITS (64)
+#define FREE_INODES_WORDS                                                      \
+    ((INODE_TABLE_SIZE + FREE_INODES_WORD_BITS - 1) / FREE_INODES_WORD_BITS)
+
+static _Atomic uint64_t *free_inodes;
+static atomic_size_t free_inodes_cursor;
 
 /* Data blocks */
-static char fs_data[BLOCK_SIZE * DATA_BLOCKS];
-static char free_blocks[DATA_BLOCKS];
+static char *fs_data;
+
+/* Free data blocks bitmap: bit i of word w is set when block (w * 64 + i) is
+ * TAKEN. Bits past DATA_BLOCKS in the last word are kept permanently set, so
+ * they are never handed out. The cursor holds the word where the last
+ * allocation happened (next-fit), so that allocations don't rescan the
+ * already full prefix of the volume. */
+#define FREE_BLOCKS_WORD_BITS (64)
+#define FREE_BLOCKS_WORDS                                                      \
+    ((DATA_BLOCKS + FREE_BLOCKS_WORD_BITS - 1) / FREE_BLOCKS_WORD_BITS)
+
+static uint64_t *free_blocks;
+static size_t free_blocks_cursor;
+
+/* The free blocks lock is statically initialized (and never destroyed), as it
+ * doesn't depend on the geometry */
+static pthread_mutex_t free_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Volatile FS state */
 
-static open_file_entry_t open_file_table[MAX_OPEN_FILES];
-static char free_open_file_entries[MAX_OPEN_FILES];
+/* Range lock of an i-node: the ranges currently held, and a condition that
+ * is signalled whenever one of them is released */
+typedef struct {
+    pthread_mutex_t rl_mutex;
+    pthread_cond_t rl_released;
+    range_lock_entry_t *rl_held;
+} range_lock_t;
+
+/* Locks of an i-node, which a file operation takes one after the other, so
+ * they are kept together. Each i-node's locks start a cache line of their
+ * own, so threads working on neighbouring i-nodes don't share lines */
+typedef struct {
+    /* Only held for writing to change the whole i-node (e.g. to truncate
+     * it), and also guards its entry in freeinode_ts; writes to a file
+     * share it, and lock the blocks they write through the range lock */
+    _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t il_table_lock;
+    /* Guards the i-node's size and block map (only held for short periods) */
+    pthread_rwlock_t il_map_lock;
+    range_lock_t il_range_lock;
+    append_queue_t il_append_queue;
+} inode_locks_t;
+
+static inode_locks_t *inode_locks;
+
+/* Open file slots are claimed and released with atomic operations on a
+ * bitmap (bit i of word w is set when slot (w * 64 + i) is TAKEN; bits past
+ * MAX_OPEN_FILES are kept permanently set), so opening and closing files
+ * doesn't serialize on a lock */
+#define OPEN_FILES_WORD_BITS (64)
+#define OPEN_FILES_WORDS                                                       \
+    ((MAX_OPEN_FILES + OPEN_FILES_WORD_BITS - 1) / OPEN_FILES_WORD_BITS)
 
-int open_files_count = 0;
-int open_flag = 1;
+/* A file handle carries its slot's generation above the slot's index. The
+ * generation is bumped whenever the slot is freed, so a handle that was
+ * already closed is rejected even if its slot has been claimed again */
+#define HANDLE_SLOT_BITS (16)
+#define HANDLE_SLOT_MASK ((1 << HANDLE_SLOT_BITS) - 1)
+#define HANDLE_GENERATION_MASK (INT_MAX >> HANDLE_SLOT_BITS)
+
+/* Open file slot: the entry, the lock that guards it and its generation,
+ * which every operation on the file reads together. Each slot starts a
+ * cache line of its own, so threads working on neighbouring slots don't
+ * share lines */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t os_lock;
+    open_file_entry_t os_entry;
+    atomic_uint os_generation;
+} open_file_slot_t;
+
+static open_file_slot_t *open_file_table;
+static _Atomic uint64_t *open_file_bitmap;
+
+/* Directory index (dentry cache): a chained hash table over the entries of
+ * every directory, keyed by (parent directory i-number, name), which
+ * add_dir_entry() and clear_dir_entry() keep in sync with the directories'
+ * blocks, so that resolving a path never reads them. Since an i-node has at
+ * most one name, the index node of an entry is the one of its i-node
+ * (dir_index[sub_inumber]). It is protected by dir_index_lock, so lookups can
+ * run concurrently with each other */
+typedef struct {
+    int di_dir_inumber; /* -1 if the i-node isn't in any directory */
+    int di_bucket;      /* directory bucket holding the entry */
+    int di_slot;        /* position of the entry in the bucket */
+    int di_next;        /* next i-node in the same bucket, -1 if none */
+    char di_name[MAX_FILE_NAME];
+} dir_index_entry_t;
+
+static dir_index_entry_t *dir_index;
+static int *dir_index_buckets;
+static size_t dir_index_bucket_count;
+static pthread_rwlock_t dir_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Directories are extendible hash tables: a directory's bucket table holds
+ * 2^i_dir_depth bucket numbers, indexed by the low bits of the names' hashes,
+ * and bucket b is its block 1 + b. The table's first block is the
+ * directory's block 0 and, as the table grows, its next ones are taken from
+ * the end of the largest possible file (dir_max_file_blocks), so that small
+ * directories only use direct blocks. A full bucket is split in two, doubling
+ * the table first if needed, up to dir_max_depth (which is as deep as the
+ * largest possible file allows) */
+static int dir_max_depth;
+static size_t dir_max_file_blocks;
+
+atomic_int open_files_count = 0;
+atomic_int open_flag = 1;
 pthread_cond_t open_files_cond;
 pthread_mutex_t open_files_mutex;
 
 static inline bool valid_inumber(int inumber) {
-    return inumber >= 0 && inumber < INODE_TABLE_SIZE;
+    return inumber >= 0 && (size_t)inumber < INODE_TABLE_SIZE;
 }
 
 static inline bool valid_block_number(int block_number) {
-    return block_number >= 0 && block_number < DATA_BLOCKS;
+    return block_number >= 0 && (size_t)block_number < DATA_BLOCKS;
+}
+
+static inline int handle_slot(int file_handle) {
+    return file_handle & HANDLE_SLOT_MASK;
+}
+
+static inline unsigned int handle_generation(int file_handle) {
+    return (unsigned int)file_handle >> HANDLE_SLOT_BITS;
 }
 
 static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+    return file_handle >= 0 &&
+           (size_t)handle_slot(file_handle) < MAX_OPEN_FILES;
+}
+
+/* Returns the lock associated with the given inumber (NULL if invalid) */
+pthread_rwlock_t *get_inode_table_lock(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return NULL;
+    }
+    return &inode_locks[inumber].il_table_lock;
+}
+
+/* Returns the lock guarding the size and block map of the given inumber */
+pthread_rwlock_t *get_inode_map_lock(int inumber) {
+    return &inode_locks[inumber].il_map_lock;
+}
+
+/* Returns the queue of pending appends to the given inumber */
+append_queue_t *get_inode_append_queue(int inumber) {
+    return &inode_locks[inumber].il_append_queue;
+}
+
+/* Returns the lock associated with the given file handle (NULL if invalid) */
+pthread_rwlock_t *get_open_file_table_lock(int file_handle) {
+    if (!valid_file_handle(file_handle)) {
+        return NULL;
+    }
+    return &open_file_table[handle_slot(file_handle)].os_lock;
 }
 
 /**
@@ -68,14 +261,100 @@ static void insert_delay() {
 }
 
 /*
- * Locks (and checks for errors) a given mutex
+ * Tells the CPU that the calling thread is spinning on a lock (which saves
+ * power and lets a sibling hyper-thread run)
+ */
+static void cpu_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * Spins on a lock before its caller blocks on it: the lock is tried up to
+ * fs_geometry.lock_spins times, pausing between tries for twice as long as
+ * the last time (up to MAX_LOCK_SPIN_PAUSES pauses). Most critical sections
+ * are a few instructions long, so the lock is usually released long before
+ * a thread that blocked on it would be woken up
+ * Input:
+ *  - try_lock: pthread_mutex_trylock, pthread_rwlock_tryrdlock or
+ *    pthread_rwlock_trywrlock
+ *  - lock: the lock
+ * Returns: true if the lock was taken, false if the caller should block
+ */
+static bool spin_on_lock(int (*try_lock)(void *), void *lock) {
+    unsigned pauses = 1;
+    for (unsigned spin = 0; spin < fs_geometry.lock_spins; spin++) {
+        int ret = try_lock(lock);
+        if (ret == 0) {
+            return true;
+        }
+        if (ret != EBUSY) {
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned i = 0; i < pauses; i++) {
+            cpu_pause();
+        }
+        if (pauses < MAX_LOCK_SPIN_PAUSES) {
+            pauses *= 2;
+        }
+    }
+    return false;
+}
+
+static int try_lock_mutex(void *mutex) {
+    return pthread_mutex_trylock((pthread_mutex_t *)mutex);
+}
+
+static int try_read_lock_rwlock(void *rwlock) {
+    return pthread_rwlock_tryrdlock((pthread_rwlock_t *)rwlock);
+}
+
+static int try_write_lock_rwlock(void *rwlock) {
+    return pthread_rwlock_trywrlock((pthread_rwlock_t *)rwlock);
+}
+
+/*
+ * Locks (and checks for errors) a given mutex, spinning on it first (see
+ * spin_on_lock)
  */
 void lock_mutex(pthread_mutex_t *mutex) {
+    if (spin_on_lock(try_lock_mutex, mutex)) {
+        return;
+    }
     if(pthread_mutex_lock(mutex) != 0) {
         exit(EXIT_FAILURE);
     }
 }
 
+/*
+ * Read-locks (and checks for errors) a given rwlock, spinning on it first
+ * (see spin_on_lock)
+ */
+void read_lock_rwlock(pthread_rwlock_t *rwlock) {
+    if (spin_on_lock(try_read_lock_rwlock, rwlock)) {
+        return;
+    }
+    if(pthread_rwlock_rdlock(rwlock) != 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Write-locks (and checks for errors) a given rwlock, spinning on it first
+ * (see spin_on_lock)
+ */
+void write_lock_rwlock(pthread_rwlock_t *rwlock) {
+    if (spin_on_lock(try_write_lock_rwlock, rwlock)) {
+        return;
+    }
+    if(pthread_rwlock_wrlock(rwlock) != 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
 /*
  * Unlocks (and checks for errors) a given mutex
  */
@@ -85,6 +364,15 @@ void unlock_mutex(pthread_mutex_t *mutex) {
     }
 }
 
+/*
+ * Unlocks (and checks for errors) a given rwlock
+ */
+void unlock_rwlock(pthread_rwlock_t *rwlock) {
+    if(pthread_rwlock_unlock(rwlock) != 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
 /*
  * Initializes (and checks for errors) a given mutex
  */
@@ -94,6 +382,15 @@ void init_mutex(pthread_mutex_t *mutex) {
     }
 }
 
+/*
+ * Initializes (and checks for errors) a given rwlock
+ */
+void init_rwlock(pthread_rwlock_t *rwlock) {
+    if(pthread_rwlock_init(rwlock, NULL) != 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
 /*
  * Destroys (and checks for errors) a given mutex
  */
@@ -103,6 +400,15 @@ void destroy_mutex(pthread_mutex_t *mutex) {
     }
 }
 
+/*
+ * Destroys (and checks for errors) a given rwlock
+ */
+void destroy_rwlock(pthread_rwlock_t *rwlock) {
+    if(pthread_rwlock_destroy(rwlock) != 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
 /*
  * Reads (and guarantees that it reads correctly) a given number of bytes
  * from a pipe to a given buffer
@@ -140,27 +446,408 @@ int write_buffer(int tx, char *buf, size_t to_write) {
 }
 
 /*
- * Initializes FS state
+ * Reserves 'size' bytes of the arena, right after the ones reserved so far
+ * (rounded up to ARENA_ALIGNMENT)
+ * Returns: the offset of the reserved bytes inside the arena
  */
-void state_init() {
-    init_mutex(&open_files_mutex);
-	lock_mutex(&open_files_mutex);
-	open_flag = 1;
-	unlock_mutex(&open_files_mutex);
+static size_t arena_reserve(size_t *arena_size, size_t size) {
+    size_t offset =
+        (*arena_size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+    *arena_size = offset + size;
+    return offset;
+}
+
+/*
+ * Maps an arena of (at least) *arena_size bytes: the first *arena_size bytes
+ * of a file (shared with it), or anonymous memory if 'fd' is -1. With huge
+ * pages, explicit huge pages (MAP_HUGETLB) are tried first for anonymous
+ * arenas, falling back to regular pages with transparent huge pages
+ * requested for them.
+ * Returns: the arena (with *arena_size set to its actual size), NULL if
+ * failed
+ */
+static char *arena_map(size_t *arena_size, bool huge_pages, int fd) {
+    void *arena;
+    if (fd != -1) {
+        arena = mmap(NULL, *arena_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+        if (arena == MAP_FAILED) {
+            fprintf(stderr, "[ERR]: mmap failed: %s\n", strerror(errno));
+            return NULL;
+        }
+        if (huge_pages) {
+            madvise(arena, *arena_size, MADV_HUGEPAGE); // only a hint
+        }
+        return (char *)arena;
+    }
+
+    if (huge_pages) {
+        size_t huge_size =
+            (*arena_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        arena = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena != MAP_FAILED) {
+            *arena_size = huge_size;
+            return (char *)arena;
+        }
+    }
+
+    arena = mmap(NULL, *arena_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        fprintf(stderr, "[ERR]: mmap failed: %s\n", strerror(errno));
+        return NULL;
+    }
+    if (huge_pages) {
+        madvise(arena, *arena_size, MADV_HUGEPAGE); // only a hint
+    }
+    return (char *)arena;
+}
+
+/*
+ * Checks whether a geometry can be used for a volume
+ */
+static bool valid_geometry(tfs_geometry_t const *geometry) {
+    return geometry->block_size >= sizeof(dir_bucket_t) + sizeof(dir_entry_t) &&
+           geometry->block_size % sizeof(int) == 0 &&
+           geometry->data_blocks > 0 && geometry->data_blocks <= INT_MAX &&
+           geometry->inode_table_size > 0 &&
+           geometry->inode_table_size <= INT_MAX &&
+           geometry->max_open_files > 0 &&
+           geometry->max_open_files <= HANDLE_SLOT_MASK + 1;
+}
+
+static int *dir_table_entry(inode_t *inode, size_t index, bool allocate);
+static dir_bucket_t *dir_bucket_create(inode_t *inode, int depth);
+static int dir_index_rebuild();
+
+/*
+ * Opens (creating it if needed) a volume image file. If it already holds a
+ * volume, the geometry is taken from its superblock.
+ * Input:
+ *  - path: the image file's path
+ *  - formatted: set to whether the image already holds a volume
+ * Returns: the image file's descriptor, -1 if failed
+ */
+static int image_open(char const *path, bool *formatted) {
+    int fd = open(path, O_RDWR | O_CREAT, 0640);
+    if (fd == -1) {
+        fprintf(stderr, "[ERR]: open(%s) failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    superblock_t image_superblock;
+    ssize_t ret = pread(fd, &image_superblock, sizeof(superblock_t), 0);
+    if (ret == -1) {
+        fprintf(stderr, "[ERR]: read failed: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* An empty image, or one whose formatting was interrupted, is formatted
+     * again */
+    *formatted = ret == sizeof(superblock_t) &&
+                 image_superblock.sb_magic == SUPERBLOCK_MAGIC;
+    if (*formatted && (image_superblock.sb_version != SUPERBLOCK_VERSION ||
+                       image_superblock.sb_inode_size != sizeof(inode_t) ||
+                       image_superblock.sb_dir_bucket_size !=
+                           sizeof(dir_bucket_t) ||
+                       image_superblock.sb_dir_entry_size !=
+                           sizeof(dir_entry_t))) {
+        fprintf(stderr, "[ERR]: %s has an incompatible layout\n", path);
+        close(fd);
+        return -1;
+    }
+    if (*formatted) {
+        fs_geometry.block_size = image_superblock.sb_block_size;
+        fs_geometry.data_blocks = image_superblock.sb_data_blocks;
+        fs_geometry.inode_table_size = image_superblock.sb_inode_table_size;
+    } else if (ret != 0 && image_superblock.sb_magic != 0) {
+        fprintf(stderr, "[ERR]: %s isn't a TecnicoFS image\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Formats an empty volume: every i-node and data block is free, except for
+ * the root directory
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int volume_format() {
     for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
         freeinode_ts[i] = FREE;
     }
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+    for (size_t i = 0; i < FREE_BLOCKS_WORDS; i++) {
+        free_blocks[i] = 0;
+    }
+    if (DATA_BLOCKS % FREE_BLOCKS_WORD_BITS != 0) {
+        free_blocks[FREE_BLOCKS_WORDS - 1] =
+            UINT64_MAX << (DATA_BLOCKS % FREE_BLOCKS_WORD_BITS);
+    }
+
+    /* create root inode */
+    if (inode_create(T_DIRECTORY) != ROOT_DIR_INUM) {
+        return -1;
+    }
+
+    superblock->sb_block_size = BLOCK_SIZE;
+    superblock->sb_data_blocks = DATA_BLOCKS;
+    superblock->sb_inode_table_size = INODE_TABLE_SIZE;
+    superblock->sb_version = SUPERBLOCK_VERSION;
+    superblock->sb_inode_size = sizeof(inode_t);
+    superblock->sb_dir_bucket_size = sizeof(dir_bucket_t);
+    superblock->sb_dir_entry_size = sizeof(dir_entry_t);
+    superblock->sb_magic = SUPERBLOCK_MAGIC;
+    return 0;
+}
+
+/*
+ * Initializes FS state: maps the volume image, formatting it unless it is an
+ * image file that already holds a volume
+ * Input:
+ *  - geometry: the volume's geometry (for an existing image file, only its
+ *    max_open_files, huge_pages and lock_spins are used)
+ * Returns: 0 if successful, -1 otherwise
+ */
+int state_init(tfs_geometry_t const *geometry) {
+    fs_geometry = *geometry;
+    /* On a single CPU, the holder of a busy lock can't run while its waiter
+     * spins */
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        fs_geometry.lock_spins = 0;
+    }
+    bool formatted = false;
+    fs_image_fd = -1;
+    if (geometry->image_path != NULL) {
+        fs_image_fd = image_open(geometry->image_path, &formatted);
+        if (fs_image_fd == -1) {
+            return -1;
+        }
+    }
+    if (!valid_geometry(&fs_geometry)) {
+        state_destroy();
+        return -1;
+    }
+
+    /* Lays out the volume image */
+    fs_image_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t fs_data_offset =
+        arena_reserve(&fs_image_size, BLOCK_SIZE * DATA_BLOCKS);
+    size_t inode_table_offset =
+        arena_reserve(&fs_image_size, INODE_TABLE_SIZE * sizeof(inode_t));
+    size_t freeinode_ts_offset =
+        arena_reserve(&fs_image_size, INODE_TABLE_SIZE * sizeof(char));
+    size_t free_blocks_offset =
+        arena_reserve(&fs_image_size, FREE_BLOCKS_WORDS * sizeof(uint64_t));
+
+    /* Lays out the arena */
+    fs_arena_size = 0;
+    size_t free_inodes_offset = arena_reserve(
+        &fs_arena_size, FREE_INODES_WORDS * sizeof(_Atomic uint64_t));
+    size_t inode_locks_offset = arena_reserve(
+        &fs_arena_size, INODE_TABLE_SIZE * sizeof(inode_locks_t));
+    size_t open_file_table_offset = arena_reserve(
+        &fs_arena_size, MAX_OPEN_FILES * sizeof(open_file_slot_t));
+    size_t open_file_bitmap_offset = arena_reserve(
+        &fs_arena_size, OPEN_FILES_WORDS * sizeof(_Atomic uint64_t));
+    dir_index_bucket_count = 1;
+    while (dir_index_bucket_count < INODE_TABLE_SIZE) {
+        dir_index_bucket_count *= 2;
+    }
+    size_t dir_index_offset = arena_reserve(
+        &fs_arena_size, INODE_TABLE_SIZE * sizeof(dir_index_entry_t));
+    size_t dir_index_buckets_offset =
+        arena_reserve(&fs_arena_size, dir_index_bucket_count * sizeof(int));
+
+    dir_max_file_blocks = MAX_FILE_BLOCKS;
+    dir_max_depth = 0;
+    while (dir_max_depth < 30) {
+        size_t buckets = (size_t)1 << (dir_max_depth + 1);
+        size_t table_blocks =
+            (buckets + INDIRECT_BLOCK_ENTRIES - 1) / INDIRECT_BLOCK_ENTRIES;
+        if (table_blocks + buckets > dir_max_file_blocks) {
+            break;
+        }
+        dir_max_depth++;
+    }
+
+    /* A new image file is sized (with zeros) before being mapped */
+    if (fs_image_fd != -1) {
+        struct stat image_stat;
+        if (fstat(fs_image_fd, &image_stat) == -1 ||
+            (!formatted &&
+             ftruncate(fs_image_fd, (off_t)fs_image_size) == -1) ||
+            (formatted && (size_t)image_stat.st_size < fs_image_size)) {
+            fprintf(stderr, "[ERR]: can't size the image file\n");
+            state_destroy();
+            return -1;
+        }
+    }
+
+    fs_image = arena_map(&fs_image_size, fs_geometry.huge_pages, fs_image_fd);
+    fs_arena = arena_map(&fs_arena_size, fs_geometry.huge_pages, -1);
+    if (fs_image == NULL || fs_arena == NULL) {
+        state_destroy();
+        return -1;
+    }
+    superblock = (superblock_t *)fs_image;
+    fs_data = fs_image + fs_data_offset;
+    inode_table = (inode_t *)(fs_image + inode_table_offset);
+    freeinode_ts = fs_image + freeinode_ts_offset;
+    free_blocks = (uint64_t *)(fs_image + free_blocks_offset);
+    free_inodes = (_Atomic uint64_t *)(fs_arena + free_inodes_offset);
+    inode_locks = (inode_locks_t *)(fs_arena + inode_locks_offset);
+    open_file_table = (open_file_slot_t *)(fs_arena + open_file_table_offset);
+    open_file_bitmap =
+        (_Atomic uint64_t *)(fs_arena + open_file_bitmap_offset);
+    dir_index = (dir_index_entry_t *)(fs_arena + dir_index_offset);
+    dir_index_buckets = (int *)(fs_arena + dir_index_buckets_offset);
+
+    init_mutex(&open_files_mutex);
+    atomic_store(&open_flag, 1);
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        range_lock_t *range_lock = &inode_locks[i].il_range_lock;
+        append_queue_t *append_queue = &inode_locks[i].il_append_queue;
+        init_rwlock(&inode_locks[i].il_table_lock);
+        init_mutex(&range_lock->rl_mutex);
+        if (pthread_cond_init(&range_lock->rl_released, NULL) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        range_lock->rl_held = NULL;
+        init_rwlock(&inode_locks[i].il_map_lock);
+        init_mutex(&append_queue->aq_mutex);
+        if (pthread_cond_init(&append_queue->aq_done, NULL) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        append_queue->aq_head = NULL;
+        append_queue->aq_tail = &append_queue->aq_head;
+        append_queue->aq_combining = false;
+        dir_index[i].di_dir_inumber = -1;
+    }
+    for (size_t i = 0; i < dir_index_bucket_count; i++) {
+        dir_index_buckets[i] = -1;
     }
+    free_blocks_cursor = 0;
 
+    /* The i-nodes taken in an existing volume are marked in the bitmap */
+    for (size_t i = 0; i < FREE_INODES_WORDS; i++) {
+        atomic_store(&free_inodes[i], 0);
+    }
+    if (INODE_TABLE_SIZE % FREE_INODES_WORD_BITS != 0) {
+        atomic_store(&free_inodes[FREE_INODES_WORDS - 1],
+                     UINT64_MAX << (INODE_TABLE_SIZE % FREE_INODES_WORD_BITS));
+    }
+    if (formatted) {
+        for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+            if (freeinode_ts[i] == TAKEN) {
+                atomic_fetch_or(&free_inodes[i / FREE_INODES_WORD_BITS],
+                                (uint64_t)1 << (i % FREE_INODES_WORD_BITS));
+            }
+        }
+    }
+    atomic_store(&free_inodes_cursor, 0);
+
+    for (size_t i = 0; i < OPEN_FILES_WORDS; i++) {
+        atomic_store(&open_file_bitmap[i], 0);
+    }
+    if (MAX_OPEN_FILES % OPEN_FILES_WORD_BITS != 0) {
+        atomic_store(&open_file_bitmap[OPEN_FILES_WORDS - 1],
+                     UINT64_MAX << (MAX_OPEN_FILES % OPEN_FILES_WORD_BITS));
+    }
+    atomic_store(&open_files_count, 0);
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+        atomic_store(&open_file_table[i].os_generation, 0);
+        init_rwlock(&open_file_table[i].os_lock);
+    }
+
+    /* An existing volume only needs its directory index to be rebuilt */
+    if ((formatted ? dir_index_rebuild() : volume_format()) == -1) {
+        state_destroy();
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Destroys FS state, writing the volume image back to its file (if any)
+ */
+void state_destroy() {
+    if (fs_arena != NULL) {
+        /* The locks are only initialized once the arena is mapped */
+        for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+            range_lock_t *range_lock = &inode_locks[i].il_range_lock;
+            append_queue_t *append_queue = &inode_locks[i].il_append_queue;
+            destroy_rwlock(&inode_locks[i].il_table_lock);
+            destroy_mutex(&range_lock->rl_mutex);
+            if (pthread_cond_destroy(&range_lock->rl_released) != 0) {
+                exit(EXIT_FAILURE);
+            }
+            destroy_rwlock(&inode_locks[i].il_map_lock);
+            destroy_mutex(&append_queue->aq_mutex);
+            if (pthread_cond_destroy(&append_queue->aq_done) != 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+            destroy_rwlock(&open_file_table[i].os_lock);
+        }
+        if (munmap(fs_arena, fs_arena_size) != 0) {
+            fprintf(stderr, "[ERR]: munmap failed: %s\n", strerror(errno));
+        }
+        fs_arena = NULL;
+    }
+    if (fs_image != NULL) {
+        if (fs_image_fd != -1 && msync(fs_image, fs_image_size, MS_SYNC) != 0) {
+            fprintf(stderr, "[ERR]: msync failed: %s\n", strerror(errno));
+        }
+        if (munmap(fs_image, fs_image_size) != 0) {
+            fprintf(stderr, "[ERR]: munmap failed: %s\n", strerror(errno));
+        }
+        fs_image = NULL;
+    }
+    if (fs_image_fd != -1) {
+        close(fs_image_fd);
+        fs_image_fd = -1;
+    }
+
+    /* No i-node, block or file handle is valid from now on */
+    fs_geometry.data_blocks = 0;
+    fs_geometry.inode_table_size = 0;
+    fs_geometry.max_open_files = 0;
+}
+
+/*
+ * Claims a free i-node in the free i-nodes bitmap
+ * Returns: the i-node's number, or -1 if there is none
+ */
+static int inode_claim() {
+    insert_delay(); // simulate storage access delay (to free_inodes)
+    size_t start = atomic_load(&free_inodes_cursor);
+    for (size_t i = 0; i < FREE_INODES_WORDS; i++) {
+        size_t w = (start + i) % FREE_INODES_WORDS;
+        uint64_t word = atomic_load(&free_inodes[w]);
+        while (word != UINT64_MAX) {
+            /* Claims the word's first free i-node (on failure, the CAS
+             * reloads the word, and the next free i-node is tried) */
+            int bit = __builtin_ctzll(~word);
+            if (atomic_compare_exchange_weak(&free_inodes[w], &word,
+                                             word | (uint64_t)1 << bit)) {
+                atomic_store(&free_inodes_cursor, w);
+                return (int)(w * FREE_INODES_WORD_BITS) + bit;
+            }
+        }
     }
+    return -1;
 }
 
-void state_destroy() { /* nothing to do */
+/* Returns an i-node to the free i-nodes bitmap */
+static void inode_release(int inumber) {
+    size_t i = (size_t)inumber;
+    atomic_fetch_and(&free_inodes[i / FREE_INODES_WORD_BITS],
+                     ~((uint64_t)1 << (i % FREE_INODES_WORD_BITS)));
 }
 
 /*
@@ -171,48 +858,44 @@ void state_destroy() { /* nothing to do */
  *  new i-node's number if successfully created, -1 otherwise
  */
 int inode_create(inode_type n_type) {
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * (int)sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
-        }
-
-        /* Finds first free entry in i-node table */
-        if (freeinode_ts[inumber] == FREE) {
-            /* Found a free entry, so takes it for the new i-node*/
-            freeinode_ts[inumber] = TAKEN;
-            insert_delay(); // simulate storage access delay (to i-node)
-            inode_table[inumber].i_node_type = n_type;
-
-            if (n_type == T_DIRECTORY) {
-                /* Initializes directory (filling its block with empty
-                 * entries, labeled with inumber==-1) */
-                int b = data_block_alloc();
-                if (b == -1) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
+    int inumber = inode_claim();
+    if (inumber == -1) {
+        return -1;
+    }
 
-                inode_table[inumber].i_size = BLOCK_SIZE;
-                inode_table[inumber].i_data_block = b;
+    /* The i-node's lock guards its entry in freeinode_ts (which is kept for
+     * the volume image) and its type (see inode_is_directory) */
+    insert_delay(); // simulate storage access delay (to i-node)
+    write_lock_rwlock(&inode_locks[inumber].il_table_lock);
+    freeinode_ts[inumber] = TAKEN;
+    inode_table[inumber].i_node_type = n_type;
+    unlock_rwlock(&inode_locks[inumber].il_table_lock);
 
-                dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-                if (dir_entry == NULL) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
+    inode_table[inumber].i_size = 0;
+    for (size_t i = 0; i < MAX_DIRECT_BLOCKS; i++) {
+        inode_table[inumber].i_data_block[i] = -1;
+    }
+    inode_table[inumber].i_indirect_data_block = -1;
+    inode_table[inumber].i_double_indirect_data_block = -1;
 
-                for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    dir_entry[i].d_inumber = -1;
-                }
-            } else {
-                /* In case of a new file, simply sets its size to 0 */
-                inode_table[inumber].i_size = 0;
-                inode_table[inumber].i_data_block = -1;
-            }
-            return inumber;
+    if (n_type == T_DIRECTORY) {
+        /* Initializes directory (a one entry bucket table pointing to
+         * a single empty bucket) */
+        inode_table[inumber].i_dir_depth = 0;
+        inode_table[inumber].i_dir_buckets = 0;
+        int *table = dir_table_entry(&inode_table[inumber], 0, true);
+        if (table == NULL ||
+            dir_bucket_create(&inode_table[inumber], 0) == NULL) {
+            inode_free_blocks(&inode_table[inumber]);
+            write_lock_rwlock(&inode_locks[inumber].il_table_lock);
+            freeinode_ts[inumber] = FREE;
+            unlock_rwlock(&inode_locks[inumber].il_table_lock);
+            inode_release(inumber);
+            return -1;
         }
+        *table = 0;
     }
-    return -1;
+    return inumber;
 }
 
 /*
@@ -226,19 +909,24 @@ int inode_delete(int inumber) {
     insert_delay();
     insert_delay();
 
-    if (!valid_inumber(inumber) || freeinode_ts[inumber] == FREE) {
+    if (!valid_inumber(inumber)) {
         return -1;
     }
 
-    freeinode_ts[inumber] = FREE;
-
-    if (inode_table[inumber].i_size > 0) {
-        if (data_block_free(inode_table[inumber].i_data_block) == -1) {
-            return -1;
-        }
+    write_lock_rwlock(&inode_locks[inumber].il_table_lock);
+    if (freeinode_ts[inumber] == FREE) {
+        unlock_rwlock(&inode_locks[inumber].il_table_lock);
+        return -1;
     }
 
-    return 0;
+    /* The blocks are released before the i-node, so that it can't be reused
+     * while they are still being freed */
+    int ret = inode_free_blocks(&inode_table[inumber]);
+    freeinode_ts[inumber] = FREE;
+    unlock_rwlock(&inode_locks[inumber].il_table_lock);
+    inode_release(inumber);
+
+    return ret;
 }
 
 /*
@@ -256,6 +944,567 @@ inode_t *inode_get(int inumber) {
     return &inode_table[inumber];
 }
 
+/*
+ * Returns the entries of the indirect block referenced by *slot. If there is
+ * no such block and 'allocate' is set, a new one (with every entry set to -1)
+ * is allocated and stored in *slot, and *slot is also added to 'allocated'
+ * (whose count is in 'allocated_count'), so the caller can free it again.
+ * Returns: pointer to the indirect block's entries, NULL if it doesn't exist
+ */
+static int *indirect_block_get(int *slot, bool allocate, int **allocated,
+                               int *allocated_count) {
+    if (*slot != -1) {
+        return (int *)data_block_get(*slot);
+    }
+    if (!allocate) {
+        return NULL;
+    }
+
+    int block_number = data_block_alloc();
+    int *entries = (int *)data_block_get(block_number);
+    if (entries == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < INDIRECT_BLOCK_ENTRIES; i++) {
+        entries[i] = -1;
+    }
+    *slot = block_number;
+    allocated[(*allocated_count)++] = slot;
+    return entries;
+}
+
+/*
+ * Frees the indirect blocks allocated while mapping a block that couldn't be
+ * allocated itself (see indirect_block_get), the last allocated first
+ */
+static void indirect_blocks_undo(int **allocated, int allocated_count) {
+    while (allocated_count > 0) {
+        int *slot = allocated[--allocated_count];
+        data_block_free(*slot);
+        *slot = -1;
+    }
+}
+
+/*
+ * Frees a block and, if it is an indirect block ('depth' > 0), every block
+ * referenced by it, 'depth' levels down.
+ * Returns: 0 if successful, -1 if failed
+ */
+static int block_tree_free(int block_number, int depth) {
+    if (block_number == -1) {
+        return 0;
+    }
+
+    if (depth > 0) {
+        int *entries = (int *)data_block_get(block_number);
+        if (entries == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < INDIRECT_BLOCK_ENTRIES; i++) {
+            if (block_tree_free(entries[i], depth - 1) == -1) {
+                return -1;
+            }
+        }
+    }
+    return data_block_free(block_number);
+}
+
+/*
+ * Returns the data block holding a given block of a file.
+ * The first MAX_DIRECT_BLOCKS file blocks are referenced by the i-node
+ * itself, the next INDIRECT_BLOCK_ENTRIES by its indirect block, and the
+ * following INDIRECT_BLOCK_ENTRIES^2 through its double indirect block.
+ * Input:
+ *  - inode: the file's i-node
+ *  - file_block: index of the block inside the file
+ *  - allocate: whether the block (and the indirect blocks leading to it)
+ *    should be allocated if it doesn't exist yet
+ * Returns: data block index, or -1 if it doesn't exist (or can't be
+ * allocated)
+ */
+int inode_block_get(inode_t *inode, size_t file_block, bool allocate) {
+    /* The indirect blocks allocated on the way to the block (at most two) */
+    int *allocated[2];
+    int allocated_count = 0;
+
+    int *slot;
+    if (file_block < MAX_DIRECT_BLOCKS) {
+        slot = &inode->i_data_block[file_block];
+    } else if (file_block - MAX_DIRECT_BLOCKS < INDIRECT_BLOCK_ENTRIES) {
+        int *indirect = indirect_block_get(&inode->i_indirect_data_block,
+                                           allocate, allocated,
+                                           &allocated_count);
+        if (indirect == NULL) {
+            return -1;
+        }
+        slot = &indirect[file_block - MAX_DIRECT_BLOCKS];
+    } else if (file_block - MAX_DIRECT_BLOCKS - INDIRECT_BLOCK_ENTRIES <
+               INDIRECT_BLOCK_ENTRIES * INDIRECT_BLOCK_ENTRIES) {
+        size_t index = file_block - MAX_DIRECT_BLOCKS - INDIRECT_BLOCK_ENTRIES;
+        int *double_indirect =
+            indirect_block_get(&inode->i_double_indirect_data_block, allocate,
+                               allocated, &allocated_count);
+        if (double_indirect == NULL) {
+            return -1;
+        }
+        int *indirect = indirect_block_get(
+            &double_indirect[index / INDIRECT_BLOCK_ENTRIES], allocate,
+            allocated, &allocated_count);
+        if (indirect == NULL) {
+            indirect_blocks_undo(allocated, allocated_count);
+            return -1;
+        }
+        slot = &indirect[index % INDIRECT_BLOCK_ENTRIES];
+    } else {
+        return -1;
+    }
+
+    if (*slot == -1 && allocate) {
+        /* New blocks are zeroed, so that the part of a file's last block
+         * past its end always reads as zeros (which lets writes past the end
+         * of a file leave no garbage behind, see _tfs_write_fill_gap) */
+        int block_number = data_block_alloc();
+        void *block = data_block_get(block_number);
+        if (block == NULL) {
+            indirect_blocks_undo(allocated, allocated_count);
+            return -1;
+        }
+        memset(block, 0, BLOCK_SIZE);
+        *slot = block_number;
+    }
+    return *slot;
+}
+
+/*
+ * Returns whether none of the entries of an indirect block is in use
+ */
+static bool indirect_block_empty(int const *entries) {
+    for (size_t i = 0; i < INDIRECT_BLOCK_ENTRIES; i++) {
+        if (entries[i] != -1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Frees a given block of a file, along with the indirect blocks that lead
+ * to it and are left without any block
+ * Input:
+ *  - inode: the file's i-node
+ *  - file_block: index of the block inside the file
+ * Returns: 0 if successful, -1 if the block doesn't exist
+ */
+int inode_block_free(inode_t *inode, size_t file_block) {
+    /* The slots on the way from the i-node to the block, the block's last */
+    int *path[3];
+    int depth = 0;
+
+    if (file_block < MAX_DIRECT_BLOCKS) {
+        path[depth++] = &inode->i_data_block[file_block];
+    } else {
+        size_t index = file_block - MAX_DIRECT_BLOCKS;
+        int *slot = &inode->i_indirect_data_block;
+        if (index >= INDIRECT_BLOCK_ENTRIES) {
+            index -= INDIRECT_BLOCK_ENTRIES;
+            if (index >= INDIRECT_BLOCK_ENTRIES * INDIRECT_BLOCK_ENTRIES) {
+                return -1;
+            }
+            path[depth++] = &inode->i_double_indirect_data_block;
+            int *double_indirect = (int *)data_block_get(*path[0]);
+            if (double_indirect == NULL) {
+                return -1;
+            }
+            slot = &double_indirect[index / INDIRECT_BLOCK_ENTRIES];
+            index %= INDIRECT_BLOCK_ENTRIES;
+        }
+        path[depth++] = slot;
+        int *indirect = (int *)data_block_get(*slot);
+        if (indirect == NULL) {
+            return -1;
+        }
+        path[depth++] = &indirect[index];
+    }
+
+    if (data_block_free(*path[depth - 1]) == -1) {
+        return -1;
+    }
+    *path[--depth] = -1;
+    /* Then the indirect blocks left empty, from the block's up */
+    while (depth > 0) {
+        int *entries = (int *)data_block_get(*path[depth - 1]);
+        if (entries == NULL || !indirect_block_empty(entries)) {
+            break;
+        }
+        data_block_free(*path[depth - 1]);
+        *path[--depth] = -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns whether two ranges of blocks conflict (they overlap, and at least
+ * one of them is being written)
+ */
+static bool ranges_conflict(range_lock_entry_t const *a,
+                            range_lock_entry_t const *b) {
+    return (a->rl_write || b->rl_write) &&
+           a->rl_first_block < b->rl_end_block &&
+           b->rl_first_block < a->rl_end_block;
+}
+
+/*
+ * Locks a range of an i-node's bytes, waiting for the conflicting ranges
+ * held by other threads to be released. Ranges are locked by whole blocks,
+ * so that threads holding disjoint ranges never touch the same block.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - range: where the lock's state is kept (until it's unlocked)
+ *  - offset, len: the range of bytes to lock (at least one block is locked)
+ *  - write: whether the range is locked for writing (or for reading, which
+ *    can be shared)
+ */
+void inode_range_lock(int inumber, range_lock_entry_t *range, size_t offset,
+                      size_t len, bool write) {
+    range->rl_first_block = offset / BLOCK_SIZE;
+    range->rl_end_block = range->rl_first_block + 1;
+    if (len > 0) {
+        range->rl_end_block = len > SIZE_MAX - offset
+                                  ? SIZE_MAX
+                                  : (offset + len - 1) / BLOCK_SIZE + 1;
+    }
+    range->rl_write = write;
+
+    range_lock_t *lock = &inode_locks[inumber].il_range_lock;
+    lock_mutex(&lock->rl_mutex);
+    for (;;) {
+        range_lock_entry_t const *held = lock->rl_held;
+        while (held != NULL && !ranges_conflict(held, range)) {
+            held = held->rl_next;
+        }
+        if (held == NULL) {
+            break;
+        }
+        pthread_cond_wait(&lock->rl_released, &lock->rl_mutex);
+    }
+    range->rl_next = lock->rl_held;
+    lock->rl_held = range;
+    unlock_mutex(&lock->rl_mutex);
+}
+
+/*
+ * Unlocks a range locked by inode_range_lock
+ */
+void inode_range_unlock(int inumber, range_lock_entry_t *range) {
+    range_lock_t *lock = &inode_locks[inumber].il_range_lock;
+    lock_mutex(&lock->rl_mutex);
+    range_lock_entry_t **link = &lock->rl_held;
+    while (*link != range) {
+        link = &(*link)->rl_next;
+    }
+    *link = range->rl_next;
+    pthread_cond_broadcast(&lock->rl_released);
+    unlock_mutex(&lock->rl_mutex);
+}
+
+/*
+ * Frees all the data blocks of a file (including its indirect blocks).
+ * Input:
+ *  - inode: the file's i-node
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_free_blocks(inode_t *inode) {
+    for (size_t i = 0; i < MAX_DIRECT_BLOCKS; i++) {
+        if (block_tree_free(inode->i_data_block[i], 0) == -1) {
+            return -1;
+        }
+        inode->i_data_block[i] = -1;
+    }
+    if (block_tree_free(inode->i_indirect_data_block, 1) == -1) {
+        return -1;
+    }
+    inode->i_indirect_data_block = -1;
+    if (block_tree_free(inode->i_double_indirect_data_block, 2) == -1) {
+        return -1;
+    }
+    inode->i_double_indirect_data_block = -1;
+    return 0;
+}
+
+/*
+ * Checks whether a file's data is stored inline, in its i-node. A file is
+ * stored inline until it grows past MAX_INLINE_DATA bytes, and then moved to
+ * data blocks (by inode_spill_inline) for as long as it isn't truncated, so
+ * it is inline exactly when its first block isn't allocated.
+ */
+bool inode_is_inline(inode_t const *inode) {
+    return inode->i_node_type == T_FILE && inode->i_data_block[0] == -1;
+}
+
+/*
+ * Moves the inline data of a file to its first data block.
+ * Input:
+ *  - inode: the file's i-node
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_spill_inline(inode_t *inode) {
+    int block_number = inode_block_get(inode, 0, true);
+    void *block = data_block_get(block_number);
+    if (block == NULL) {
+        return -1;
+    }
+
+    memcpy(block, inode->i_inline_data, inode->i_size);
+    return 0;
+}
+
+/*
+ * Returns the hash of a name (FNV-1a, over the part of it that is compared)
+ */
+static uint32_t dir_name_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Returns the directory index bucket of a name inside a directory
+ */
+static size_t dir_index_bucket(int inumber, char const *name) {
+    return (dir_name_hash(name) ^ (uint32_t)inumber * 2654435761u) &
+           (dir_index_bucket_count - 1);
+}
+
+/*
+ * Adds an entry of a directory's bucket to the directory index
+ */
+static void dir_index_insert(int inumber, int bucket, int slot,
+                             dir_entry_t const *entry) {
+    dir_index_entry_t *index_entry = &dir_index[entry->d_inumber];
+    size_t index_bucket = dir_index_bucket(inumber, entry->d_name);
+    index_entry->di_dir_inumber = inumber;
+    index_entry->di_bucket = bucket;
+    index_entry->di_slot = slot;
+    memcpy(index_entry->di_name, entry->d_name, MAX_FILE_NAME);
+    index_entry->di_next = dir_index_buckets[index_bucket];
+    dir_index_buckets[index_bucket] = entry->d_inumber;
+}
+
+/*
+ * Removes an i-node from the directory index
+ */
+static void dir_index_remove(int sub_inumber) {
+    dir_index_entry_t *entry = &dir_index[sub_inumber];
+    int *link = &dir_index_buckets[dir_index_bucket(entry->di_dir_inumber,
+                                                    entry->di_name)];
+    while (*link != sub_inumber) {
+        link = &dir_index[*link].di_next;
+    }
+    *link = entry->di_next;
+    entry->di_dir_inumber = -1;
+}
+
+/*
+ * Returns a pointer to an entry of a directory's bucket table, allocating
+ * the table block holding it if needed and 'allocate' is set
+ * Returns: pointer to the entry, NULL if its block doesn't exist
+ */
+static int *dir_table_entry(inode_t *inode, size_t index, bool allocate) {
+    size_t table_block = index / INDIRECT_BLOCK_ENTRIES;
+    int block_number = inode_block_get(
+        inode, table_block == 0 ? 0 : dir_max_file_blocks - table_block,
+        allocate);
+    int *table = (int *)data_block_get(block_number);
+    if (table == NULL) {
+        return NULL;
+    }
+    return &table[index % INDIRECT_BLOCK_ENTRIES];
+}
+
+/*
+ * Returns a bucket of a directory
+ */
+static dir_bucket_t *dir_bucket_get(inode_t *inode, int bucket) {
+    return (dir_bucket_t *)data_block_get(
+        inode_block_get(inode, 1 + (size_t)bucket, false));
+}
+
+/*
+ * Returns the entries of a directory bucket
+ */
+static dir_entry_t *dir_bucket_entries(dir_bucket_t *bucket) {
+    return (dir_entry_t *)(bucket + 1);
+}
+
+/*
+ * Appends a new empty bucket (with every entry labeled with inumber==-1) to
+ * a directory
+ * Returns: pointer to the bucket, NULL if it couldn't be allocated
+ */
+static dir_bucket_t *dir_bucket_create(inode_t *inode, int depth) {
+    int block_number =
+        inode_block_get(inode, 1 + (size_t)inode->i_dir_buckets, true);
+    dir_bucket_t *bucket = (dir_bucket_t *)data_block_get(block_number);
+    if (bucket == NULL) {
+        return NULL;
+    }
+
+    bucket->db_depth = depth;
+    bucket->db_count = 0;
+    bucket->db_free_hint = 0;
+    dir_entry_t *dir_entry = dir_bucket_entries(bucket);
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        dir_entry[i].d_inumber = -1;
+    }
+    inode->i_dir_buckets++;
+    inode->i_size = (1 + (size_t)inode->i_dir_buckets) * BLOCK_SIZE;
+    return bucket;
+}
+
+/*
+ * Doubles the bucket table of a directory (the new half points to the same
+ * buckets as the old one)
+ * Returns: 0 if successful, -1 if failed
+ */
+static int dir_table_grow(inode_t *inode) {
+    if (inode->i_dir_depth == dir_max_depth) {
+        return -1;
+    }
+
+    size_t size = (size_t)1 << inode->i_dir_depth;
+    for (size_t i = 0; i < size; i++) {
+        int *old_entry = dir_table_entry(inode, i, false);
+        int *new_entry = dir_table_entry(inode, size + i, true);
+        if (old_entry == NULL || new_entry == NULL) {
+            return -1;
+        }
+        *new_entry = *old_entry;
+    }
+    inode->i_dir_depth++;
+    return 0;
+}
+
+/*
+ * Splits a full bucket of a directory, moving the entries whose next hash
+ * bit is set to a new bucket
+ * Input:
+ *  - inumber: identifier of the directory's i-node
+ *  - bucket_number: the bucket to split
+ *  - hash: hash of any name in the bucket
+ * Returns: 0 if successful, -1 if failed
+ */
+static int dir_bucket_split(int inumber, int bucket_number, uint32_t hash) {
+    inode_t *inode = &inode_table[inumber];
+    dir_bucket_t *bucket = dir_bucket_get(inode, bucket_number);
+    if (bucket == NULL) {
+        return -1;
+    }
+    int depth = bucket->db_depth;
+    if (depth == inode->i_dir_depth && dir_table_grow(inode) == -1) {
+        return -1;
+    }
+
+    int new_bucket_number = inode->i_dir_buckets;
+    dir_bucket_t *new_bucket = dir_bucket_create(inode, depth + 1);
+    if (new_bucket == NULL) {
+        return -1;
+    }
+
+    /* Moves the entries */
+    dir_entry_t *dir_entry = dir_bucket_entries(bucket);
+    dir_entry_t *new_dir_entry = dir_bucket_entries(new_bucket);
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (dir_entry[i].d_inumber == -1 ||
+            (dir_name_hash(dir_entry[i].d_name) >> depth & 1) == 0) {
+            continue;
+        }
+        int slot = new_bucket->db_count++;
+        new_dir_entry[slot] = dir_entry[i];
+        dir_index[dir_entry[i].d_inumber].di_bucket = new_bucket_number;
+        dir_index[dir_entry[i].d_inumber].di_slot = slot;
+        dir_entry[i].d_inumber = -1;
+        bucket->db_count--;
+    }
+    new_bucket->db_free_hint = new_bucket->db_count;
+    bucket->db_free_hint = 0;
+    bucket->db_depth = depth + 1;
+
+    /* Points the table entries with the new bit set to the new bucket */
+    size_t low_bits = hash & (((size_t)1 << depth) - 1);
+    size_t stride = (size_t)1 << depth;
+    for (size_t i = low_bits | stride; i < (size_t)1 << inode->i_dir_depth;
+         i += stride * 2) {
+        int *table = dir_table_entry(inode, i, false);
+        if (table == NULL) {
+            return -1;
+        }
+        *table = new_bucket_number;
+    }
+    return 0;
+}
+
+/*
+ * Returns whether an i-node is a directory; its type is read under its lock,
+ * since the i-node may be being created or deleted
+ */
+static bool inode_is_directory(int inumber) {
+    read_lock_rwlock(&inode_locks[inumber].il_table_lock);
+    bool is_directory = inode_table[inumber].i_node_type == T_DIRECTORY;
+    unlock_rwlock(&inode_locks[inumber].il_table_lock);
+    return is_directory;
+}
+
+/*
+ * Adds an entry to a directory, with dir_index_lock held for writing
+ */
+static int _add_dir_entry_unsynchronized(int inumber, int sub_inumber,
+                                         char const *sub_name) {
+    inode_t *inode = &inode_table[inumber];
+    if (dir_index[sub_inumber].di_dir_inumber != -1) {
+        return -1;
+    }
+
+    uint32_t hash = dir_name_hash(sub_name);
+    for (;;) {
+        /* Locates the bucket the name belongs to */
+        int *table = dir_table_entry(
+            inode, hash & (((size_t)1 << inode->i_dir_depth) - 1), false);
+        if (table == NULL) {
+            return -1;
+        }
+        int bucket_number = *table;
+        dir_bucket_t *bucket = dir_bucket_get(inode, bucket_number);
+        if (bucket == NULL) {
+            return -1;
+        }
+
+        if (bucket->db_count == MAX_DIR_ENTRIES) {
+            if (dir_bucket_split(inumber, bucket_number, hash) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        /* Finds and fills the first empty entry, starting at the free slot
+         * hint */
+        dir_entry_t *dir_entry = dir_bucket_entries(bucket);
+        size_t i = (size_t)bucket->db_free_hint;
+        while (dir_entry[i].d_inumber != -1) {
+            i++;
+        }
+        dir_entry[i].d_inumber = sub_inumber;
+        strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
+        dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
+        bucket->db_count++;
+        bucket->db_free_hint = (int)i + 1;
+
+        dir_index_insert(inumber, bucket_number, (int)i, &dir_entry[i]);
+        return 0;
+    }
+}
+
 /*
  * Adds an entry to the i-node directory data.
  * Input:
@@ -270,7 +1519,7 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
     }
 
     insert_delay(); // simulate storage access delay to i-node with inumber
-    if (inode_table[inumber].i_node_type != T_DIRECTORY) {
+    if (!inode_is_directory(inumber)) {
         return -1;
     }
 
@@ -278,27 +1527,134 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
         return -1;
     }
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block);
-    if (dir_entry == NULL) {
+    write_lock_rwlock(&dir_index_lock);
+    int ret = _add_dir_entry_unsynchronized(inumber, sub_inumber, sub_name);
+    unlock_rwlock(&dir_index_lock);
+    return ret;
+}
+
+/*
+ * Removes an entry from the i-node directory data.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ * Returns: SUCCESS or FAIL
+ */
+int clear_dir_entry(int inumber, int sub_inumber) {
+    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
         return -1;
     }
 
-    /* Finds and fills the first empty entry */
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
-            return 0;
+    insert_delay(); // simulate storage access delay to i-node with inumber
+    if (!inode_is_directory(inumber)) {
+        return -1;
+    }
+
+    write_lock_rwlock(&dir_index_lock);
+    if (dir_index[sub_inumber].di_dir_inumber != inumber) {
+        unlock_rwlock(&dir_index_lock);
+        return -1;
+    }
+
+    /* Locates the bucket containing the entry (buckets aren't merged back
+     * when they empty) */
+    dir_bucket_t *bucket = dir_bucket_get(&inode_table[inumber],
+                                          dir_index[sub_inumber].di_bucket);
+    if (bucket == NULL) {
+        unlock_rwlock(&dir_index_lock);
+        return -1;
+    }
+
+    dir_entry_t *dir_entry = dir_bucket_entries(bucket);
+    int slot = dir_index[sub_inumber].di_slot;
+    dir_entry[slot].d_inumber = -1;
+    dir_entry[slot].d_name[0] = '\0';
+    bucket->db_count--;
+    if (slot < bucket->db_free_hint) {
+        bucket->db_free_hint = slot;
+    }
+    dir_index_remove(sub_inumber);
+    unlock_rwlock(&dir_index_lock);
+    return 0;
+}
+
+/*
+ * Reads the next entry of a directory, in no particular order.
+ * Input:
+ *  - inumber: identifier of the directory's i-node
+ *  - position: where to continue from (0 for the first entry); it is
+ *    updated to follow the entry read
+ *  - entry: where to store the entry read
+ * Returns: 1 if an entry was read, 0 at the end of the directory, -1 if failed
+ */
+int dir_read_entry(int inumber, size_t *position, dir_entry_t *entry) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay to i-node with inumber
+    if (!inode_is_directory(inumber)) {
+        return -1;
+    }
+
+    inode_t *inode = &inode_table[inumber];
+    read_lock_rwlock(&dir_index_lock);
+    for (size_t bucket_number = *position / MAX_DIR_ENTRIES;
+         bucket_number < (size_t)inode->i_dir_buckets; bucket_number++) {
+        dir_bucket_t *bucket = dir_bucket_get(inode, (int)bucket_number);
+        if (bucket == NULL) {
+            unlock_rwlock(&dir_index_lock);
+            return -1;
+        }
+        dir_entry_t *dir_entry = dir_bucket_entries(bucket);
+        for (size_t i = *position % MAX_DIR_ENTRIES; i < MAX_DIR_ENTRIES;
+             i++) {
+            if (dir_entry[i].d_inumber != -1) {
+                *entry = dir_entry[i];
+                *position = bucket_number * MAX_DIR_ENTRIES + i + 1;
+                unlock_rwlock(&dir_index_lock);
+                return 1;
+            }
         }
+        *position = (bucket_number + 1) * MAX_DIR_ENTRIES;
     }
+    unlock_rwlock(&dir_index_lock);
+    return 0;
+}
 
-    return -1;
+/*
+ * Rebuilds the directory index from the entries of every directory, once an
+ * existing volume is mapped
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int dir_index_rebuild() {
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        inode_t *inode = &inode_table[inumber];
+        if (freeinode_ts[inumber] == FREE || inode->i_node_type != T_DIRECTORY) {
+            continue;
+        }
+
+        for (int bucket_number = 0; bucket_number < inode->i_dir_buckets;
+             bucket_number++) {
+            dir_bucket_t *bucket = dir_bucket_get(inode, bucket_number);
+            if (bucket == NULL) {
+                return -1;
+            }
+            dir_entry_t *dir_entry = dir_bucket_entries(bucket);
+            for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+                if (dir_entry[i].d_inumber != -1) {
+                    dir_index_insert(inumber, bucket_number, (int)i,
+                                     &dir_entry[i]);
+                }
+            }
+        }
+    }
+    return 0;
 }
 
 /* Looks for a given name inside a directory
+ * The directory index is searched, so the directory's blocks aren't read, and
+ * concurrent lookups don't exclude each other.
  * Input:
  * 	- parent directory's i-node number
  * 	- name to search
@@ -306,44 +1662,47 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
  */
 int find_in_dir(int inumber, char const *sub_name) {
     insert_delay(); // simulate storage access delay to i-node with inumber
-    if (!valid_inumber(inumber) ||
-        inode_table[inumber].i_node_type != T_DIRECTORY) {
+    if (!valid_inumber(inumber) || !inode_is_directory(inumber)) {
         return -1;
     }
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block);
-    if (dir_entry == NULL) {
-        return -1;
+    read_lock_rwlock(&dir_index_lock);
+    int sub_inumber = dir_index_buckets[dir_index_bucket(inumber, sub_name)];
+    while (sub_inumber != -1 &&
+           (dir_index[sub_inumber].di_dir_inumber != inumber ||
+            strncmp(dir_index[sub_inumber].di_name, sub_name, MAX_FILE_NAME) !=
+                0)) {
+        sub_inumber = dir_index[sub_inumber].di_next;
     }
+    unlock_rwlock(&dir_index_lock);
 
-    /* Iterates over the directory entries looking for one that has the target
-     * name */
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            return dir_entry[i].d_inumber;
-        }
-
-    return -1;
+    return sub_inumber;
 }
 
 /*
  * Allocated a new data block
+ * The bitmap is scanned a word at a time starting at the next-fit cursor, and
+ * the first free block inside a word is found with a count-trailing-zeros on
+ * its complement, so the cost doesn't grow as the volume fills up.
  * Returns: block index if successful, -1 otherwise
  */
 int data_block_alloc() {
-    for (int i = 0; i < DATA_BLOCKS; i++) {
-        if (i * (int)sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
+    lock_mutex(&free_blocks_lock);
+    for (size_t n = 0; n < FREE_BLOCKS_WORDS; n++) {
+        if (n * sizeof(uint64_t) % BLOCK_SIZE == 0) {
             insert_delay(); // simulate storage access delay to free_blocks
         }
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-            return i;
+        size_t w = (free_blocks_cursor + n) % FREE_BLOCKS_WORDS;
+        if (free_blocks[w] != UINT64_MAX) {
+            int bit = __builtin_ctzll(~free_blocks[w]);
+            free_blocks[w] |= (uint64_t)1 << bit;
+            free_blocks_cursor = w;
+            unlock_mutex(&free_blocks_lock);
+            return (int)(w * FREE_BLOCKS_WORD_BITS) + bit;
         }
     }
+    unlock_mutex(&free_blocks_lock);
     return -1;
 }
 
@@ -358,7 +1717,10 @@ int data_block_free(int block_number) {
     }
 
     insert_delay(); // simulate storage access delay to free_blocks
-    free_blocks[block_number] = FREE;
+    lock_mutex(&free_blocks_lock);
+    free_blocks[block_number / FREE_BLOCKS_WORD_BITS] &=
+        ~((uint64_t)1 << (block_number % FREE_BLOCKS_WORD_BITS));
+    unlock_mutex(&free_blocks_lock);
     return 0;
 }
 
@@ -373,58 +1735,109 @@ void *data_block_get(int block_number) {
     }
 
     insert_delay(); // simulate storage access delay to block
-    return &fs_data[block_number * BLOCK_SIZE];
+    return &fs_data[(size_t)block_number * BLOCK_SIZE];
 }
 
 /* Add new entry to the open file table
  * Inputs:
  * 	- I-node number of the file to open
  * 	- Initial offset
+ * 	- Whether writes append to the end of the file (TFS_O_APPEND)
  * Returns: file handle if successful, -1 otherwise
  */
-int add_to_open_file_table(int inumber, size_t offset) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            lock_mutex(&open_files_mutex);
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            open_files_count++;
-            unlock_mutex(&open_files_mutex);
-            return i;
+int add_to_open_file_table(int inumber, size_t offset, bool append) {
+    for (size_t w = 0; w < OPEN_FILES_WORDS; w++) {
+        uint64_t word = atomic_load(&open_file_bitmap[w]);
+        while (word != UINT64_MAX) {
+            /* Claims the word's first free slot (on failure, the CAS reloads
+             * the word, and the next free slot is tried) */
+            int bit = __builtin_ctzll(~word);
+            if (!atomic_compare_exchange_weak(&open_file_bitmap[w], &word,
+                                              word | (uint64_t)1 << bit)) {
+                continue;
+            }
+            atomic_fetch_add(&open_files_count, 1);
+
+            /* The slot's lock is only held by threads that still use a stale
+             * handle to it, so it is free most of the time */
+            int slot = (int)(w * OPEN_FILES_WORD_BITS) + bit;
+            open_file_slot_t *file_slot = &open_file_table[slot];
+            write_lock_rwlock(&file_slot->os_lock);
+            file_slot->os_entry.of_inumber = inumber;
+            file_slot->os_entry.of_offset = offset;
+            file_slot->os_entry.of_append = append;
+            unsigned int generation = atomic_load(&file_slot->os_generation);
+            unlock_rwlock(&file_slot->os_lock);
+            return (int)(generation << HANDLE_SLOT_BITS) | slot;
         }
     }
     return -1;
 }
 
+/* Decrements the number of open files; whoever closes the last one does it
+ * while holding open_files_mutex, so tfs_destroy_after_all_closed() can't
+ * tear down the FS before it is done signalling */
+static void open_files_count_decrement() {
+    int count = atomic_load(&open_files_count);
+    while (count > 1) {
+        if (atomic_compare_exchange_weak(&open_files_count, &count,
+                                         count - 1)) {
+            return;
+        }
+    }
+
+    lock_mutex(&open_files_mutex);
+    if (atomic_fetch_sub(&open_files_count, 1) == 1) {
+        pthread_cond_signal(&open_files_cond);
+    }
+    unlock_mutex(&open_files_mutex);
+}
+
 /* Frees an entry from the open file table
  * Inputs:
  * 	- file handle to free/close
  * Returns 0 is success, -1 otherwise
  */
 int remove_from_open_file_table(int fhandle) {
-    if (!valid_file_handle(fhandle) ||
-        free_open_file_entries[fhandle] != TAKEN) {
+    if (!valid_file_handle(fhandle)) {
         return -1;
     }
-    lock_mutex(&open_files_mutex);
-    open_files_count--;
-    if (open_files_count == 0) {
-        pthread_cond_signal(&open_files_cond);
+    int slot = handle_slot(fhandle);
+    write_lock_rwlock(&open_file_table[slot].os_lock);
+    if (get_open_file_entry(fhandle) == NULL) {
+        unlock_rwlock(&open_file_table[slot].os_lock);
+        return -1;
     }
-    free_open_file_entries[fhandle] = FREE;
-    unlock_mutex(&open_files_mutex);
+    /* Invalidates every handle to the slot before releasing it */
+    atomic_store(&open_file_table[slot].os_generation,
+                 (handle_generation(fhandle) + 1) & HANDLE_GENERATION_MASK);
+    unlock_rwlock(&open_file_table[slot].os_lock);
+
+    /* The entry's lock is released first, since closing the last file may
+     * let tfs_destroy_after_all_closed tear down the open file table */
+    atomic_fetch_and(&open_file_bitmap[slot / OPEN_FILES_WORD_BITS],
+                     ~((uint64_t)1 << (slot % OPEN_FILES_WORD_BITS)));
+    open_files_count_decrement();
     return 0;
 }
 
 /* Returns pointer to a given entry in the open file table
  * Inputs:
  * 	 - file handle
- * Returns: pointer to the entry if sucessful, NULL otherwise
+ * Returns: pointer to the entry if sucessful, NULL otherwise (including when
+ * the handle was already closed)
+ * (the caller must hold the entry's lock, see get_open_file_table_lock)
  */
 open_file_entry_t *get_open_file_entry(int fhandle) {
     if (!valid_file_handle(fhandle)) {
         return NULL;
     }
-    return &open_file_table[fhandle];
+    int slot = handle_slot(fhandle);
+    uint64_t word = atomic_load(&open_file_bitmap[slot / OPEN_FILES_WORD_BITS]);
+    if (!(word & (uint64_t)1 << (slot % OPEN_FILES_WORD_BITS)) ||
+        atomic_load(&open_file_table[slot].os_generation) !=
+            handle_generation(fhandle)) {
+        return NULL;
+    }
+    return &open_file_table[slot].os_entry;
 }
@@ -3,9 +3,11 @@
 
 #include "config.h"
 #include "../common/common.h"
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 /*
@@ -16,29 +18,125 @@ typedef struct {
     int d_inumber;
 } dir_entry_t;
 
+/*
+ * Directory bucket header: each bucket block of a directory starts with it,
+ * and is followed by MAX_DIR_ENTRIES entries
+ */
+typedef struct {
+    int db_depth;     /* number of hash bits shared by all of its names */
+    int db_count;     /* entries in use */
+    int db_free_hint; /* no entry before this one is free */
+} dir_bucket_t;
+
 typedef enum { T_FILE, T_DIRECTORY } inode_type;
 
+/*
+ * Volume geometry, chosen when the FS is initialized
+ */
+typedef struct {
+    size_t block_size;
+    size_t data_blocks;
+    size_t inode_table_size;
+    size_t max_open_files;
+    /* Back the FS arenas with huge pages (MAP_HUGETLB if available,
+     * transparent huge pages otherwise) */
+    bool huge_pages;
+    /* Volume image file (created if it doesn't exist yet), NULL to keep the
+     * volume in memory only */
+    char const *image_path;
+    /* Number of times a lock is tried (spinning between tries) before a
+     * thread blocks on it, 0 to block at once (always 0 on a single CPU) */
+    unsigned lock_spins;
+} tfs_geometry_t;
+
+/* Geometry of the current FS instance. The macros below read it, so they
+ * are only fixed between state_init() and state_destroy() */
+extern tfs_geometry_t fs_geometry;
+
+#define BLOCK_SIZE (fs_geometry.block_size)
+#define DATA_BLOCKS (fs_geometry.data_blocks)
+#define INODE_TABLE_SIZE (fs_geometry.inode_table_size)
+#define MAX_OPEN_FILES (fs_geometry.max_open_files)
+
 /*
  * I-node
  */
 typedef struct {
-    inode_type i_node_type;
+    /* The fields a file operation reads come first, and each i-node starts a
+     * cache line of its own, so writers of neighbouring i-nodes don't share
+     * lines */
+    _Alignas(CACHE_LINE_SIZE) inode_type i_node_type;
     size_t i_size;
-    int i_data_block;
+    int i_data_block[MAX_DIRECT_BLOCKS];
+    int i_indirect_data_block;
+    int i_double_indirect_data_block;
+    /* Directories only: depth of the bucket table and number of buckets */
+    int i_dir_depth;
+    int i_dir_buckets;
+    /* Files only: the file's data, while it is stored inline (see
+     * inode_is_inline) */
+    char i_inline_data[MAX_INLINE_DATA];
     /* in a real FS, more fields would exist here */
 } inode_t;
 
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
+/*
+ * Range of blocks held in an i-node's range lock (see inode_range_lock); it
+ * is kept by the holder (e.g. in its stack) while the range is locked
+ */
+typedef struct range_lock_entry {
+    size_t rl_first_block;
+    size_t rl_end_block;
+    bool rl_write;
+    struct range_lock_entry *rl_next;
+} range_lock_entry_t;
+
 /*
  * Open file entry (in open file table)
  */
 typedef struct {
     int of_inumber;
     size_t of_offset;
+    bool of_append;
 } open_file_entry_t;
 
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+/*
+ * Pending append to a file (see get_inode_append_queue); it is kept by the
+ * appending thread (e.g. in its stack) until it is done
+ */
+typedef struct append_request {
+    void const *ar_buffer;
+    size_t ar_len;
+    ssize_t ar_written;
+    size_t ar_end;
+    bool ar_done;
+    struct append_request *ar_next;
+} append_request_t;
+
+/*
+ * Queue of the pending appends to a file, which are done in batches by
+ * whichever appender is the combiner
+ */
+typedef struct {
+    pthread_mutex_t aq_mutex;
+    pthread_cond_t aq_done;
+    append_request_t *aq_head;
+    append_request_t **aq_tail;
+    bool aq_combining;
+} append_queue_t;
+
+/* Number of entries held by a directory bucket */
+#define MAX_DIR_ENTRIES                                                        \
+    ((BLOCK_SIZE - sizeof(dir_bucket_t)) / sizeof(dir_entry_t))
+
+/* Number of block indexes held by an indirect block */
+#define INDIRECT_BLOCK_ENTRIES (BLOCK_SIZE / sizeof(int))
+
+/* Number of blocks of the largest possible file (see inode_block_get) */
+#define MAX_FILE_BLOCKS                                                        \
+    (MAX_DIRECT_BLOCKS + INDIRECT_BLOCK_ENTRIES +                              \
+     INDIRECT_BLOCK_ENTRIES * INDIRECT_BLOCK_ENTRIES)
 
 /*
  * The regular pipe read and write functions aren't guaranteed to read/write
@@ -50,32 +148,51 @@ int read_buffer(int rx, char *buf, size_t to_read);
 int write_buffer(int tx, char *buf, size_t to_write);
 
 void lock_mutex(pthread_mutex_t *mutex);
+void read_lock_rwlock(pthread_rwlock_t *rwlock);
+void write_lock_rwlock(pthread_rwlock_t *rwlock);
 void unlock_mutex(pthread_mutex_t *mutex);
+void unlock_rwlock(pthread_rwlock_t *rwlock);
 void init_mutex(pthread_mutex_t *mutex);
+void init_rwlock(pthread_rwlock_t *rwlock);
 void destroy_mutex(pthread_mutex_t *mutex);
+void destroy_rwlock(pthread_rwlock_t *rwlock);
 
-void state_init();
+int state_init(tfs_geometry_t const *geometry);
 void state_destroy();
 
 int inode_create(inode_type n_type);
 int inode_delete(int inumber);
 inode_t *inode_get(int inumber);
+int inode_block_get(inode_t *inode, size_t file_block, bool allocate);
+int inode_block_free(inode_t *inode, size_t file_block);
+int inode_free_blocks(inode_t *inode);
+bool inode_is_inline(inode_t const *inode);
+int inode_spill_inline(inode_t *inode);
 
 int clear_dir_entry(int inumber, int sub_inumber);
 int add_dir_entry(int inumber, int sub_inumber, char const *sub_name);
 int find_in_dir(int inumber, char const *sub_name);
+int dir_read_entry(int inumber, size_t *position, dir_entry_t *entry);
 
 int data_block_alloc();
 int data_block_free(int block_number);
 void *data_block_get(int block_number);
 
-int add_to_open_file_table(int inumber, size_t offset);
+int add_to_open_file_table(int inumber, size_t offset, bool append);
 int remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
 
+pthread_rwlock_t *get_inode_table_lock(int inumber);
+pthread_rwlock_t *get_inode_map_lock(int inumber);
+append_queue_t *get_inode_append_queue(int inumber);
+void inode_range_lock(int inumber, range_lock_entry_t *range, size_t offset,
+                      size_t len, bool write);
+void inode_range_unlock(int inumber, range_lock_entry_t *range);
+pthread_rwlock_t *get_open_file_table_lock(int file_handle);
+
 /* Stores the number of currently open files - useful for the function
  * tfs_destroy_after_all_closed() */
-extern int open_files_count;
+extern atomic_int open_files_count;
 
 /* Condition variable and mutex for the tfs_destroy_after_all_closed()
  * function - related to all files being closed (or not) */
@@ -84,6 +201,6 @@ extern pthread_mutex_t open_files_mutex;
 
 /* Condition that assures that tfs_open can only be used when tfs_init()
  * has been called */
-extern int open_flag;
+extern atomic_int open_flag;
 
 #endif // STATE_H
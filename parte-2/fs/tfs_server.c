@@ -3,7 +3,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,24 +17,92 @@
 #include <unistd.h>
 #include <pthread.h>
 
-int next_session_id = 1;
+/* A session id carries its slot's generation above the slot's index. The
+ * generation is bumped whenever the session is unmounted, so a stale id is
+ * rejected even if its slot has been mounted again */
+#define SESSION_SLOT_BITS (16)
+#define SESSION_SLOT_MASK ((1 << SESSION_SLOT_BITS) - 1)
+#define SESSION_GENERATION_MASK (INT_MAX >> SESSION_SLOT_BITS)
+
+/* Number of session slots that were ever mounted; the slots past it were
+ * never initialized */
+int next_session_slot = 0;
 int failure_code = -1;
+// the failure answer to the requests that are answered with a size
+ssize_t size_failure_code = -1;
 Session sessions[MAX_CLIENTS];
+/* Unmounted slots, as a lock-free stack: the index of the top slot plus one
+ * (0 if empty) in the low half, and a tag that is bumped on every change in
+ * the high half, so that a pop can't succeed on a stack that was changed
+ * under it (ABA). The slots are linked by their next_free */
+_Atomic uint64_t free_sessions = 0;
+/* Sessions with a request waiting for a worker, in arrival order */
+Session *ready_sessions_head = NULL;
+Session *ready_sessions_tail = NULL;
+pthread_mutex_t ready_sessions_lock;
+pthread_cond_t ready_sessions_cond;
 bool shutting_down = false;
 bool shutdown_called = false;
-pthread_mutex_t next_session_id_lock;
+pthread_mutex_t next_session_slot_lock;
 pthread_mutex_t shutting_down_lock;
 
 int main(int argc, char **argv) {
-    if (argc < 2) {
+    /* The volume geometry can be chosen with command line options, the
+     * defaults being the ones in config.h */
+    tfs_geometry_t geometry = {
+        .block_size = DEFAULT_BLOCK_SIZE,
+        .data_blocks = DEFAULT_DATA_BLOCKS,
+        .inode_table_size = DEFAULT_INODE_TABLE_SIZE,
+        .max_open_files = DEFAULT_MAX_OPEN_FILES,
+        .huge_pages = false,
+        .image_path = NULL,
+        .lock_spins = DEFAULT_LOCK_SPINS,
+    };
+    int option;
+    while ((option = getopt(argc, argv, "b:n:i:f:Hm:s:")) != -1) {
+        switch (option) {
+            case 'b':
+                geometry.block_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                geometry.data_blocks = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                geometry.inode_table_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                geometry.max_open_files = strtoul(optarg, NULL, 10);
+                break;
+            case 'H':
+                geometry.huge_pages = true;
+                break;
+            case 'm':
+                geometry.image_path = optarg;
+                break;
+            case 's':
+                geometry.lock_spins = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-b block_size] [-n data_blocks] "
+                                "[-i inodes] [-f open_files] [-H] [-m image] "
+                                "[-s lock_spins] pipename\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
         fprintf(stderr, "Please specify the pathname of the server's pipe.\n");
         return 1;
     }
 
-    tfs_init();
+    if (tfs_init_with_geometry(&geometry) == -1) {
+        fprintf(stderr, "[ERR]: failed to initialize the file system\n");
+        return 1;
+    }
 		signal(SIGPIPE, SIG_IGN);
 
-    char *pipename = argv[1];
+    char *pipename = argv[optind];
     printf("[INFO]: Starting TecnicoFS server with pipe called %s\n", pipename);
 
     // unlink pipe
@@ -59,10 +131,8 @@ int main(int argc, char **argv) {
     char op_code;
     char temp_buffer[MAX_REQUEST_SIZE];
     Session *current_session;
-    bool too_many_clients;
     lock_mutex(&shutting_down_lock);
     do {
-        too_many_clients = false;
         unlock_mutex(&shutting_down_lock);
         ret = read(rx, &op_code, sizeof(char));
         if (!check_pipe_open(ret, rx, pipename)) { // if it had to be reopened
@@ -70,43 +140,49 @@ int main(int argc, char **argv) {
         }
 
         if (op_code == TFS_OP_CODE_MOUNT) {
-            lock_mutex(&next_session_id_lock);
-            session_id = next_session_id++;
-            current_session = &sessions[session_id - 1];
-            lock_mutex(&current_session->session_lock);
-            current_session->session_id = session_id;
-            memcpy(current_session->buffer, &op_code, sizeof(char));
-
-            if (next_session_id > 64) {
-                handle_too_many_clients(current_session);
+            int slot = take_session_slot();
+            if (slot == -1) {
                 // we still need to read the rest of the content sent by the client
                 // even though we are not going to do anything of use to it,
                 // so that there are no conflicts with further clients' requests
                 if (read_buffer(rx, temp_buffer, MOUNT_SIZE_SERVER) == -1) {
-                    write(current_session->tx, &failure_code, sizeof(int));
+                    continue;
                 }
-                unlock_mutex(&current_session->session_lock);
+                handle_too_many_clients(temp_buffer);
                 continue;
             }
+            current_session = &sessions[slot];
+            lock_mutex(&current_session->session_lock);
+            current_session->session_id =
+                (int)(current_session->generation << SESSION_SLOT_BITS) | slot;
+            memcpy(current_session->buffer, &op_code, sizeof(char));
             if (read_buffer(rx, current_session->buffer + 1, MOUNT_SIZE_SERVER) == -1) {
-                write(current_session->tx, &failure_code, sizeof(int));
+                // there's no pipe to answer to, so the slot is simply given back
+                end_session(current_session);
                 unlock_mutex(&current_session->session_lock);
+                release_session_slot(slot);
                 continue;
             }
-            unlock_mutex(&next_session_id_lock);
         } else {
             if (read(rx, &session_id, sizeof(int)) == -1) {
                 fprintf(stderr, "[ERR]: read failed: %s\n", strerror(errno));
                 continue;
             }
-            current_session = &sessions[session_id - 1];
-            lock_mutex(&current_session->session_lock);
-            if (session_id < 1 || session_id > MAX_CLIENTS) {
+            int slot = session_id & SESSION_SLOT_MASK;
+            lock_mutex(&next_session_slot_lock);
+            bool mounted = session_id >= 0 && slot < next_session_slot;
+            unlock_mutex(&next_session_slot_lock);
+            if (!mounted) {
+                // without a valid session there is no client pipe to answer to
                 fprintf(stderr, "[ERR]: invalid session id: %d\n", session_id);
-                write(current_session->tx, &failure_code, sizeof(int));
-                unlock_mutex(&current_session->session_lock);
                 continue;
             }
+            current_session = &sessions[slot];
+            lock_mutex(&current_session->session_lock);
+            // the session's buffer is only reused once a worker is done with it
+            while (current_session->is_active) {
+                pthread_cond_wait(&current_session->session_flag, &current_session->session_lock);
+            }
 
             memcpy(current_session->buffer, &op_code, sizeof(char));
             memcpy(current_session->buffer + 1, &session_id, sizeof(int));
@@ -138,6 +214,12 @@ int main(int argc, char **argv) {
                         unlock_mutex(&current_session->session_lock);
                         continue;
                     }
+                    if (len > MAX_WRITE_CONTENTS) {
+                        // the contents wouldn't fit in the session's buffer
+                        refuse_write(current_session, rx, len);
+                        unlock_mutex(&current_session->session_lock);
+                        continue;
+                    }
                     memcpy(current_session->buffer + 1 + 2 * sizeof(int), &len, sizeof(size_t));
                     if (read_buffer(rx, current_session->buffer + 1 + 2 * sizeof(int) + sizeof(size_t), sizeof(char) * len) == -1) {
                         write(current_session->tx, &failure_code, sizeof(int));
@@ -152,6 +234,40 @@ int main(int argc, char **argv) {
                         continue;
                     }
                     break;
+                case TFS_OP_CODE_PWRITE:
+                    // the header (file handle, length and offset) tells how much content follows
+                    if (read_buffer(rx, current_session->buffer + 1 + sizeof(int), PWRITE_HEADER_SIZE_SERVER) == -1) {
+                        write(current_session->tx, &size_failure_code, sizeof(ssize_t));
+                        unlock_mutex(&current_session->session_lock);
+                        continue;
+                    }
+                    memcpy(&len, current_session->buffer + 1 + 2 * sizeof(int), sizeof(size_t));
+                    if (len > MAX_WRITE_CONTENTS) {
+                        // the contents wouldn't fit in the session's buffer
+                        refuse_write(current_session, rx, len);
+                        unlock_mutex(&current_session->session_lock);
+                        continue;
+                    }
+                    if (read_buffer(rx, current_session->buffer + 1 + 2 * sizeof(int) + 2 * sizeof(size_t), sizeof(char) * len) == -1) {
+                        write(current_session->tx, &size_failure_code, sizeof(ssize_t));
+                        unlock_mutex(&current_session->session_lock);
+                        continue;
+                    }
+                    break;
+                case TFS_OP_CODE_PREAD:
+                    if (read_buffer(rx, current_session->buffer + 1 + sizeof(int), PREAD_SIZE_SERVER) == -1) {
+                        write(current_session->tx, &size_failure_code, sizeof(ssize_t));
+                        unlock_mutex(&current_session->session_lock);
+                        continue;
+                    }
+                    break;
+                case TFS_OP_CODE_MKDIR:
+                    if (read_buffer(rx, current_session->buffer + 1 + sizeof(int), MKDIR_SIZE_SERVER) == -1) {
+                        write(current_session->tx, &failure_code, sizeof(int));
+                        unlock_mutex(&current_session->session_lock);
+                        continue;
+                    }
+                    break;
                 case TFS_OP_CODE_UNMOUNT:
                 case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
                     // cases not required - we have already read the session id
@@ -165,13 +281,17 @@ int main(int argc, char **argv) {
             }
         }
 
-        if (!too_many_clients) {
-            // we only send the request if the session id was valid
-            // otherwise we just ignore the request's content
-            current_session->is_active = true;
-            pthread_cond_signal(&current_session->session_flag);
+        if (op_code != TFS_OP_CODE_MOUNT &&
+            current_session->session_id != session_id) {
+            // the session was unmounted (and its slot may have been mounted
+            // again): the request is dropped, as there's no pipe to answer to
+            fprintf(stderr, "[ERR]: stale session id: %d\n", session_id);
+            unlock_mutex(&current_session->session_lock);
+            continue;
         }
+        current_session->is_active = true;
         unlock_mutex(&current_session->session_lock);
+        dispatch_session(current_session);
         lock_mutex(&shutting_down_lock);
     } while(!shutting_down);
 
@@ -185,40 +305,36 @@ int main(int argc, char **argv) {
  * ----------------------------------------------------------------------------
  */
 
-void case_mount(Session *session) {
-    char client_pipename[BUFFER_SIZE];
-    int tx;
-    memcpy(client_pipename, session->buffer + 1, sizeof(char) * BUFFER_SIZE);
-    tx = open(client_pipename, O_WRONLY);
-    if (tx == -1) {
+int case_mount(Session *session) {
+    memcpy(session->pipename, session->buffer + 1, sizeof(char) * BUFFER_SIZE);
+    session->pipename[BUFFER_SIZE - 1] = '\0';
+    // the client opens its pipe before mounting, so if nobody reads it the
+    // client is gone; the pipe stays non-blocking so that no reply can hold
+    // a worker for longer than REPLY_TIMEOUT_MS (see write_reply)
+    session->tx = open(session->pipename, O_WRONLY | O_NONBLOCK);
+    if (session->tx == -1) {
+        // there's no pipe to answer to
         fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
-        write(session->tx, &failure_code, sizeof(int));
-        exit(EXIT_FAILURE);
+        end_session(session);
+        return -1;
     }
-    if (write(tx, &session->session_id, sizeof(int)) == -1) {
-        fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
-        write(session->tx, &failure_code, sizeof(int));
-        return;
+    if (write_reply(session, &session->session_id, sizeof(int)) == -1) {
+        end_session(session);
+        return -1;
     }
-    session->tx = tx;
-    session->pipename = client_pipename;
+    return 0;
 }
 
 void case_unmount(Session *session) {
     int successful_unmount = 0;
-    if (write(session->tx, &successful_unmount, sizeof(int)) == -1) {
-        fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
-        return;
-    }
-    if (close(session->tx) != 0) {
-        fprintf(stderr, "[ERR]: close failed: %s\n", strerror(errno));
-        return;
-    }
+    // the pipe is unlinked before answering, as the client may mount again
+    // (creating a pipe with the same name) as soon as it is answered
     if (unlink(session->pipename) != 0 && errno != ENOENT) {
         fprintf(stderr, "[ERR]: unlink(%s) failed: %s\n", session->pipename,
                 strerror(errno));
-        return;
     }
+    write_reply(session, &successful_unmount, sizeof(int));
+    end_session(session);
 }
 
 void case_open(Session *session) {
@@ -227,11 +343,14 @@ void case_open(Session *session) {
     memcpy(&flags, session->buffer + 1 + sizeof(int), sizeof(int));
     memcpy(filename, session->buffer + 1 + 2 * sizeof(int), sizeof(char) * BUFFER_SIZE);
     int call_ret = tfs_open(filename, flags);
-    if (write(session->tx, &call_ret, sizeof(int)) == -1) {
-        fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
-        write(session->tx, &failure_code, sizeof(int));
-        return;
-    }
+    write_reply(session, &call_ret, sizeof(int));
+}
+
+void case_mkdir(Session *session) {
+    char dirname[BUFFER_SIZE];
+    memcpy(dirname, session->buffer + 1 + sizeof(int), sizeof(char) * BUFFER_SIZE);
+    int call_ret = tfs_mkdir(dirname);
+    write_reply(session, &call_ret, sizeof(int));
 }
 
 void case_close(Session *session) {
@@ -239,59 +358,89 @@ void case_close(Session *session) {
     int ret;
     memcpy(&fhandle, session->buffer + 1 + sizeof(int), sizeof(int));
     ret = tfs_close(fhandle);
-    if (write(session->tx, &ret, sizeof(int)) == -1) {
-        fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
-        write(session->tx, &failure_code, sizeof(int));
-        return;
-    }
+    write_reply(session, &ret, sizeof(int));
 }
 
 void case_write(Session *session) {
+    int fhandle;
+    size_t len;
+    ssize_t ret;
+    memcpy(&fhandle, session->buffer + 1 + sizeof(int), sizeof(int));
+    memcpy(&len, session->buffer + 1 + 2 * sizeof(int), sizeof(size_t));
+    // the contents are written straight from the session's buffer
+    ret = tfs_write(fhandle, session->buffer + 1 + 2 * sizeof(int) + sizeof(size_t), len);
+    write_reply(session, &ret, sizeof(ssize_t));
+}
+
+void case_read(Session *session) {
     int fhandle;
     size_t len;
     char *buffer;
     ssize_t ret;
     memcpy(&fhandle, session->buffer + 1 + sizeof(int), sizeof(int));
     memcpy(&len, session->buffer + 1 + 2 * sizeof(int), sizeof(size_t));
+    // no read returns more than the largest possible file
+    if (len > MAX_FILE_BLOCKS * BLOCK_SIZE) {
+        len = MAX_FILE_BLOCKS * BLOCK_SIZE;
+    }
     buffer = malloc(sizeof(char) * len);
     if (buffer == NULL) {
         fprintf(stderr, "[ERR]: malloc failed: %s\n", strerror(errno));
-        write(session->tx, &failure_code, sizeof(int));
-        exit(EXIT_FAILURE);
+        write_reply(session, &size_failure_code, sizeof(ssize_t));
+        return;
     }
-    memcpy(buffer, session->buffer + 1 + 2 * sizeof(int) + sizeof(size_t), sizeof(char) * len);
-    ret = tfs_write(fhandle, buffer, len);
-    if (write(session->tx, &ret, sizeof(ssize_t)) == -1) {
-        fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
-        write(session->tx, &failure_code, sizeof(int));
+    ret = tfs_read(fhandle, buffer, len);
+    if (write_reply(session, &ret, sizeof(ssize_t)) == -1) {
+        free(buffer);
+        return;
+    }
+    // the contents only follow if the read succeeded
+    if (ret > 0 && write_reply(session, buffer, (size_t) ret) == -1) {
         free(buffer);
         return;
     }
     free(buffer);
 }
 
-void case_read(Session *session) {
+void case_pwrite(Session *session) {
+    int fhandle;
+    size_t len;
+    size_t offset;
+    ssize_t ret;
+    memcpy(&fhandle, session->buffer + 1 + sizeof(int), sizeof(int));
+    memcpy(&len, session->buffer + 1 + 2 * sizeof(int), sizeof(size_t));
+    memcpy(&offset, session->buffer + 1 + 2 * sizeof(int) + sizeof(size_t), sizeof(size_t));
+    // the contents are written straight from the session's buffer
+    ret = tfs_pwrite(fhandle, session->buffer + 1 + 2 * sizeof(int) + 2 * sizeof(size_t), len, offset);
+    write_reply(session, &ret, sizeof(ssize_t));
+}
+
+void case_pread(Session *session) {
     int fhandle;
     size_t len;
+    size_t offset;
     char *buffer;
     ssize_t ret;
     memcpy(&fhandle, session->buffer + 1 + sizeof(int), sizeof(int));
     memcpy(&len, session->buffer + 1 + 2 * sizeof(int), sizeof(size_t));
+    memcpy(&offset, session->buffer + 1 + 2 * sizeof(int) + sizeof(size_t), sizeof(size_t));
+    // no read returns more than the largest possible file
+    if (len > MAX_FILE_BLOCKS * BLOCK_SIZE) {
+        len = MAX_FILE_BLOCKS * BLOCK_SIZE;
+    }
     buffer = malloc(sizeof(char) * len);
     if (buffer == NULL) {
         fprintf(stderr, "[ERR]: malloc failed: %s\n", strerror(errno));
-        write(session->tx, &failure_code, sizeof(int));
-        exit(EXIT_FAILURE);
+        write_reply(session, &size_failure_code, sizeof(ssize_t));
+        return;
     }
-    ret = tfs_read(fhandle, buffer, len);
-    if (write(session->tx, &ret, sizeof(ssize_t)) == -1) {
-        fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
-        write(session->tx, &failure_code, sizeof(int));
+    ret = tfs_pread(fhandle, buffer, len, offset);
+    if (write_reply(session, &ret, sizeof(ssize_t)) == -1) {
         free(buffer);
         return;
     }
-    if (write_buffer(session->tx, buffer, (size_t) ret) == -1) {
-        write(session->tx, &failure_code, sizeof(int));
+    // the contents only follow if the read succeeded
+    if (ret > 0 && write_reply(session, buffer, (size_t) ret) == -1) {
         free(buffer);
         return;
     }
@@ -302,9 +451,7 @@ void case_shutdown(Session *session) {
     int ret = tfs_destroy_after_all_closed();
     lock_mutex(&shutting_down_lock);
     shutting_down = true;
-    if (write(session->tx, &ret, sizeof(int)) == -1) {
-        fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
-        write(session->tx, &failure_code, sizeof(int));
+    if (write_reply(session, &ret, sizeof(int)) == -1) {
         exit(EXIT_FAILURE);
     }
     unlock_mutex(&shutting_down_lock);
@@ -320,54 +467,151 @@ void case_shutdown(Session *session) {
  */
 
 void start_sessions() {
-    init_mutex(&next_session_id_lock);
+    init_mutex(&next_session_slot_lock);
     init_mutex(&shutting_down_lock);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        sessions[i].session_id = i + 1;
-        sessions[i].is_active = false;
-        init_mutex(&sessions[i].session_lock);
-        if (pthread_cond_init(&sessions[i].session_flag, NULL) != 0) {
-            fprintf(stderr, "[ERR]: cond init failed: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-        if (pthread_create(&sessions[i].session_t, NULL, thread_handler, (void *) &sessions[i]) != 0) {
+    init_mutex(&ready_sessions_lock);
+    if (pthread_cond_init(&ready_sessions_cond, NULL) != 0) {
+        fprintf(stderr, "[ERR]: cond init failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // one worker per core: more of them would only wait for a core
+    long worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (worker_count < 1) {
+        worker_count = 1;
+    }
+    for (long i = 0; i < worker_count; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, thread_handler, NULL) != 0 ||
+            pthread_detach(worker) != 0) {
             fprintf(stderr, "[ERR]: thread create failed: %s\n", strerror(errno));
             exit(EXIT_FAILURE);
         }
     }
 }
 
+void init_session(Session *session) {
+    session->session_id = -1;
+    session->generation = 0;
+    session->is_active = false;
+    session->tx = -1;
+    session->next_ready = NULL;
+    init_mutex(&session->session_lock);
+    if (pthread_cond_init(&session->session_flag, NULL) != 0) {
+        fprintf(stderr, "[ERR]: cond init failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+int take_session_slot() {
+    uint64_t head = atomic_load(&free_sessions);
+    while ((uint32_t) head != 0) {
+        int slot = (int) (uint32_t) head - 1;
+        uint64_t next = ((head >> 32) + 1) << 32 |
+                        (uint32_t) (atomic_load(&sessions[slot].next_free) + 1);
+        if (atomic_compare_exchange_weak(&free_sessions, &head, next)) {
+            return slot;
+        }
+    }
+
+    // no slot was unmounted: a new one is initialized
+    lock_mutex(&next_session_slot_lock);
+    int slot = -1;
+    if (next_session_slot < MAX_CLIENTS) {
+        slot = next_session_slot;
+        init_session(&sessions[slot]);
+        next_session_slot++;
+    }
+    unlock_mutex(&next_session_slot_lock);
+    return slot;
+}
+
+void release_session_slot(int slot) {
+    uint64_t head = atomic_load(&free_sessions);
+    uint64_t next;
+    do {
+        atomic_store(&sessions[slot].next_free, (int) (uint32_t) head - 1);
+        next = ((head >> 32) + 1) << 32 | (uint32_t) (slot + 1);
+    } while (!atomic_compare_exchange_weak(&free_sessions, &head, next));
+}
+
+void end_session(Session *session) {
+    if (session->tx != -1 && close(session->tx) != 0) {
+        fprintf(stderr, "[ERR]: close failed: %s\n", strerror(errno));
+    }
+    // every id of the session is stale from now on
+    session->tx = -1;
+    session->session_id = -1;
+    session->generation = (session->generation + 1) & SESSION_GENERATION_MASK;
+    memset(session->pipename, '\0', BUFFER_SIZE);
+}
+
+void dispatch_session(Session *session) {
+    lock_mutex(&ready_sessions_lock);
+    session->next_ready = NULL;
+    if (ready_sessions_tail == NULL) {
+        ready_sessions_head = session;
+    } else {
+        ready_sessions_tail->next_ready = session;
+    }
+    ready_sessions_tail = session;
+    pthread_cond_signal(&ready_sessions_cond);
+    unlock_mutex(&ready_sessions_lock);
+}
+
 /*
  * ----------------------------------------------------------------------------
- * Below is the thread handler function.
+ * Below are the thread handler functions.
  * ----------------------------------------------------------------------------
  */
 
 void *thread_handler(void *arg) {
-    Session *session = (Session *) arg;
+    (void) arg;
     char op_code;
     while (true) {
-        lock_mutex(&session->session_lock);
-        while (!session->is_active) {
-            pthread_cond_wait(&session->session_flag, &session->session_lock);
+        lock_mutex(&ready_sessions_lock);
+        while (ready_sessions_head == NULL) {
+            pthread_cond_wait(&ready_sessions_cond, &ready_sessions_lock);
         }
+        Session *session = ready_sessions_head;
+        ready_sessions_head = session->next_ready;
+        if (ready_sessions_head == NULL) {
+            ready_sessions_tail = NULL;
+        }
+        unlock_mutex(&ready_sessions_lock);
+
+        lock_mutex(&session->session_lock);
         lock_mutex(&shutting_down_lock);
-        session->is_active = true;
         memcpy(&op_code, session->buffer, sizeof(char));
         if (shutdown_called && op_code == TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED) {
             // not continuing if already shutting down
-            write(session->tx, &failure_code, sizeof(int));
+            write_reply(session, &failure_code, sizeof(int));
             unlock_mutex(&shutting_down_lock);
-            unlock_mutex(&session->session_lock);
-            break;
+            finish_request(session);
+            continue;
         }
         if (op_code == TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED) {
             shutdown_called = true;
+            unlock_mutex(&shutting_down_lock);
+            unlock_mutex(&session->session_lock);
+            // the shutdown waits for every file to be closed, which other
+            // sessions' requests must still be served to do, so it doesn't
+            // hold a worker (the session stays active until the server exits)
+            pthread_t shutdown_thread;
+            if (pthread_create(&shutdown_thread, NULL, shutdown_handler, session) != 0 ||
+                pthread_detach(shutdown_thread) != 0) {
+                fprintf(stderr, "[ERR]: thread create failed: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            continue;
         }
         unlock_mutex(&shutting_down_lock);
+        // whether the session was torn down, and its slot can be mounted again
+        bool ended = false;
+        errno = 0;
         switch (op_code) {
             case TFS_OP_CODE_MOUNT:
-                case_mount(session);
+                ended = case_mount(session) == -1;
                 break;
             case TFS_OP_CODE_UNMOUNT:
                 case_unmount(session);
@@ -375,6 +619,9 @@ void *thread_handler(void *arg) {
             case TFS_OP_CODE_OPEN:
                 case_open(session);
                 break;
+            case TFS_OP_CODE_MKDIR:
+                case_mkdir(session);
+                break;
             case TFS_OP_CODE_CLOSE:
                 case_close(session);
                 break;
@@ -384,18 +631,44 @@ void *thread_handler(void *arg) {
             case TFS_OP_CODE_READ:
                 case_read(session);
                 break;
-            case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
-                case_shutdown(session);
+            case TFS_OP_CODE_PWRITE:
+                case_pwrite(session);
+                break;
+            case TFS_OP_CODE_PREAD:
+                case_pread(session);
                 break;
             default: break; // never gets here, already treated in main
         }
-        session->is_active = false;
-        strcpy(session->buffer, ""); // clearing the buffer after each request
-        unlock_mutex(&session->session_lock);
+        if (op_code == TFS_OP_CODE_UNMOUNT) {
+            ended = true;
+        } else if (!ended && errno == EPIPE) {
+            // the client closed its pipe without unmounting: it's gone for
+            // good, so its session is torn down as if it had unmounted
+            fprintf(stderr, "[ERR]: client of session %d is gone\n", session->session_id);
+            end_session(session);
+            ended = true;
+        }
+        finish_request(session);
+        // the slot can only be mounted again once the worker is done with it
+        if (ended) {
+            release_session_slot((int) (session - sessions));
+        }
     }
     return NULL;
 }
 
+void *shutdown_handler(void *arg) {
+    case_shutdown((Session *) arg);
+    return NULL;
+}
+
+void finish_request(Session *session) {
+    session->is_active = false;
+    strcpy(session->buffer, ""); // clearing the buffer after each request
+    pthread_cond_signal(&session->session_flag);
+    unlock_mutex(&session->session_lock);
+}
+
 /*
  * ----------------------------------------------------------------------------
  * Below are general-use helper functions used in main.
@@ -424,19 +697,65 @@ bool check_pipe_open(ssize_t ret, int rx, char *pipename) {
     return true;
 }
 
-void handle_too_many_clients(Session *session) {
+int write_reply(Session *session, void const *reply, size_t len) {
+    char const *bytes = reply;
+    size_t written = 0;
+    while (written < len) {
+        ssize_t ret = write(session->tx, bytes + written, len - written);
+        if (ret != -1) {
+            written += (size_t) ret;
+            continue;
+        }
+        if (errno != EAGAIN && errno != EINTR) {
+            fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
+            return -1;
+        }
+        // the client's pipe is full: the client has a while to read from it
+        struct pollfd pipe_fd = {.fd = session->tx, .events = POLLOUT};
+        int ready = poll(&pipe_fd, 1, REPLY_TIMEOUT_MS);
+        if (ready == 0) {
+            // a client that doesn't read its replies is taken as gone
+            fprintf(stderr, "[ERR]: client of session %d stopped reading\n",
+                    session->session_id);
+            errno = EPIPE;
+            return -1;
+        }
+        if (ready == -1 && errno != EINTR) {
+            fprintf(stderr, "[ERR]: poll failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void refuse_write(Session *session, int rx, size_t len) {
+    fprintf(stderr, "[ERR]: write request of %zu bytes refused\n", len);
+    char contents[MAX_REQUEST_SIZE];
+    while (len > 0) {
+        size_t to_read = len < sizeof(contents) ? len : sizeof(contents);
+        if (read_buffer(rx, contents, to_read) == -1) {
+            break;
+        }
+        len -= to_read;
+    }
+    if (write(session->tx, &size_failure_code, sizeof(ssize_t)) == -1) {
+        fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
+    }
+}
+
+void handle_too_many_clients(char const *request) {
     fprintf(stderr, "[ERR]: Too many clients connected. Try again shortly.\n");
-    unlock_mutex(&next_session_id_lock);
     char pipename[BUFFER_SIZE];
-    memcpy(pipename, session->buffer + 1, BUFFER_SIZE);
+    memcpy(pipename, request, BUFFER_SIZE);
+    pipename[BUFFER_SIZE - 1] = '\0';
     int rx;
-    if ((rx = open(pipename, 0640)) == -1) {
+    // the receptor thread mustn't wait for a client that isn't reading
+    if ((rx = open(pipename, O_WRONLY | O_NONBLOCK)) == -1) {
         fprintf(stderr, "[ERR]: open failed %s\n", strerror(errno));
         return;
     }
     if (write(rx, &failure_code, sizeof(int)) == -1) {
         fprintf(stderr, "[ERR]: write failed %s\n", strerror(errno));
-        return;
     }
     close(rx);
 }
@@ -5,31 +5,50 @@
 #include "state.h"
 #include "config.h"
 #include <sys/types.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 
 /*
  * Structure responsible for holding a given session's information.
+ * Sessions aren't bound to threads: the receptor thread reads a session's
+ * request into its buffer and queues the session, and whichever worker is
+ * free serves it. A session is active from the moment its request is read
+ * until a worker is done with it, and session_flag is signalled then.
+ * The fields used to hand a request over to a worker come first, and each
+ * session starts a cache line of its own, so handing requests to
+ * neighbouring sessions doesn't make their workers share lines.
   */
 typedef struct Session{
-    int session_id;
-    bool is_active;
-    pthread_mutex_t session_lock;
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t session_lock;
     pthread_cond_t session_flag;
-    pthread_t session_t;
-    char buffer[MAX_REQUEST_SIZE];
+    bool is_active;
+    int session_id; // -1 while the session isn't mounted
+    unsigned int generation; // of the session's slot (see take_session_slot)
     int tx;
-    char *pipename;
+    struct Session *next_ready; // next session waiting for a worker
+    atomic_int next_free; // next unmounted slot (see take_session_slot)
+    char pipename[BUFFER_SIZE];
+    char buffer[MAX_REQUEST_SIZE];
 } Session;
 
 #define MOUNT_SIZE_SERVER (BUFFER_SIZE * sizeof(char))
 #define OPEN_SIZE_SERVER (sizeof(int) + BUFFER_SIZE * sizeof(char))
 #define CLOSE_SIZE_SERVER (sizeof(int))
 #define READ_SIZE_SERVER (sizeof(int) + sizeof(size_t))
+#define MKDIR_SIZE_SERVER (BUFFER_SIZE * sizeof(char))
+#define PWRITE_HEADER_SIZE_SERVER (sizeof(int) + 2 * sizeof(size_t))
+#define PREAD_SIZE_SERVER (sizeof(int) + 2 * sizeof(size_t))
+
+/* Longest time, in milliseconds, that a worker waits for a client to make
+ * room in its pipe for a reply (see write_reply) */
+#define REPLY_TIMEOUT_MS (2000)
 
 /*
  * Performs the bridge between server and client in the tfs_mount operation
+ * Returns 0 if successful, or -1 if the client couldn't be answered (in
+ * which case the session was torn down, see end_session)
  */
-void case_mount(Session *session);
+int case_mount(Session *session);
 
 /*
  * Performs the bridge between server and client in the tfs_unmount operation
@@ -41,6 +60,11 @@ void case_unmount(Session *session);
  */
 void case_open(Session *session);
 
+/*
+ * Performs the bridge between server and client in the tfs_mkdir operation
+ */
+void case_mkdir(Session *session);
+
 /*
  * Performs the bridge between server and client in the tfs_close operation
  */
@@ -56,23 +80,76 @@ void case_write(Session *session);
  */
 void case_read(Session *session);
 
+/*
+ * Performs the bridge between server and client in the tfs_pwrite operation
+ */
+void case_pwrite(Session *session);
+
+/*
+ * Performs the bridge between server and client in the tfs_pread operation
+ */
+void case_pread(Session *session);
+
 /*
  * Performs the bridge between server and client in the tfs_shutdown operation
  */
 void case_shutdown(Session *session);
 
 /*
- * Starts all the available sessions in the server, initializing:
- * - each session's lock
- * - each session's cond_var
+ * Starts the server's sessions: initializes the locks that hand sessions
+ * over to workers and starts the worker pool (one worker per core). The
+ * sessions themselves are only initialized when they are mounted, so the
+ * ones that are never used don't take up memory.
  */
 void start_sessions();
 
 /*
- * Handles the requests from the receptor thread to a worker thread
+ * Initializes a session slot the first time it is mounted, initializing:
+ * - the session's lock
+ * - the session's cond_var
+ */
+void init_session(Session *session);
+
+/*
+ * Takes a session slot for a client that is mounting: one that was
+ * unmounted if there is any, otherwise one that was never used.
+ * Returns the slot's index, or -1 if every slot is mounted.
+ */
+int take_session_slot();
+
+/*
+ * Returns the slot of an unmounted session, so it can be mounted again
+ * (only once no worker uses it anymore)
+ */
+void release_session_slot(int slot);
+
+/*
+ * Tears down a session that is unmounting: closes its pipe to the client and
+ * resets it, making every id it was given stale
+ */
+void end_session(Session *session);
+
+/*
+ * Queues a session whose request was read, for the next free worker
+ */
+void dispatch_session(Session *session);
+
+/*
+ * Worker thread: serves the requests of the queued sessions, in order
  */
 void *thread_handler(void *arg);
 
+/*
+ * Runs a shutdown request on a thread of its own (see thread_handler)
+ */
+void *shutdown_handler(void *arg);
+
+/*
+ * Marks a session's request as served, letting the receptor thread read the
+ * session's next one, and unlocks the session
+ */
+void finish_request(Session *session);
+
 /*
  * Helper function for reading from pipe in main.
  * Checks if it was able to read correctly from the pipe.
@@ -80,10 +157,29 @@ void *thread_handler(void *arg);
  */
 bool check_pipe_open(ssize_t ret, int rx, char *pipename);
 
+/*
+ * Writes a reply of 'len' bytes to a session's client. The client's pipe
+ * doesn't block (see case_mount), so a client that stops reading can't hold
+ * a worker: if there's no room in the pipe for REPLY_TIMEOUT_MS, the client
+ * is taken as gone.
+ * Returns 0 if successful, or -1 (with errno set to EPIPE if the client is
+ * gone, in which case the worker tears the session down)
+ */
+int write_reply(Session *session, void const *reply, size_t len);
+
+/*
+ * Helper function for refusing a write (or pwrite) request whose contents
+ * (of 'len' bytes) don't fit in a session's buffer: the contents are read
+ * and dropped, so the next request is read from its start, and the client
+ * is answered -1
+ */
+void refuse_write(Session *session, int rx, size_t len);
+
 /*
  * Helper function for handling the case where it's not possible for another
- * client to connect to the server.
+ * client to connect to the server (given the client's mount request, which
+ * starts with its pipe's name).
  */
-void handle_too_many_clients(Session *session);
+void handle_too_many_clients(char const *request);
 
 #endif
\ No newline at end of file
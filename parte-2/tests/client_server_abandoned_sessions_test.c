@@ -0,0 +1,72 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  Leaves more sessions behind than the server has, in two ways: mount
+    requests naming a pipe that doesn't exist (so the server can't answer
+    them), and clients that close their pipe without unmounting and then
+    send a request (so the server's answer finds no reader). Every one of
+    them must give its slot back, so a client can still mount afterwards. */
+
+#define ABANDON_COUNT (MAX_CLIENTS + 100)
+#define MOUNT_ATTEMPTS (100)
+
+extern Client client;
+
+/* Mounts, retrying for a while: the slots of the sessions left behind are
+ * only given back once the server has tried to answer them */
+static void mount(char const *client_pipe, char const *server_pipe) {
+    for (int attempt = 0; attempt < MOUNT_ATTEMPTS; attempt++) {
+        if (tfs_mount(client_pipe, server_pipe) == 0) {
+            return;
+        }
+        close(client.rx);
+        close(client.tx);
+        nanosleep(&(struct timespec){.tv_nsec = 10000000}, NULL);
+    }
+    assert(false);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    /* Mount requests that can't be answered */
+    int tx = open(argv[2], O_WRONLY);
+    assert(tx != -1);
+    char request[MOUNT_SIZE_API];
+    memset(request, '\0', sizeof(request));
+    request[0] = TFS_OP_CODE_MOUNT;
+    strcpy(request + 1, "/tmp/tfs_no_such_pipe");
+    for (int i = 0; i < ABANDON_COUNT; i++) {
+        assert(write_buffer(tx, request, sizeof(request)) == 0);
+    }
+    close(tx);
+
+    /* Clients that go away without unmounting */
+    for (int i = 0; i < ABANDON_COUNT; i++) {
+        mount(argv[1], argv[2]);
+        assert(close(client.rx) == 0);
+        assert(unlink(argv[1]) == 0);
+        assert(tfs_open("/f1", 0) == -1);
+        assert(close(client.tx) == 0);
+    }
+
+    mount(argv[1], argv[2]);
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
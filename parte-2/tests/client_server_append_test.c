@@ -0,0 +1,113 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*  Several clients open the same log with TFS_O_APPEND (all of them before
+    any writes to it, so their handles start at the same offset), and then
+    append records to it at the same time, each through its own session.
+    Checks that every write went to the end of the log: it holds every
+    record of every client, whole and in each client's order. */
+
+#define CLIENT_COUNT 8
+#define RECORDS_PER_CLIENT 200
+#define RECORD_SIZE 16
+#define CLIENT_PIPE_NAME_FORMAT "/tmp/tfs_a%d"
+
+void run_test(char *server_pipe, int client_id, int opened, int start);
+
+static char *path = "/log";
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    /* Each client writes a byte to 'opened' once it has opened the log, and
+     * waits for 'start' to be closed before appending to it */
+    int opened[2], start[2];
+    assert(pipe(opened) == 0);
+    assert(pipe(start) == 0);
+
+    int child_pids[CLIENT_COUNT];
+    for (int i = 0; i < CLIENT_COUNT; ++i) {
+        int pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            close(opened[0]);
+            close(start[1]);
+            run_test(argv[1], i, opened[1], start[0]);
+            exit(0);
+        } else {
+            child_pids[i] = pid;
+        }
+    }
+    close(opened[1]);
+    close(start[0]);
+
+    for (int i = 0; i < CLIENT_COUNT; ++i) {
+        char byte;
+        assert(read(opened[0], &byte, 1) == 1);
+    }
+    close(start[1]);
+
+    for (int i = 0; i < CLIENT_COUNT; ++i) {
+        int result;
+        waitpid(child_pids[i], &result, 0);
+        assert(WIFEXITED(result) && WEXITSTATUS(result) == 0);
+    }
+
+    /* Reads the log back, one record at a time */
+    char client_pipe[40];
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, CLIENT_COUNT);
+    assert(tfs_mount(client_pipe, argv[1]) == 0);
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+
+    int next[CLIENT_COUNT] = {0};
+    for (int i = 0; i < CLIENT_COUNT * RECORDS_PER_CLIENT; i++) {
+        char record[RECORD_SIZE + 1] = {0};
+        int client_id, record_id;
+        assert(tfs_read(f, record, RECORD_SIZE) == RECORD_SIZE);
+        assert(sscanf(record, "%d %d", &client_id, &record_id) == 2);
+        assert(client_id >= 0 && client_id < CLIENT_COUNT);
+        assert(record_id == next[client_id]);
+        next[client_id]++;
+    }
+    char byte;
+    assert(tfs_pread(f, &byte, 1,
+                     CLIENT_COUNT * RECORDS_PER_CLIENT * RECORD_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void run_test(char *server_pipe, int client_id, int opened, int start) {
+    char byte = 0;
+
+    char client_pipe[40];
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, client_id);
+    assert(tfs_mount(client_pipe, server_pipe) == 0);
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_APPEND);
+    assert(f != -1);
+
+    assert(write(opened, &byte, 1) == 1);
+    assert(read(start, &byte, 1) == 0);
+
+    for (int i = 0; i < RECORDS_PER_CLIENT; i++) {
+        char record[RECORD_SIZE + 1];
+        snprintf(record, sizeof(record), "%-7d %-7d", client_id, i);
+        assert(tfs_write(f, record, RECORD_SIZE) == RECORD_SIZE);
+    }
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_unmount() == 0);
+}
@@ -0,0 +1,74 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*  Writes a file with a single tfs_write of more than MAX_REQUEST_SIZE bytes
+    and reads it back, through the client-server architecture. Then sends a
+    write request whose contents don't fit in the server's buffer by hand,
+    checking that it is refused and that the next request is still served.
+    Finally, reads the whole file with a single tfs_read (whose reply is
+    larger than a pipe's atomic writes), then past its end, and then with a
+    huge length through a closed handle, which fails without a reply's
+    contents. */
+
+#define FILE_SIZE (3 * MAX_REQUEST_SIZE + 100)
+
+extern Client client;
+
+int main(int argc, char **argv) {
+    char *path = "/large";
+    static char input[FILE_SIZE];
+    static char output[FILE_SIZE];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    for (int i = 0; i < FILE_SIZE; i++) {
+        input[i] = (char)('A' + i % 26);
+    }
+
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, input, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_pread(f, output, FILE_SIZE, 0) == FILE_SIZE);
+    assert(memcmp(input, output, FILE_SIZE) == 0);
+
+    /* A write request carrying the whole file at once */
+    char op_code = TFS_OP_CODE_WRITE;
+    size_t len = FILE_SIZE;
+    assert(write(client.tx, &op_code, sizeof(char)) == sizeof(char));
+    assert(write(client.tx, &client.session_id, sizeof(int)) == sizeof(int));
+    assert(write(client.tx, &f, sizeof(int)) == sizeof(int));
+    assert(write(client.tx, &len, sizeof(size_t)) == sizeof(size_t));
+    assert(write_buffer(client.tx, input, FILE_SIZE) == 0);
+    ssize_t ret;
+    assert(read(client.rx, &ret, sizeof(ssize_t)) == sizeof(ssize_t));
+    assert(ret == -1);
+
+    assert(tfs_pread(f, output, FILE_SIZE, 0) == FILE_SIZE);
+    assert(memcmp(input, output, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    memset(output, 0, FILE_SIZE);
+    assert(tfs_read(f, output, FILE_SIZE) == FILE_SIZE);
+    assert(memcmp(input, output, FILE_SIZE) == 0);
+    assert(tfs_read(f, output, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_read(f, output, SIZE_MAX) == -1);
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
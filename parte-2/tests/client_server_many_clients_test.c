@@ -0,0 +1,87 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*  Mounts more clients at once than the server has workers (and more than
+    the 64 sessions it used to have), and checks that every one of them is
+    served. Every client stays mounted until all of them are, and then each
+    one writes and reads back a file.
+    The server must allow CLIENT_COUNT open files (e.g. run it with -f 256). */
+
+#define CLIENT_COUNT 200
+#define CLIENT_PIPE_NAME_FORMAT "/tmp/tfs_m%d"
+
+void run_test(char *server_pipe, int client_id, int mounted, int start);
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    /* Each client writes a byte to 'mounted' once it is mounted, and waits
+     * for 'start' to be closed before going on */
+    int mounted[2], start[2];
+    assert(pipe(mounted) == 0);
+    assert(pipe(start) == 0);
+
+    int child_pids[CLIENT_COUNT];
+    for (int i = 0; i < CLIENT_COUNT; ++i) {
+        int pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            close(mounted[0]);
+            close(start[1]);
+            run_test(argv[1], i, mounted[1], start[0]);
+            exit(0);
+        } else {
+            child_pids[i] = pid;
+        }
+    }
+    close(mounted[1]);
+    close(start[0]);
+
+    for (int i = 0; i < CLIENT_COUNT; ++i) {
+        char byte;
+        assert(read(mounted[0], &byte, 1) == 1);
+    }
+    close(start[1]);
+
+    for (int i = 0; i < CLIENT_COUNT; ++i) {
+        int result;
+        waitpid(child_pids[i], &result, 0);
+        assert(WIFEXITED(result) && WEXITSTATUS(result) == 0);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void run_test(char *server_pipe, int client_id, int mounted, int start) {
+    char *str = "AAA!";
+    char *path = "/f1";
+    char buffer[40];
+    char byte = 0;
+
+    char client_pipe[40];
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, client_id);
+    assert(tfs_mount(client_pipe, server_pipe) == 0);
+
+    assert(write(mounted, &byte, 1) == 1);
+    assert(read(start, &byte, 1) == 0);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_pwrite(f, str, strlen(str), 0) == strlen(str));
+    assert(tfs_pread(f, buffer, sizeof(buffer) - 1, 0) == strlen(str));
+    assert(memcmp(buffer, str, strlen(str)) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_unmount() == 0);
+}
@@ -0,0 +1,72 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define GRN "\x1B[32m"
+#define RESET "\x1B[0m"
+
+/*  Writes a file out of order with tfs_pwrite and reads parts of it back with
+    tfs_pread, through the client-server architecture, checking that the
+    handle's offset isn't moved by either. Then writes a second file with a
+    tfs_pwrite of more than MAX_REQUEST_SIZE bytes, and reads it back with a
+    tfs_pread of a length far larger than any file. */
+
+#define LARGE_SIZE (3 * MAX_REQUEST_SIZE + 100)
+#define LARGE_OFFSET (100)
+
+int main(int argc, char **argv) {
+
+    char *path = "/f1";
+    char buffer[40];
+    static char input[LARGE_SIZE];
+    static char output[LARGE_OFFSET + LARGE_SIZE];
+
+    int f;
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+
+    f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+
+    assert(tfs_pwrite(f, "world!", 6, 6) == 6);
+    assert(tfs_pwrite(f, "hello ", 6, 0) == 6);
+
+    assert(tfs_pread(f, buffer, 5, 6) == 5);
+    assert(memcmp(buffer, "world", 5) == 0);
+    assert(tfs_pread(f, buffer, sizeof(buffer), 20) == 0);
+
+    assert(tfs_read(f, buffer, sizeof(buffer) - 1) == 12);
+    buffer[12] = '\0';
+    assert(strcmp(buffer, "hello world!") == 0);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_pread(f, buffer, 5, 0) == -1);
+
+    for (int i = 0; i < LARGE_SIZE; i++) {
+        input[i] = (char)('A' + i % 26);
+    }
+    f = tfs_open("/f2", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_pwrite(f, input, LARGE_SIZE, LARGE_OFFSET) == LARGE_SIZE);
+    assert(tfs_pread(f, output, SIZE_MAX / 2, 0) ==
+           LARGE_OFFSET + LARGE_SIZE);
+    for (int i = 0; i < LARGE_OFFSET; i++) {
+        assert(output[i] == 0);
+    }
+    assert(memcmp(output + LARGE_OFFSET, input, LARGE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_shutdown_after_all_closed() == 0);
+
+    printf(GRN "Successful test.\n" RESET);
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Mounts and unmounts a client more times than the server has sessions,
+    checking that unmounted sessions are given to the next clients, and that
+    a session that is mounted again gets a new id (so requests with the old
+    one can't reach it). */
+
+#define MOUNT_COUNT (MAX_CLIENTS + 100)
+
+extern Client client;
+
+int main(int argc, char **argv) {
+    char *str = "AAA!";
+    char *path = "/f1";
+    char buffer[40];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    int previous_id = -1;
+    for (int i = 0; i < MOUNT_COUNT; i++) {
+        assert(tfs_mount(argv[1], argv[2]) == 0);
+        assert(client.session_id != previous_id);
+        previous_id = client.session_id;
+
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_pwrite(f, str, strlen(str), 0) == strlen(str));
+        assert(tfs_pread(f, buffer, sizeof(buffer), 0) == strlen(str));
+        assert(memcmp(buffer, str, strlen(str)) == 0);
+        assert(tfs_close(f) != -1);
+
+        assert(tfs_unmount() == 0);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*  Several clients each ask the server to read back a file larger than a
+    pipe holds, and then stop reading their pipe, which leaves a worker
+    waiting to reply to each of them (more of them than the server has
+    workers on a small machine). Checks that the server is still serving
+    another client: the stuck ones are given up on in a bounded time. */
+
+#define STUCK_COUNT 4
+#define FILE_BLOCKS 128
+#define BLOCK_LEN MAX_WRITE_CONTENTS
+#define CLIENT_PIPE_NAME_FORMAT "/tmp/tfs_k%d"
+
+extern Client client;
+
+void run_stuck_client(char *server_pipe, int client_id, int ready, int release);
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    /* Each stuck client writes a byte to 'ready' once its read request was
+     * sent, and waits for 'release' to be closed before exiting */
+    int ready[2], release[2];
+    assert(pipe(ready) == 0);
+    assert(pipe(release) == 0);
+
+    int child_pids[STUCK_COUNT];
+    for (int i = 0; i < STUCK_COUNT; ++i) {
+        int pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            close(ready[0]);
+            close(release[1]);
+            run_stuck_client(argv[1], i, ready[1], release[0]);
+            exit(0);
+        } else {
+            child_pids[i] = pid;
+        }
+    }
+    close(ready[1]);
+    close(release[0]);
+
+    for (int i = 0; i < STUCK_COUNT; ++i) {
+        char byte;
+        assert(read(ready[0], &byte, 1) == 1);
+    }
+
+    /* The stuck clients are still around, but this one is served */
+    char input[] = "still served";
+    char output[sizeof(input)];
+    char client_pipe[40];
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, STUCK_COUNT);
+    assert(tfs_mount(client_pipe, argv[1]) == 0);
+    int f = tfs_open("/served", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, input, sizeof(input)) == sizeof(input));
+    assert(tfs_pread(f, output, sizeof(output), 0) == sizeof(output));
+    assert(memcmp(input, output, sizeof(input)) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() == 0);
+
+    close(release[1]);
+    for (int i = 0; i < STUCK_COUNT; ++i) {
+        int result;
+        waitpid(child_pids[i], &result, 0);
+        assert(WIFEXITED(result) && WEXITSTATUS(result) == 0);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void run_stuck_client(char *server_pipe, int client_id, int ready, int release) {
+    char input[BLOCK_LEN];
+    char byte = 0;
+
+    char client_pipe[40];
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, client_id);
+    assert(tfs_mount(client_pipe, server_pipe) == 0);
+
+    char path[40];
+    sprintf(path, "/k%d", client_id);
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    memset(input, 'A' + client_id, BLOCK_LEN);
+    for (int i = 0; i < FILE_BLOCKS; i++) {
+        assert(tfs_write(f, input, BLOCK_LEN) == BLOCK_LEN);
+    }
+
+    /* A read request for the whole file, whose reply is never read */
+    char request[PREAD_SIZE_API];
+    char op_code = TFS_OP_CODE_PREAD;
+    size_t len = FILE_BLOCKS * BLOCK_LEN;
+    size_t offset = 0;
+    memcpy(request, &op_code, sizeof(char));
+    memcpy(request + 1, &client.session_id, sizeof(int));
+    memcpy(request + 1 + sizeof(int), &f, sizeof(int));
+    memcpy(request + 1 + 2 * sizeof(int), &len, sizeof(size_t));
+    memcpy(request + 1 + 2 * sizeof(int) + sizeof(size_t), &offset,
+           sizeof(size_t));
+    assert(write_buffer(client.tx, request, PREAD_SIZE_API) == 0);
+
+    assert(write(ready, &byte, 1) == 1);
+    assert(read(release, &byte, 1) == 0);
+}
@@ -0,0 +1,125 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Throughput benchmark for the server: for 1 up to MAX_CLIENT_COUNT client
+ * processes, each client mounts a session of its own, fills a file of its
+ * own one block per tfs_write call and then reads it back a few times (one
+ * block per tfs_pread call), going through the pipes and the server's
+ * workers for every operation. Clients share no file, so the throughput
+ * should grow with the client count (up to the server's worker count). The
+ * throughput for each client count is printed. */
+
+#define MAX_CLIENT_COUNT 8
+#define BLOCKS_PER_CLIENT 64
+#define READ_PASSES 16
+#define BLOCK_LEN MAX_WRITE_CONTENTS
+#define CLIENT_PIPE_NAME_FORMAT "/tmp/tfs_t%d"
+
+void run_client(char *server_pipe, int client_id, int ready, int start);
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+    struct timespec start_time, end_time;
+
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    printf("%-10s %-10s %s\n", "clients", "ops", "ops/s");
+    for (int client_count = 1; client_count <= MAX_CLIENT_COUNT;
+         client_count *= 2) {
+        /* Each client writes a byte to 'ready' once it is mounted and has
+         * opened its file, and waits for 'start' to be closed before going
+         * on, so that only the operations themselves are timed */
+        int ready[2], start[2];
+        assert(pipe(ready) == 0);
+        assert(pipe(start) == 0);
+
+        /* What was printed so far mustn't be printed again by the clients */
+        fflush(stdout);
+        int child_pids[MAX_CLIENT_COUNT];
+        for (int i = 0; i < client_count; ++i) {
+            int pid = fork();
+            assert(pid >= 0);
+            if (pid == 0) {
+                close(ready[0]);
+                close(start[1]);
+                run_client(argv[1], i, ready[1], start[0]);
+                exit(0);
+            } else {
+                child_pids[i] = pid;
+            }
+        }
+        close(ready[1]);
+        close(start[0]);
+
+        for (int i = 0; i < client_count; ++i) {
+            char byte;
+            assert(read(ready[0], &byte, 1) == 1);
+        }
+        close(ready[0]);
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        close(start[1]);
+
+        for (int i = 0; i < client_count; ++i) {
+            int result;
+            waitpid(child_pids[i], &result, 0);
+            assert(WIFEXITED(result) && WEXITSTATUS(result) == 0);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+        int ops = client_count * BLOCKS_PER_CLIENT * (1 + READ_PASSES);
+        printf("%-10d %-10d %.0f\n", client_count, ops,
+               ops / elapsed_s(&start_time, &end_time));
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void run_client(char *server_pipe, int client_id, int ready, int start) {
+    char input[BLOCK_LEN];
+    char output[BLOCK_LEN];
+    char byte = 0;
+
+    char client_pipe[40];
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, client_id);
+    assert(tfs_mount(client_pipe, server_pipe) == 0);
+
+    /* Every round of clients overwrites the files of the last one */
+    char path[40];
+    sprintf(path, "/c%d", client_id);
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+
+    assert(write(ready, &byte, 1) == 1);
+    assert(read(start, &byte, 1) == 0);
+
+    memset(input, 'A' + client_id, BLOCK_LEN);
+    for (int i = 0; i < BLOCKS_PER_CLIENT; i++) {
+        assert(tfs_write(f, input, BLOCK_LEN) == BLOCK_LEN);
+    }
+    for (int pass = 0; pass < READ_PASSES; pass++) {
+        for (int i = 0; i < BLOCKS_PER_CLIENT; i++) {
+            assert(tfs_pread(f, output, BLOCK_LEN, (size_t)i * BLOCK_LEN) ==
+                   BLOCK_LEN);
+            assert(memcmp(input, output, BLOCK_LEN) == 0);
+        }
+    }
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_unmount() == 0);
+}
@@ -0,0 +1,97 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Directory scaling benchmark: adds NAME_COUNT names to the root directory,
+ * looks each of them up (and as many names that don't exist), lists the
+ * directory and then removes every other name. The average cost of each
+ * operation is printed.
+ * The directory layer is used directly, so the names point to i-nodes that
+ * aren't allocated (i-node allocation isn't what is being measured). */
+
+#define NAME_COUNT (100000)
+#define NAME_MAX_LEN (16)
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 +
+           (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static void name_of(int i, char *name) { sprintf(name, "file%d", i); }
+
+int main() {
+    tfs_geometry_t geometry = {
+        .block_size = DEFAULT_BLOCK_SIZE,
+        .data_blocks = 16384,
+        .inode_table_size = NAME_COUNT + 1,
+        .max_open_files = DEFAULT_MAX_OPEN_FILES,
+        .huge_pages = false,
+    };
+    char name[NAME_MAX_LEN];
+    struct timespec start, end;
+
+    assert(tfs_init_with_geometry(&geometry) != -1);
+    printf("%-10s %-10s %s\n", "operation", "count", "ns/op");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 1; i <= NAME_COUNT; i++) {
+        name_of(i, name);
+        assert(add_dir_entry(ROOT_DIR_INUM, i, name) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%-10s %-10d %.0f\n", "create", NAME_COUNT,
+           elapsed_ns(&start, &end) / NAME_COUNT);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 1; i <= NAME_COUNT; i++) {
+        name_of(i, name);
+        assert(find_in_dir(ROOT_DIR_INUM, name) == i);
+        name_of(-i, name);
+        assert(find_in_dir(ROOT_DIR_INUM, name) == -1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%-10s %-10d %.0f\n", "lookup", 2 * NAME_COUNT,
+           elapsed_ns(&start, &end) / (2 * NAME_COUNT));
+
+    char *listed = calloc(NAME_COUNT + 1, sizeof(char));
+    assert(listed != NULL);
+    size_t position = 0;
+    dir_entry_t entry;
+    int count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (dir_read_entry(ROOT_DIR_INUM, &position, &entry) == 1) {
+        assert(entry.d_inumber > 0 && entry.d_inumber <= NAME_COUNT);
+        assert(!listed[entry.d_inumber]);
+        name_of(entry.d_inumber, name);
+        assert(strcmp(entry.d_name, name) == 0);
+        listed[entry.d_inumber] = 1;
+        count++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(count == NAME_COUNT);
+    printf("%-10s %-10d %.0f\n", "list", count,
+           elapsed_ns(&start, &end) / count);
+    free(listed);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 2; i <= NAME_COUNT; i += 2) {
+        assert(clear_dir_entry(ROOT_DIR_INUM, i) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%-10s %-10d %.0f\n", "remove", NAME_COUNT / 2,
+           elapsed_ns(&start, &end) / (NAME_COUNT / 2));
+
+    for (int i = 1; i <= NAME_COUNT; i++) {
+        name_of(i, name);
+        assert(find_in_dir(ROOT_DIR_INUM, name) == (i % 2 == 1 ? i : -1));
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
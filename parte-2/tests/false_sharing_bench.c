@@ -0,0 +1,125 @@
+/* syscall() isn't part of POSIX */
+#define _DEFAULT_SOURCE
+
+#include "fs/operations.h"
+#include <assert.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* False sharing benchmark for the FS tables: for 1 up to MAX_THREAD_COUNT
+ * threads, each thread overwrites and reads back a small (inline) file of
+ * its own through a handle of its own. The files are created and opened one
+ * after the other, so the threads work on neighbouring i-nodes and open file
+ * slots, and share no data: any cache line they share is false sharing.
+ * The throughput for each thread count is printed, along with the number of
+ * cache misses per operation, counted by the CPU's performance counters
+ * (when the kernel lets the process use them). */
+
+#define MAX_THREAD_COUNT 8
+#define OPS_PER_THREAD 20000
+#define FILE_NAME_MAX_LEN 10
+
+void *overwrite_file(void *arg);
+
+static int handles[MAX_THREAD_COUNT];
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Opens a counter of the cache misses of this process, which also counts
+ * the threads it creates from then on (-1 if it can't be opened) */
+static int cache_misses_open() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int main() {
+    pthread_t tid[MAX_THREAD_COUNT];
+    int table[MAX_THREAD_COUNT];
+    struct timespec start, end;
+
+    printf("%-10s %-10s %-10s %s\n", "threads", "ops", "ops/s", "misses/op");
+    for (int thread_count = 1; thread_count <= MAX_THREAD_COUNT;
+         thread_count *= 2) {
+        assert(tfs_init() != -1);
+        for (int i = 0; i < thread_count; ++i) {
+            char path[FILE_NAME_MAX_LEN] = {"/f"};
+            sprintf(path + 2, "%d", i);
+            handles[i] = tfs_open(path, TFS_O_CREAT);
+            assert(handles[i] != -1);
+        }
+
+        int counter = cache_misses_open();
+        if (counter != -1) {
+            assert(ioctl(counter, PERF_EVENT_IOC_ENABLE, 0) == 0);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < thread_count; ++i) {
+            table[i] = i;
+            if (pthread_create(&tid[i], NULL, overwrite_file, &table[i]) !=
+                0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        for (int i = 0; i < thread_count; ++i) {
+            pthread_join(tid[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        int ops = thread_count * OPS_PER_THREAD * 2;
+        printf("%-10d %-10d %-10.0f ", thread_count, ops,
+               ops / elapsed_s(&start, &end));
+        uint64_t misses;
+        if (counter != -1 &&
+            read(counter, &misses, sizeof(misses)) == sizeof(misses)) {
+            printf("%.2f\n", (double)misses / ops);
+        } else {
+            printf("n/a\n");
+        }
+        if (counter != -1) {
+            close(counter);
+        }
+
+        for (int i = 0; i < thread_count; ++i) {
+            assert(tfs_close(handles[i]) != -1);
+        }
+        assert(tfs_destroy() != -1);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void *overwrite_file(void *arg) {
+    int file_i = *((int *)arg);
+    int f = handles[file_i];
+
+    for (int i = 0; i < OPS_PER_THREAD; i++) {
+        int value = file_i * OPS_PER_THREAD + i;
+        int output;
+        assert(tfs_pwrite(f, &value, sizeof(value), 0) == sizeof(value));
+        assert(tfs_pread(f, &output, sizeof(output), 0) == sizeof(output));
+        assert(output == value);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,100 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*  Creates a volume in an image file, fills it with a directory and a few
+    files (small and large), and maps it again after tfs_destroy(), checking
+    that everything is still there (also when asking for another geometry)
+    and that the volume keeps working. Images written with another layout,
+    and files that aren't images, are refused.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+#define IMAGE_PATH "tfs_image_test.img"
+#define LARGE_SIZE (20 * DEFAULT_BLOCK_SIZE + 123)
+
+static char large[LARGE_SIZE];
+
+static void write_file(char const *path, char const *content, size_t len) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, content, len) == len);
+    assert(tfs_close(f) != -1);
+}
+
+static void check_file(char const *path, char const *content, size_t len) {
+    static char output[LARGE_SIZE + 1];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, output, sizeof(output)) == len);
+    assert(memcmp(output, content, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    tfs_geometry_t geometry = {
+        .block_size = DEFAULT_BLOCK_SIZE,
+        .data_blocks = DEFAULT_DATA_BLOCKS,
+        .inode_table_size = DEFAULT_INODE_TABLE_SIZE,
+        .max_open_files = DEFAULT_MAX_OPEN_FILES,
+        .huge_pages = false,
+        .image_path = IMAGE_PATH,
+    };
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        large[i] = (char)('a' + i % 23);
+    }
+    unlink(IMAGE_PATH);
+
+    assert(tfs_init_with_geometry(&geometry) != -1);
+    assert(tfs_mkdir("/d") != -1);
+    write_file("/small", "small file", 10);
+    write_file("/d/large", large, LARGE_SIZE);
+    assert(tfs_destroy() != -1);
+
+    /* The image's geometry wins over the one asked for */
+    geometry.block_size = 4096;
+    geometry.data_blocks = 16;
+    assert(tfs_init_with_geometry(&geometry) != -1);
+    assert(BLOCK_SIZE == DEFAULT_BLOCK_SIZE);
+    assert(DATA_BLOCKS == DEFAULT_DATA_BLOCKS);
+    check_file("/small", "small file", 10);
+    check_file("/d/large", large, LARGE_SIZE);
+    assert(tfs_lookup("/d") != -1);
+
+    /* New files don't take the blocks or i-nodes of the old ones */
+    write_file("/d/other", large + 1, LARGE_SIZE - 1);
+    check_file("/d/large", large, LARGE_SIZE);
+    check_file("/d/other", large + 1, LARGE_SIZE - 1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init_with_geometry(&geometry) != -1);
+    check_file("/d/other", large + 1, LARGE_SIZE - 1);
+    assert(tfs_destroy() != -1);
+
+    /* Images with another format version (which follows the superblock's
+     * magic number) are refused, e.g. those written before it was kept */
+    FILE *image = fopen(IMAGE_PATH, "r+");
+    assert(image != NULL);
+    uint32_t version = 0;
+    assert(fseek(image, sizeof(uint32_t), SEEK_SET) == 0);
+    assert(fwrite(&version, sizeof(version), 1, image) == 1);
+    assert(fclose(image) == 0);
+    assert(tfs_init_with_geometry(&geometry) == -1);
+
+    /* Files that aren't images are refused */
+    FILE *not_an_image = fopen(IMAGE_PATH, "w");
+    assert(not_an_image != NULL);
+    assert(fputs("not an image", not_an_image) >= 0);
+    assert(fclose(not_an_image) == 0);
+    assert(tfs_init_with_geometry(&geometry) == -1);
+
+    assert(unlink(IMAGE_PATH) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that small files are stored inline, in their i-nodes: on a volume
+    whose data blocks are all taken by the root directory, small files can
+    still be written and read back, but can't grow past MAX_INLINE_DATA.
+    With one more data block, a file that grows past it is moved to the block
+    and keeps its contents.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+#define FILE_COUNT (10)
+
+int main() {
+    char input[MAX_INLINE_DATA + 1];
+    char output[2 * MAX_INLINE_DATA];
+    char path[8];
+    memset(input, 'A', sizeof(input));
+
+    /* The root directory takes two data blocks (its bucket table and its
+     * first bucket) */
+    tfs_geometry_t geometry = {
+        .block_size = DEFAULT_BLOCK_SIZE,
+        .data_blocks = 2,
+        .inode_table_size = DEFAULT_INODE_TABLE_SIZE,
+        .max_open_files = DEFAULT_MAX_OPEN_FILES,
+        .huge_pages = false,
+    };
+    assert(tfs_init_with_geometry(&geometry) != -1);
+
+    for (int i = 0; i < FILE_COUNT; i++) {
+        sprintf(path, "/f%d", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, input, MAX_INLINE_DATA / 2) == MAX_INLINE_DATA / 2);
+        assert(tfs_write(f, input, MAX_INLINE_DATA / 2) == MAX_INLINE_DATA / 2);
+        assert(tfs_write(f, input, 1) == 0);
+        assert(tfs_close(f) != -1);
+
+        f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_read(f, output, sizeof(output)) == MAX_INLINE_DATA);
+        assert(memcmp(input, output, MAX_INLINE_DATA) == 0);
+        assert(tfs_close(f) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    geometry.data_blocks = 3;
+    assert(tfs_init_with_geometry(&geometry) != -1);
+
+    for (int i = 0; i < 2; i++) {
+        int f = tfs_open("/f", TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, "small", 5) == 5);
+        assert(tfs_write(f, input, sizeof(input)) == sizeof(input));
+        assert(tfs_close(f) != -1);
+
+        f = tfs_open("/f", 0);
+        assert(f != -1);
+        assert(tfs_read(f, output, sizeof(output)) == 5 + sizeof(input));
+        assert(memcmp(output, "small", 5) == 0);
+        assert(memcmp(output + 5, input, sizeof(input)) == 0);
+        assert(tfs_close(f) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
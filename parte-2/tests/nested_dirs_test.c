@@ -0,0 +1,69 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Creates a small directory tree, with files of the same name in different
+    directories, and checks that each path reaches the right file.
+    Also checks that paths through missing directories or files fail.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+static void write_file(char const *path, char const *content) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, content, strlen(content)) == strlen(content));
+    assert(tfs_close(f) != -1);
+}
+
+static void check_file(char const *path, char const *content) {
+    char buffer[40];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == strlen(content));
+    assert(memcmp(buffer, content, strlen(content)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    assert(tfs_init() != -1);
+
+    assert(tfs_mkdir("/a") != -1);
+    assert(tfs_mkdir("/a/b") != -1);
+    assert(tfs_mkdir("/c") != -1);
+    assert(tfs_mkdir("/a") == -1);
+    assert(tfs_mkdir("/x/y") == -1);
+
+    write_file("/f", "root");
+    write_file("/a/f", "in a");
+    write_file("/a/b/f", "in a/b");
+    write_file("/c/f", "in c");
+
+    check_file("/f", "root");
+    check_file("/a/f", "in a");
+    check_file("/a/b/f", "in a/b");
+    check_file("/c/f", "in c");
+
+    assert(tfs_lookup("/a/b") != -1);
+    assert(tfs_lookup("/a/b/f") != tfs_lookup("/a/f"));
+    assert(tfs_lookup("/b") == -1);
+    assert(tfs_lookup("/c/b/f") == -1);
+
+    /* Directories can't be opened as files, nor files used as directories */
+    assert(tfs_open("/a", 0) == -1);
+    assert(tfs_open("/a/b", TFS_O_CREAT) == -1);
+    assert(tfs_open("/f/g", TFS_O_CREAT) == -1);
+    assert(tfs_mkdir("/f/g") == -1);
+
+    /* Malformed paths */
+    assert(tfs_open("/a/", TFS_O_CREAT) == -1);
+    assert(tfs_open("/a//f", 0) == -1);
+    assert(tfs_open("a/f", 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that tfs_pwrite/tfs_pread work at arbitrary offsets without moving
+    the file's offset (also when the gap left by writing past the end of a
+    file must read as zeros, both inline and in blocks), that a gap that
+    doesn't fit leaves no blocks behind, and that several threads can read
+    different parts of a file through the same handle.
+*/
+
+#define THREAD_COUNT (8)
+#define CHUNK_SIZE (DEFAULT_BLOCK_SIZE / 2 + 3)
+#define FILE_SIZE (THREAD_COUNT * CHUNK_SIZE)
+#define ROUNDS (50)
+
+static int f;
+static char contents[FILE_SIZE];
+
+void *read_chunk(void *arg);
+
+int main() {
+    char output[FILE_SIZE];
+    char zeros[FILE_SIZE];
+    memset(zeros, 0, sizeof(zeros));
+    for (int i = 0; i < FILE_SIZE; i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    /* A gap in an inline file */
+    int g = tfs_open("/inline", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_write(g, "AB", 2) == 2);
+    assert(tfs_pwrite(g, "CD", 2, 10) == 2);
+    assert(tfs_pread(g, output, sizeof(output), 0) == 12);
+    assert(memcmp(output, "AB", 2) == 0);
+    assert(memcmp(output + 2, zeros, 8) == 0);
+    assert(memcmp(output + 10, "CD", 2) == 0);
+
+    /* A gap that spills the file to blocks */
+    assert(tfs_pwrite(g, "EF", 2, BLOCK_SIZE + 5) == 2);
+    assert(tfs_pread(g, output, sizeof(output), 0) == BLOCK_SIZE + 7);
+    assert(memcmp(output + 10, "CD", 2) == 0);
+    assert(memcmp(output + 12, zeros, BLOCK_SIZE - 7) == 0);
+    assert(memcmp(output + BLOCK_SIZE + 5, "EF", 2) == 0);
+
+    /* The handle's offset is still where tfs_write left it */
+    assert(tfs_read(g, output, 10) == 10);
+    assert(memcmp(output, zeros, 8) == 0);
+    assert(memcmp(output + 8, "CD", 2) == 0);
+    assert(tfs_close(g) != -1);
+
+    /* Gaps past the largest possible file, or larger than the volume, fail
+     * and allocate nothing: half the volume can still be written */
+    g = tfs_open("/gap", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_pwrite(g, "GH", 2, MAX_FILE_BLOCKS * BLOCK_SIZE) == -1);
+    assert(tfs_pwrite(g, "GH", 2, (DATA_BLOCKS + 1) * BLOCK_SIZE) == -1);
+    assert(tfs_pread(g, output, sizeof(output), 0) == 0);
+    static char half[DEFAULT_DATA_BLOCKS / 2 * DEFAULT_BLOCK_SIZE];
+    assert(tfs_pwrite(g, half, sizeof(half), 0) == sizeof(half));
+    assert(tfs_close(g) != -1);
+
+    f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+
+    /* Writes the chunks backwards, the first one past the end of the file */
+    for (int i = THREAD_COUNT - 1; i >= 0; i--) {
+        assert(tfs_pwrite(f, contents + (size_t)i * CHUNK_SIZE, CHUNK_SIZE,
+                          (size_t)i * CHUNK_SIZE) == CHUNK_SIZE);
+    }
+    assert(tfs_pread(f, output, FILE_SIZE, 0) == FILE_SIZE);
+    assert(memcmp(output, contents, FILE_SIZE) == 0);
+    assert(tfs_pread(f, output, FILE_SIZE, FILE_SIZE - 10) == 10);
+    assert(tfs_pread(f, output, FILE_SIZE, FILE_SIZE + 10) == 0);
+    assert(tfs_read(f, output, FILE_SIZE) == FILE_SIZE);
+    assert(memcmp(output, contents, FILE_SIZE) == 0);
+
+    pthread_t tid[THREAD_COUNT];
+    int table[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        table[i] = i;
+        assert(pthread_create(&tid[i], NULL, read_chunk, &table[i]) == 0);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_pread(f, output, FILE_SIZE, 0) == -1);
+    assert(tfs_pwrite(f, output, FILE_SIZE, 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void *read_chunk(void *arg) {
+    int chunk = *((int *)arg);
+    char output[CHUNK_SIZE];
+
+    for (int i = 0; i < ROUNDS; i++) {
+        assert(tfs_pread(f, output, CHUNK_SIZE, (size_t)chunk * CHUNK_SIZE) ==
+               CHUNK_SIZE);
+        assert(memcmp(output, contents + (size_t)chunk * CHUNK_SIZE, CHUNK_SIZE) == 0);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,103 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Several threads write disjoint chunks of one file at the same time (each
+    one through its own handle, in an order that keeps extending the file),
+    while other threads read the chunks back: a chunk must always be read
+    either whole or not at all, and, in the end, the file must hold every
+    chunk where it was written.
+*/
+
+#define WRITER_COUNT (4)
+#define READER_COUNT (2)
+#define CHUNK_SIZE (DEFAULT_BLOCK_SIZE / 2 + 3)
+#define CHUNKS_PER_WRITER (8)
+#define CHUNK_COUNT (WRITER_COUNT * CHUNKS_PER_WRITER)
+#define FILE_SIZE (CHUNK_COUNT * CHUNK_SIZE)
+#define ROUNDS (20)
+
+static char contents[FILE_SIZE];
+
+void *write_chunks(void *arg);
+void *read_chunks(void *arg);
+
+int main() {
+    for (int i = 0; i < FILE_SIZE; i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+
+    pthread_t writers[WRITER_COUNT];
+    pthread_t readers[READER_COUNT];
+    int table[WRITER_COUNT];
+    for (int i = 0; i < WRITER_COUNT; i++) {
+        table[i] = i;
+        assert(pthread_create(&writers[i], NULL, write_chunks, &table[i]) ==
+               0);
+    }
+    for (int i = 0; i < READER_COUNT; i++) {
+        assert(pthread_create(&readers[i], NULL, read_chunks, NULL) == 0);
+    }
+    for (int i = 0; i < WRITER_COUNT; i++) {
+        assert(pthread_join(writers[i], NULL) == 0);
+    }
+    for (int i = 0; i < READER_COUNT; i++) {
+        assert(pthread_join(readers[i], NULL) == 0);
+    }
+
+    static char output[FILE_SIZE];
+    assert(tfs_pread(f, output, FILE_SIZE, 0) == FILE_SIZE);
+    assert(memcmp(output, contents, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void *write_chunks(void *arg) {
+    int writer = *((int *)arg);
+    int f = tfs_open("/f1", 0);
+    assert(f != -1);
+
+    /* The writers' chunks are interleaved, so they share blocks */
+    for (int i = 0; i < CHUNKS_PER_WRITER; i++) {
+        size_t offset = (size_t)(i * WRITER_COUNT + writer) * CHUNK_SIZE;
+        assert(tfs_pwrite(f, contents + offset, CHUNK_SIZE, offset) ==
+               CHUNK_SIZE);
+    }
+
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+void *read_chunks(void *arg) {
+    (void)arg;
+    char output[CHUNK_SIZE];
+    char zeros[CHUNK_SIZE];
+    memset(zeros, 0, sizeof(zeros));
+    int f = tfs_open("/f1", 0);
+    assert(f != -1);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        for (int chunk = 0; chunk < CHUNK_COUNT; chunk++) {
+            size_t offset = (size_t)chunk * CHUNK_SIZE;
+            ssize_t read = tfs_pread(f, output, CHUNK_SIZE, offset);
+            assert(read >= 0 && read <= CHUNK_SIZE);
+            /* Either the chunk was written, or it reads as (part of) a gap */
+            assert(memcmp(output, contents + offset, (size_t)read) == 0 ||
+                   memcmp(output, zeros, (size_t)read) == 0);
+        }
+    }
+
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
@@ -0,0 +1,80 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that a closed file handle is rejected, also after its open file
+    table slot was handed out again, and that many threads opening and closing
+    files concurrently never get the same handle (each thread writes through
+    its handles and reads its own data back).
+*/
+
+#define THREAD_COUNT (8)
+#define ROUNDS (200)
+#define FILE_NAME_MAX_LEN (10)
+
+void *open_close_file(void *arg);
+
+int main() {
+    char buffer[8];
+
+    assert(tfs_init() != -1);
+
+    int stale = tfs_open("/f", TFS_O_CREAT);
+    assert(stale != -1);
+    assert(tfs_close(stale) != -1);
+
+    /* The slot is reused, but with a new handle */
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(f != stale);
+
+    assert(tfs_write(stale, "stale", 5) == -1);
+    assert(tfs_read(stale, buffer, sizeof(buffer)) == -1);
+    assert(tfs_close(stale) == -1);
+
+    assert(tfs_write(f, "fresh", 5) == 5);
+    assert(tfs_close(f) != -1);
+    assert(tfs_close(f) == -1);
+
+    pthread_t tid[THREAD_COUNT];
+    int table[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        table[i] = i;
+        assert(pthread_create(&tid[i], NULL, open_close_file, &table[i]) ==
+               0);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void *open_close_file(void *arg) {
+    int file_i = *((int *)arg);
+    char path[FILE_NAME_MAX_LEN] = {"/t"};
+    sprintf(path + 2, "%d", file_i);
+    char input = (char)('a' + file_i);
+    char output;
+
+    for (int i = 0; i < ROUNDS; i++) {
+        int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, &input, 1) == 1);
+        assert(tfs_close(f) != -1);
+
+        f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_read(f, &output, 1) == 1);
+        assert(output == input);
+        assert(tfs_close(f) != -1);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,106 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Scaling benchmark for the engine's locking: for 1 up to MAX_THREAD_COUNT
+ * threads, each thread creates its own file, fills it one block per
+ * tfs_write call and then reads it back a few times (one block per tfs_read
+ * call). Threads share no file, so with fine-grained locking the throughput
+ * should grow with the thread count. The throughput for each thread count is
+ * printed, once with threads blocking on a busy lock at once and once with
+ * them spinning on it first. */
+
+#define MAX_THREAD_COUNT 8
+#define BLOCKS_PER_THREAD 64
+#define READ_PASSES 4
+#define FILE_NAME_MAX_LEN 10
+
+void *write_and_read_file(void *arg);
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Runs the benchmark for every thread count, with the given lock spins */
+static void run_bench(unsigned lock_spins) {
+    pthread_t tid[MAX_THREAD_COUNT];
+    int table[MAX_THREAD_COUNT];
+    struct timespec start, end;
+    tfs_geometry_t geometry = {
+        .block_size = DEFAULT_BLOCK_SIZE,
+        .data_blocks = DEFAULT_DATA_BLOCKS,
+        .inode_table_size = DEFAULT_INODE_TABLE_SIZE,
+        .max_open_files = DEFAULT_MAX_OPEN_FILES,
+        .huge_pages = false,
+        .image_path = NULL,
+        .lock_spins = lock_spins,
+    };
+
+    for (int thread_count = 1; thread_count <= MAX_THREAD_COUNT;
+         thread_count *= 2) {
+        assert(tfs_init_with_geometry(&geometry) != -1);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < thread_count; ++i) {
+            table[i] = i;
+            if (pthread_create(&tid[i], NULL, write_and_read_file,
+                               &table[i]) != 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        for (int i = 0; i < thread_count; ++i) {
+            pthread_join(tid[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        int ops = thread_count * BLOCKS_PER_THREAD * (1 + READ_PASSES);
+        printf("%-12u %-10d %-10d %.0f\n", lock_spins, thread_count, ops,
+               ops / elapsed_s(&start, &end));
+
+        assert(tfs_destroy() != -1);
+    }
+}
+
+int main() {
+    printf("%-12s %-10s %-10s %s\n", "lock spins", "threads", "ops", "ops/s");
+    run_bench(0);
+    run_bench(DEFAULT_LOCK_SPINS);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void *write_and_read_file(void *arg) {
+    int file_i = *((int *)arg);
+    char input[BLOCK_SIZE];
+    char output[BLOCK_SIZE];
+    memset(input, 'A' + file_i, BLOCK_SIZE);
+
+    char path[FILE_NAME_MAX_LEN] = {"/f"};
+    sprintf(path + 2, "%d", file_i);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < BLOCKS_PER_THREAD; i++) {
+        assert(tfs_write(f, input, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(tfs_close(f) != -1);
+
+    for (int pass = 0; pass < READ_PASSES; pass++) {
+        f = tfs_open(path, 0);
+        assert(f != -1);
+        for (int i = 0; i < BLOCKS_PER_THREAD; i++) {
+            assert(tfs_read(f, output, BLOCK_SIZE) == BLOCK_SIZE);
+            assert(memcmp(input, output, BLOCK_SIZE) == 0);
+        }
+        assert(tfs_close(f) != -1);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,101 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*  Writes a file that spans the direct, indirect and double indirect blocks
+    of its i-node, using writes that aren't aligned to the block size, and
+    checks that it reads back the same (also with unaligned reads).
+    Then truncates it and checks that all of its blocks were freed, by
+    writing the same amount of data again.
+    This is done for the default volume geometry and for a volume with
+    larger blocks.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+static char *input;
+static char *output;
+static size_t file_size;
+
+static void write_file(char const *path, int flags) {
+    size_t write_chunk = BLOCK_SIZE + BLOCK_SIZE / 3;
+    int f = tfs_open(path, flags);
+    assert(f != -1);
+
+    for (size_t written = 0; written < file_size; written += write_chunk) {
+        size_t len = write_chunk;
+        if (len > file_size - written) {
+            len = file_size - written;
+        }
+        assert(tfs_write(f, input + written, len) == len);
+    }
+
+    assert(tfs_close(f) != -1);
+}
+
+static void check_file(char const *path) {
+    size_t read_chunk = BLOCK_SIZE * 3 - 7;
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+
+    memset(output, 0, file_size);
+    size_t read = 0;
+    ssize_t r;
+    while ((r = tfs_read(f, output + read, read_chunk)) > 0) {
+        read += (size_t)r;
+    }
+    assert(r == 0);
+    assert(read == file_size);
+    assert(memcmp(input, output, file_size) == 0);
+
+    assert(tfs_close(f) != -1);
+}
+
+static void run_test(tfs_geometry_t const *geometry) {
+    char *path = "/f1";
+
+    assert(tfs_init_with_geometry(geometry) != -1);
+
+    file_size =
+        (MAX_DIRECT_BLOCKS + INDIRECT_BLOCK_ENTRIES + 20) * BLOCK_SIZE;
+    input = malloc(file_size);
+    output = malloc(file_size);
+    assert(input != NULL && output != NULL);
+    for (size_t i = 0; i < file_size; i++) {
+        input[i] = (char)('A' + i % 26 + i / BLOCK_SIZE % 3);
+    }
+
+    write_file(path, TFS_O_CREAT);
+    check_file(path);
+
+    for (int i = 0; i < 3; i++) {
+        write_file(path, TFS_O_TRUNC);
+        check_file(path);
+    }
+
+    free(input);
+    free(output);
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    tfs_geometry_t geometry = {
+        .block_size = DEFAULT_BLOCK_SIZE,
+        .data_blocks = DEFAULT_DATA_BLOCKS,
+        .inode_table_size = DEFAULT_INODE_TABLE_SIZE,
+        .max_open_files = DEFAULT_MAX_OPEN_FILES,
+        .huge_pages = false,
+    };
+    run_test(&geometry);
+
+    geometry.block_size = 4096;
+    geometry.data_blocks = 4096;
+    geometry.huge_pages = true;
+    run_test(&geometry);
+
+    printf("Successful test.\n");
+
+    return 0;
+}